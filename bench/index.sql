@@ -0,0 +1,54 @@
+-- Lookups through indexes on expressions against full scans, and the cost
+-- of an options argument, which is parsed once per statement.
+--
+-- Indexes on expressions need the functions to be deterministic. From the
+-- repository root:
+--
+--   gcc -O3 -fPIC -shared xml_to_json.c -o xml_to_json.so -DSQLITE
+--   sqlite3 < bench/index.sql
+--
+.load ./xml_to_json
+.timer on
+
+-- 100,000 small orders
+CREATE TABLE doc AS
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<100000)
+SELECT i, '<order id="' || i || '" status="' || (CASE i%3 WHEN 0 THEN 'open' ELSE 'closed' END) || '">'
+       || '<customer><name>Customer ' || (i%1000) || '</name><city>City ' || (i%50) || '</city></customer>'
+       || '<item sku="A' || (i%7) || '"><qty>' || (i%5+1) || '</qty><price>' || (i%100) || '.99</price></item>'
+       || '<item sku="B' || (i%11) || '"><qty>1</qty><price>' || (i%30) || '.50</price></item>'
+       || '<note>Deliver &amp; sign</note>'
+       || '</order>' AS xml
+FROM n;
+
+-- 100 ids to look up. The column has no type, as a TEXT affinity would be
+-- applied to the indexed expression and stop the index being used.
+CREATE TABLE k(id);
+INSERT INTO k
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<100)
+SELECT CAST(i*997%100000 AS TEXT) FROM n;
+
+.print
+.print Full scan, 100 lookups by id
+SELECT count(*) FROM k, doc WHERE xml_extract(doc.xml, '$.order.@id')=k.id;
+SELECT count(*) FROM k, doc WHERE json_extract(xml_to_json(doc.xml), '$.order.@id')=k.id;
+
+.print
+.print Building the indexes
+CREATE INDEX doc_id ON doc(xml_extract(xml, '$.order.@id'));
+CREATE INDEX doc_city ON doc(json_extract(xml_to_json(xml, '{"attribute_prefix":"_"}'), '$.order.customer.city'));
+
+.print
+.print Indexed, 100 lookups by id
+SELECT count(*) FROM k, doc WHERE xml_extract(doc.xml, '$.order.@id')=k.id;
+
+.print
+.print Indexed, one city
+SELECT count(*) FROM doc WHERE json_extract(xml_to_json(xml, '{"attribute_prefix":"_"}'), '$.order.customer.city')='City 7';
+SELECT count(*) FROM doc NOT INDEXED WHERE json_extract(xml_to_json(xml, '{"attribute_prefix":"_"}'), '$.order.customer.city')='City 7';
+
+.print
+.print Options argument
+SELECT count(xml_to_json(xml)) FROM doc;
+SELECT count(xml_to_json(xml, -1)) FROM doc;
+SELECT count(xml_to_json(xml, '{"attribute_prefix":"_","text_key":"value"}')) FROM doc;
@@ -0,0 +1,49 @@
+-- Query throughput of text JSON from xml_to_json() against JSONB from
+-- xml_to_jsonb().
+--
+-- JSONB needs the sqlite3 shell 3.45 or later. From the repository root:
+--
+--   gcc -O3 -fPIC -shared xml_to_json.c -o xml_to_json.so -DSQLITE
+--   sqlite3 < bench/jsonb.sql
+--
+.load ./xml_to_json
+.timer on
+
+-- 100,000 small orders
+CREATE TEMP TABLE doc AS
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<100000)
+SELECT i, '<order id="' || i || '" status="' || (CASE i%3 WHEN 0 THEN 'open' ELSE 'closed' END) || '">'
+       || '<customer><name>Customer ' || (i%1000) || '</name><city>City ' || (i%50) || '</city></customer>'
+       || '<item sku="A' || (i%7) || '"><qty>' || (i%5+1) || '</qty><price>' || (i%100) || '.99</price></item>'
+       || '<item sku="B' || (i%11) || '"><qty>1</qty><price>' || (i%30) || '.50</price></item>'
+       || '<note>Deliver &amp; sign</note>'
+       || '</order>' AS xml
+FROM n;
+
+.print
+.print Conversion
+SELECT count(xml_to_json(xml)) FROM doc;
+SELECT count(xml_to_jsonb(xml)) FROM doc;
+
+CREATE TEMP TABLE conv AS
+SELECT i, xml_to_json(xml) AS txt, xml_to_jsonb(xml) AS bin FROM doc;
+
+.print
+.print Stored column, one field
+SELECT count(*) FROM conv WHERE json_extract(txt, '$.order.customer.city')='City 7';
+SELECT count(*) FROM conv WHERE json_extract(bin, '$.order.customer.city')='City 7';
+
+.print
+.print Stored column, array elements
+SELECT sum(json_extract(txt, '$.order.item[1].price')) FROM conv;
+SELECT sum(json_extract(bin, '$.order.item[1].price')) FROM conv;
+
+.print
+.print Stored column, json_each
+SELECT count(*) FROM conv, json_each(conv.txt, '$.order.item');
+SELECT count(*) FROM conv, json_each(conv.bin, '$.order.item');
+
+.print
+.print Converted per query
+SELECT sum(json_extract(xml_to_json(xml), '$.order.@id')) FROM doc;
+SELECT sum(json_extract(xml_to_jsonb(xml), '$.order.@id')) FROM doc;
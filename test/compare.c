@@ -0,0 +1,599 @@
+/*
+** compare.c - checks the JSON of every conversion against xml_to_json()
+**
+*************************************************************************
+**
+** MIT License, see xml_to_json.c
+**
+*************************************************************************
+**
+** Usage: compare FILE...
+**
+** Each FILE is converted by xml_to_json() with indents of -1 and 2, and
+** the JSON compared with that of:
+**
+**   xml_to_json_parallel()   on 2 and 4 threads
+**   xml_to_json_batch()      of all the FILEs, on 4 threads
+**   xml_to_json_iov()        with the iovecs joined
+**   xml_doc_emit()           of a document from xml_doc_parse()
+**   xml_doc_emit()           of the same document saved by xml_doc_save()
+**                            and loaded by xml_doc_load()
+**
+** The minified JSON is also compared with that decoded from
+** xml_to_cbor(), xml_to_msgpack() and xml_to_jsonb(), after the strings
+** of both are written with the same escapes. A generated document is
+** checked along with the FILEs, with arrays, attributes and text large
+** enough to need every size of header in the binary formats.
+**
+** Every document is converted in parallel, however small, as
+** PARALLEL_MIN_SIZE is 0. Each difference is reported on standard error
+** with the offset of the first byte that differs, and the exit status is
+** 1 if there were any.
+**
+*************************************************************************
+**
+** To compile and run with gcc, from the repository root:
+**
+**   gcc -O2 test/compare.c -o compare -lpthread
+**   ./compare *.xml
+**
+*************************************************************************
+*/
+
+#define PARALLEL_MIN_SIZE 0
+#ifndef THREADS
+#define THREADS
+#endif
+#include "../xml_to_json.c"
+#include <stdarg.h>
+
+static int nTest = 0;
+static int nFail = 0;
+
+static char *read_file(const char *zPath){
+  FILE *f = fopen(zPath, "rb");
+  char *z;
+  long n;
+  
+  if( !f )
+    return 0;
+  fseek(f, 0, SEEK_END);
+  n = ftell(f);
+  rewind(f);
+  z = malloc(n+1);
+  if( z && fread(z, 1, n, f)!=(size_t)n ){
+    free(z);
+    z = 0;
+  }
+  fclose(f);
+  if( z )
+    z[n] = 0;
+  return z;
+}
+
+// Compare JSON with the expected JSON, reporting any difference
+static void check(const char *zFile, const char *zHow, int indent, const char *zExpect, const char *zJson){
+  int i;
+  
+  nTest++;
+  if( zJson && strcmp(zExpect, zJson)==0 )
+    return;
+  nFail++;
+  if( !zJson ){
+    fprintf(stderr, "%s: %s, indent %d: null\n", zFile, zHow, indent);
+    return;
+  }
+  for(i=0; zExpect[i] && zExpect[i]==zJson[i]; i++);
+  fprintf(stderr, "%s: %s, indent %d: differs at byte %d\n", zFile, zHow, indent, i);
+}
+
+// JSON text being built
+typedef struct canon {
+  char *z;
+  size_t n;
+  size_t nAlloc;
+} canon;
+
+static void canon_append(canon *c, const char *z, size_t n){
+  if( c->n+n+1>c->nAlloc ){
+    c->nAlloc = (c->n+n+1)*2;
+    c->z = realloc(c->z, c->nAlloc);
+  }
+  memcpy(&c->z[c->n], z, n);
+  c->n += n;
+  c->z[c->n] = 0;
+}
+
+// Write a string with the escapes used for every JSON compared: only
+// quotes, backslashes and control characters are escaped, as \u00XX
+static void canon_string(canon *c, const unsigned char *z, size_t n){
+  char zHex[8];
+  size_t i;
+  
+  canon_append(c, "\"", 1);
+  for(i=0; i<n; i++){
+    if( z[i]=='"' || z[i]=='\\' ){
+      canon_append(c, "\\", 1);
+      canon_append(c, (const char *)&z[i], 1);
+    }else if( z[i]<0x20 ){
+      snprintf(zHex, sizeof(zHex), "\\u%04x", z[i]);
+      canon_append(c, zHex, 6);
+    }else
+      canon_append(c, (const char *)&z[i], 1);
+  }
+  canon_append(c, "\"", 1);
+}
+
+// Decode the JSON escapes of a string ending at a quote, or at n bytes
+static size_t unescape(canon *c, const char *z, size_t n){
+  unsigned char zUtf[4];
+  unsigned u;
+  size_t i;
+  
+  for(i=0; i<n && z[i]!='"'; i++){
+    if( z[i]!='\\' || i+1>=n ){
+      canon_append(c, &z[i], 1);
+      continue;
+    }
+    switch( z[++i] ){
+      case 'b': canon_append(c, "\b", 1); break;
+      case 'f': canon_append(c, "\f", 1); break;
+      case 'n': canon_append(c, "\n", 1); break;
+      case 'r': canon_append(c, "\r", 1); break;
+      case 't': canon_append(c, "\t", 1); break;
+      case 'u':
+        if( i+4>=n || sscanf(&z[i+1], "%4x", &u)!=1 )
+          return i;
+        i += 4;
+        if( u<0x80 ){
+          zUtf[0] = u;
+          canon_append(c, (const char *)zUtf, 1);
+        }else if( u<0x800 ){
+          zUtf[0] = 0xC0 | (u>>6);
+          zUtf[1] = 0x80 | (u&0x3F);
+          canon_append(c, (const char *)zUtf, 2);
+        }else{
+          zUtf[0] = 0xE0 | (u>>12);
+          zUtf[1] = 0x80 | ((u>>6)&0x3F);
+          zUtf[2] = 0x80 | (u&0x3F);
+          canon_append(c, (const char *)zUtf, 3);
+        }
+        break;
+      default: canon_append(c, &z[i], 1); break;
+    }
+  }
+  return i;
+}
+
+// Rewrite JSON text without whitespace and with the strings escaped by
+// canon_string()
+static char *canon_json(const char *zJson){
+  canon c = {0, 0, 0};
+  canon s;
+  size_t n = strlen(zJson);
+  size_t i;
+  
+  canon_append(&c, "", 0);
+  for(i=0; i<n; i++){
+    if( zJson[i]=='"' ){
+      s.z = 0;
+      s.n = s.nAlloc = 0;
+      canon_append(&s, "", 0);
+      i += 1+unescape(&s, &zJson[i+1], n-i-1);
+      canon_string(&c, (const unsigned char *)s.z, s.n);
+      free(s.z);
+    }else if( !strchr(" \t\r\n", zJson[i]) )
+      canon_append(&c, &zJson[i], 1);
+  }
+  return c.z;
+}
+
+// Read an unsigned big endian number of n bytes
+static unsigned long long read_be(const unsigned char *z, int n){
+  unsigned long long u = 0;
+  
+  while( n-- )
+    u = (u<<8) | *z++;
+  return u;
+}
+
+// Write a number
+static void canon_number(canon *c, const char *zFormat, ...){
+  char zNum[32];
+  va_list ap;
+  
+  va_start(ap, zFormat);
+  vsnprintf(zNum, sizeof(zNum), zFormat, ap);
+  va_end(ap);
+  canon_append(c, zNum, strlen(zNum));
+}
+
+// Decode the CBOR item at *pi as JSON. Returns 0 if it is not valid.
+static int cbor_decode(canon *c, const unsigned char *z, size_t n, size_t *pi){
+  unsigned long long u;
+  size_t i = *pi;
+  int major;
+  int minor;
+  int nArg;
+  double r;
+  
+  if( i>=n )
+    return 0;
+  major = z[i]>>5;
+  minor = z[i++]&0x1F;
+  nArg = minor<24 ? 0 : minor<28 ? 1<<(minor-24) : -1;
+  if( nArg<0 || i+nArg>n )
+    return 0;
+  u = nArg ? read_be(&z[i], nArg) : (unsigned long long)minor;
+  i += nArg;
+  switch( major ){
+    case 0:
+      canon_number(c, "%llu", u);
+      break;
+    case 1:
+      canon_number(c, "-%llu", u+1);
+      break;
+    case 3:
+      if( u>n-i )
+        return 0;
+      canon_string(c, &z[i], u);
+      i += u;
+      break;
+    case 4:
+    case 5:
+      canon_append(c, major==4 ? "[" : "{", 1);
+      for(; u; u--){
+        if( !cbor_decode(c, z, n, &i) )
+          return 0;
+        if( major==5 ){
+          canon_append(c, ":", 1);
+          if( !cbor_decode(c, z, n, &i) )
+            return 0;
+        }
+        if( u>1 )
+          canon_append(c, ",", 1);
+      }
+      canon_append(c, major==4 ? "]" : "}", 1);
+      break;
+    case 7:
+      if( minor==20 )
+        canon_append(c, "false", 5);
+      else if( minor==21 )
+        canon_append(c, "true", 4);
+      else if( minor==22 )
+        canon_append(c, "null", 4);
+      else if( minor==27 ){
+        memcpy(&r, &u, 8);
+        canon_number(c, "%.17g", r);
+      }else
+        return 0;
+      break;
+    default:
+      return 0;
+  }
+  *pi = i;
+  return 1;
+}
+
+// Decode the MessagePack item at *pi as JSON. Returns 0 if it is not valid.
+static int msgpack_decode(canon *c, const unsigned char *z, size_t n, size_t *pi){
+  unsigned long long u;
+  size_t i = *pi;
+  int type;
+  int nArg = 0;
+  double r;
+  
+  if( i>=n )
+    return 0;
+  type = z[i++];
+  if( type<0x80 ){
+    canon_number(c, "%d", type);
+  }else if( type>=0xE0 ){
+    canon_number(c, "%d", type-0x100);
+  }else if( type==0xC0 ){
+    canon_append(c, "null", 4);
+  }else if( type==0xC2 || type==0xC3 ){
+    canon_append(c, type==0xC2 ? "false" : "true", type==0xC2 ? 5 : 4);
+  }else if( type>=0xCC && type<=0xD3 ){
+    nArg = 1<<((type-0xCC)&3);
+    if( i+nArg>n )
+      return 0;
+    u = read_be(&z[i], nArg);
+    i += nArg;
+    if( type<0xD0 )
+      canon_number(c, "%llu", u);
+    else
+      canon_number(c, "%lld", (long long)(u<<(64-8*nArg))>>(64-8*nArg));
+  }else if( type==0xCB ){
+    if( i+8>n )
+      return 0;
+    u = read_be(&z[i], 8);
+    i += 8;
+    memcpy(&r, &u, 8);
+    canon_number(c, "%.17g", r);
+  }else if( (type>=0xA0 && type<0xC0) || (type>=0xD9 && type<=0xDB) ){
+    nArg = type<0xC0 ? 0 : 1<<(type-0xD9);
+    if( i+nArg>n )
+      return 0;
+    u = nArg ? read_be(&z[i], nArg) : (unsigned long long)(type&0x1F);
+    i += nArg;
+    if( u>n-i )
+      return 0;
+    canon_string(c, &z[i], u);
+    i += u;
+  }else if( type<0xA0 || (type>=0xDC && type<=0xDF) ){
+    int isMap = type<0x90 || type>=0xDE;
+    nArg = type<0xA0 ? 0 : type&1 ? 4 : 2;
+    if( i+nArg>n )
+      return 0;
+    u = nArg ? read_be(&z[i], nArg) : (unsigned long long)(type&0x0F);
+    i += nArg;
+    canon_append(c, isMap ? "{" : "[", 1);
+    for(; u; u--){
+      if( !msgpack_decode(c, z, n, &i) )
+        return 0;
+      if( isMap ){
+        canon_append(c, ":", 1);
+        if( !msgpack_decode(c, z, n, &i) )
+          return 0;
+      }
+      if( u>1 )
+        canon_append(c, ",", 1);
+    }
+    canon_append(c, isMap ? "}" : "]", 1);
+  }else
+    return 0;
+  *pi = i;
+  return 1;
+}
+
+// Decode the JSONB element at *pi as JSON. Returns 0 if it is not valid.
+static int jsonb_decode(canon *c, const unsigned char *z, size_t n, size_t *pi){
+  unsigned long long u;
+  size_t i = *pi;
+  size_t iEnd;
+  canon s;
+  int type;
+  int nArg;
+  
+  if( i>=n )
+    return 0;
+  type = z[i]&0x0F;
+  u = z[i++]>>4;
+  nArg = u<12 ? 0 : 1<<(u-12);
+  if( i+nArg>n )
+    return 0;
+  if( nArg )
+    u = read_be(&z[i], nArg);
+  i += nArg;
+  if( u>n-i )
+    return 0;
+  iEnd = i+u;
+  switch( type ){
+    case JSONB_NULL:
+      canon_append(c, "null", 4);
+      break;
+    case JSONB_TRUE:
+      canon_append(c, "true", 4);
+      break;
+    case JSONB_FALSE:
+      canon_append(c, "false", 5);
+      break;
+    case JSONB_INT:
+    case JSONB_FLOAT:
+      canon_append(c, (const char *)&z[i], u);
+      break;
+    case JSONB_TEXT:
+      canon_string(c, &z[i], u);
+      break;
+    case JSONB_TEXTJ:
+      s.z = 0;
+      s.n = s.nAlloc = 0;
+      canon_append(&s, "", 0);
+      unescape(&s, (const char *)&z[i], u);
+      canon_string(c, (const unsigned char *)s.z, s.n);
+      free(s.z);
+      break;
+    case JSONB_ARRAY:
+    case JSONB_OBJECT:
+      canon_append(c, type==JSONB_ARRAY ? "[" : "{", 1);
+      while( i<iEnd ){
+        if( !jsonb_decode(c, z, iEnd, &i) )
+          return 0;
+        if( type==JSONB_OBJECT ){
+          canon_append(c, ":", 1);
+          if( !jsonb_decode(c, z, iEnd, &i) )
+            return 0;
+        }
+        if( i<iEnd )
+          canon_append(c, ",", 1);
+      }
+      canon_append(c, type==JSONB_ARRAY ? "]" : "}", 1);
+      break;
+    default:
+      return 0;
+  }
+  *pi = iEnd;
+  return 1;
+}
+
+// Decode a whole binary document as JSON, or return null if it is not
+// valid. A null document, as for an empty XML document, is an empty string.
+static char *binary_to_json(int (*xDecode)(canon*, const unsigned char*, size_t, size_t*), const unsigned char *z, int n){
+  canon c = {0, 0, 0};
+  size_t i = 0;
+  
+  canon_append(&c, "", 0);
+  if( z && (!xDecode(&c, z, n, &i) || i!=(size_t)n) ){
+    free(c.z);
+    return 0;
+  }
+  return c.z;
+}
+
+// Generate a document with arrays of 70,000 and 300 items, elements with
+// 70,000 and 300 attributes, and text of 70,000 bytes, so that every size
+// of header is written, and an array of elements with text and children
+static char *generate_xml(void){
+  canon c = {0, 0, 0};
+  char zItem[64];
+  int i;
+  
+  canon_append(&c, "<r>", 3);
+  for(i=0; i<70000; i++){
+    snprintf(zItem, sizeof(zItem), "<i>%d</i>", i);
+    canon_append(&c, zItem, strlen(zItem));
+  }
+  canon_append(&c, "<j>", 3);
+  for(i=0; i<300; i++)
+    canon_append(&c, "<k>x</k>", 8);
+  canon_append(&c, "</j><m", 6);
+  for(i=0; i<70000; i++){
+    snprintf(zItem, sizeof(zItem), " a%d=\"%d\"", i, i);
+    canon_append(&c, zItem, strlen(zItem));
+  }
+  canon_append(&c, "/><n", 4);
+  for(i=0; i<300; i++){
+    snprintf(zItem, sizeof(zItem), " a%d=\"%d\"", i, i);
+    canon_append(&c, zItem, strlen(zItem));
+  }
+  canon_append(&c, ">", 1);
+  for(i=0; i<70000; i++)
+    canon_append(&c, &"abcdefghij"[i%10], 1);
+  canon_append(&c, "</n><t>a<u/></t><t>b<u/>c</t><t/></r>", 37);
+  return c.z;
+}
+
+// Join the iovecs of xml_to_json_iov() into a string
+static char *iov_join(struct iovec *iov, int nIov){
+  size_t n = 0;
+  char *z;
+  int i;
+  
+  for(i=0; i<nIov; i++)
+    n += iov[i].iov_len;
+  z = malloc(n+1);
+  n = 0;
+  for(i=0; i<nIov; i++){
+    memcpy(&z[n], iov[i].iov_base, iov[i].iov_len);
+    n += iov[i].iov_len;
+  }
+  z[n] = 0;
+  return z;
+}
+
+int main(int argc, char **argv){
+  char **aXml;
+  char **azName;
+  char **azExpect;
+  char *zCanon;
+  unsigned char *zBinary;
+  int *aOffset;
+  char *zBatch;
+  char *zJson;
+  char zTree[] = "/tmp/compareXXXXXX";
+  struct iovec *iov;
+  xml_doc doc;
+  xml_doc loaded;
+  int nIov;
+  int nByte;
+  int nXml = argc;
+  int indent;
+  int fd;
+  int i;
+  
+  if( argc<2 ){
+    fprintf(stderr, "usage: compare FILE...\n");
+    return 1;
+  }
+  fd = mkstemp(zTree);
+  if( fd<0 ){
+    fprintf(stderr, "compare: cannot create tree file\n");
+    return 1;
+  }
+  close(fd);
+  
+  aXml = malloc(nXml*sizeof(char *));
+  azName = malloc(nXml*sizeof(char *));
+  azExpect = malloc(nXml*sizeof(char *));
+  aOffset = malloc((nXml+1)*sizeof(int));
+  for(i=0; i<argc-1; i++){
+    azName[i] = argv[i+1];
+    aXml[i] = read_file(argv[i+1]);
+    if( !aXml[i] ){
+      fprintf(stderr, "compare: cannot read file: %s\n", argv[i+1]);
+      return 1;
+    }
+  }
+  azName[i] = "generated document";
+  aXml[i] = generate_xml();
+  
+  for(indent=-1; indent<=2; indent+=3){
+    for(i=0; i<nXml; i++)
+      azExpect[i] = xml_to_json(aXml[i], indent);
+  
+    zBatch = xml_to_json_batch(aXml, nXml, aOffset, indent, 4);
+    for(i=0; i<nXml; i++)
+      check(azName[i], "batch", indent, azExpect[i], zBatch ? &zBatch[aOffset[i]] : 0);
+    free(zBatch);
+  
+    for(i=0; i<nXml; i++){
+      zJson = xml_to_json_parallel(aXml[i], indent, 2);
+      check(azName[i], "parallel on 2 threads", indent, azExpect[i], zJson);
+      free(zJson);
+      zJson = xml_to_json_parallel(aXml[i], indent, 4);
+      check(azName[i], "parallel on 4 threads", indent, azExpect[i], zJson);
+      free(zJson);
+  
+      iov = xml_to_json_iov(aXml[i], indent, &nIov);
+      zJson = iov_join(iov, nIov);
+      check(azName[i], "iovecs", indent, azExpect[i], zJson);
+      free(zJson);
+      free(iov);
+  
+      doc = xml_doc_parse(aXml[i], 0);
+      zJson = xml_doc_emit(doc, XML_DOC_JSON, indent, 0);
+      check(azName[i], "parsed document", indent, azExpect[i], zJson);
+      free(zJson);
+  
+      loaded = xml_doc_save(doc, zTree) ? xml_doc_load(zTree) : 0;
+      zJson = loaded ? xml_doc_emit(loaded, XML_DOC_JSON, indent, 0) : 0;
+      check(azName[i], "tree file", indent, azExpect[i], zJson);
+      free(zJson);
+      xml_doc_free(loaded);
+      xml_doc_free(doc);
+  
+      if( indent<0 ){
+        zCanon = canon_json(azExpect[i]);
+        zBinary = xml_to_cbor(aXml[i], &nByte);
+        zJson = binary_to_json(cbor_decode, zBinary, nByte);
+        check(azName[i], "CBOR", indent, zCanon, zJson);
+        free(zJson);
+        free(zBinary);
+        zBinary = xml_to_msgpack(aXml[i], &nByte);
+        zJson = binary_to_json(msgpack_decode, zBinary, nByte);
+        check(azName[i], "MessagePack", indent, zCanon, zJson);
+        free(zJson);
+        free(zBinary);
+        zBinary = xml_to_jsonb(aXml[i], &nByte);
+        zJson = binary_to_json(jsonb_decode, zBinary, nByte);
+        check(azName[i], "JSONB", indent, zCanon, zJson);
+        free(zJson);
+        free(zBinary);
+        free(zCanon);
+      }
+  
+      free(azExpect[i]);
+    }
+  }
+  
+  remove(zTree);
+  for(i=0; i<nXml; i++)
+    free(aXml[i]);
+  free(aXml);
+  free(azName);
+  free(azExpect);
+  free(aOffset);
+  printf("%d comparisons, %d failed\n", nTest, nFail);
+  return nFail ? 1 : 0;
+}
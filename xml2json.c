@@ -0,0 +1,479 @@
+/*
+** xml2json.c - converts XML files to JSON on a pool of threads
+**
+*************************************************************************
+**
+** MIT License, see xml_to_json.c
+**
+*************************************************************************
+**
+** Usage: xml2json [OPTIONS] [FILE|DIRECTORY]...
+**
+** Each FILE is converted to JSON, and each DIRECTORY is searched for files
+** ending in .xml, in name order, including its subdirectories. The JSON is
+** written to standard output as NDJSON, one line per file in the order of
+** the files, unless -o is given:
+**
+**   -o DIR         Write the JSON of each file to a file of its own in DIR,
+**                  named as the file with .xml replaced by .json, and in
+**                  the same subdirectory for files found in a DIRECTORY
+**   -j THREADS     Threads converting files, one per CPU by default
+**   -i INDENT      Indent of the JSON written with -o, or -1 for minified
+**                  JSON (default). NDJSON is always minified
+**   -s SCHEMA      File with the schema of the documents, as written by
+**                  xml2schema
+**   -t             Output numbers and booleans as JSON numbers and booleans
+**   -v             Report the size and throughput of each file
+**
+** FILE may be - to read standard input, which is read if there are no
+** files. e.g.
+**
+**   xml2json -j 8 feeds > feeds.ndjson
+**   xml2json -o json -i 2 feeds
+**
+** Files are converted on a work stealing pool of threads, each reusing its
+** own arena and buffers from one file to the next. For NDJSON, files are
+** converted a window at a time, and each window is written in order once
+** converted, so no more than a window of JSON is held in memory. A file
+** that cannot be read or is not XML is reported and written as null, so
+** that line N is always the JSON of the Nth file. The total throughput is
+** reported on standard error.
+**
+*************************************************************************
+**
+** To compile with gcc:
+**
+**   gcc -O2 xml2json.c -o xml2json -lpthread
+**
+*************************************************************************
+*/
+
+#ifndef THREADS
+#define THREADS
+#endif
+#include "xml_to_json.c"
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define XML2JSON_WINDOW 1024            // Files converted per NDJSON window
+#define XML2JSON_WINDOW_BYTES (64*1024*1024) // XML that ends a window early
+
+// State kept by each worker
+typedef struct json_worker *json_worker;
+struct json_worker{
+  struct arena arena;                   // Arena reused for each file
+  char *xml;                            // XML of the file being converted
+  int nXmlAlloc;                        // Allocated size of xml
+  char *json;                           // JSON of the files converted in this window
+  int nJson;                            // Length of json
+  int nJsonAlloc;                       // Allocated size of json
+};
+
+typedef struct json_file *json_file;
+struct json_file{
+  char *zPath;                          // Path of the file, or - for standard input
+  char *zName;                          // Path of its JSON, relative to the -o directory
+  long long nXml;                       // Size of the file
+  int iWorker;                          // Worker that converted the file
+  int iStart;                           // Offset of the JSON in the worker's json
+  int nJson;                            // Length of the JSON
+  double secs;                          // Time taken to read and convert the file
+  const char *zError;                   // Why the file was not converted, or null
+};
+
+typedef struct json_run *json_run;
+struct json_run{
+  json_file aFile;                      // Files to convert
+  int nFile;                            // Number of files
+  int nFileAlloc;                       // Allocated size of aFile
+  json_file aWindow;                    // First file of the window being converted
+  json_worker aWorker;                  // State of each worker
+  const char *zDir;                     // Directory of -o, or null for NDJSON
+  struct xml_options options;           // Conversion options
+};
+
+static void usage(void){
+  fprintf(stderr,
+    "usage: xml2json [OPTIONS] [FILE|DIRECTORY]...\n"
+    "  -o DIR      write the JSON of each file to DIR instead of NDJSON\n"
+    "  -j THREADS  threads converting files, one per CPU by default\n"
+    "  -i INDENT   indent of the JSON written with -o, -1 by default\n"
+    "  -s SCHEMA   file with the schema of the documents\n"
+    "  -t          output numbers and booleans as JSON numbers and booleans\n"
+    "  -v          report the throughput of each file\n");
+  exit(1);
+}
+
+static void *json_malloc(size_t n){
+  void *p = malloc(n ? n : 1);
+  if( !p ){
+    fprintf(stderr, "xml2json: out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+static double json_seconds(struct timespec *t0, struct timespec *t1){
+  return (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec)/1e9;
+}
+
+//
+// json_add
+//
+// Add a file to convert. Its JSON is written to zName with .xml replaced
+// by .json if -o is given.
+//
+static void json_add(json_run p, const char *zPath, const char *zName, long long nXml){
+  json_file f;
+  int nPath = strlen(zPath);
+  int nName = strlen(zName);
+  
+  if( p->nFile==p->nFileAlloc ){
+    p->nFileAlloc = 2*p->nFileAlloc + 64;
+    p->aFile = realloc(p->aFile, p->nFileAlloc*sizeof(struct json_file));
+    if( !p->aFile ){
+      fprintf(stderr, "xml2json: out of memory\n");
+      exit(1);
+    }
+  }
+  f = &p->aFile[p->nFile++];
+  memset(f, 0, sizeof(*f));
+  f->zPath = json_malloc(nPath+1);
+  memcpy(f->zPath, zPath, nPath+1);
+  if( nName>4 && strcmp(&zName[nName-4], ".xml")==0 )
+    nName -= 4;
+  f->zName = json_malloc(nName+6);
+  memcpy(f->zName, zName, nName);
+  memcpy(&f->zName[nName], ".json", 6);
+  f->nXml = nXml;
+}
+
+static int json_compare(const void *a, const void *b){
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+//
+// json_add_directory
+//
+// Add the files ending in .xml in directory zPath and its subdirectories,
+// in name order. Their JSON is written to the same subdirectory of the -o
+// directory, which is zName. Hidden files and directories, and links to
+// directories, are skipped.
+//
+static void json_add_directory(json_run p, const char *zPath, const char *zName){
+  DIR *d = opendir(zPath);
+  struct dirent *e;
+  struct stat st;
+  char **azEntry = 0;
+  int nEntry = 0;
+  int nAlloc = 0;
+  char *zChild;
+  char *zChildName;
+  int nPath = strlen(zPath);
+  int nName = strlen(zName);
+  int n;
+  int i;
+  
+  if( !d ){
+    fprintf(stderr, "xml2json: cannot open directory: %s\n", zPath);
+    exit(1);
+  }
+  while( (e = readdir(d))!=0 ){
+    if( e->d_name[0]=='.' )
+      continue;
+    if( nEntry==nAlloc ){
+      nAlloc = 2*nAlloc + 16;
+      azEntry = realloc(azEntry, nAlloc*sizeof(char *));
+      if( !azEntry ){
+        fprintf(stderr, "xml2json: out of memory\n");
+        exit(1);
+      }
+    }
+    n = strlen(e->d_name);
+    azEntry[nEntry] = json_malloc(n+1);
+    memcpy(azEntry[nEntry++], e->d_name, n+1);
+  }
+  closedir(d);
+  qsort(azEntry, nEntry, sizeof(char *), json_compare);
+  
+  for(i=0; i<nEntry; i++){
+    n = strlen(azEntry[i]);
+    zChild = json_malloc(nPath+n+2);
+    zChildName = json_malloc(nName+n+2);
+    sprintf(zChild, "%s/%s", zPath, azEntry[i]);
+    sprintf(zChildName, "%s%s%s", zName, nName ? "/" : "", azEntry[i]);
+    if( lstat(zChild, &st)==0 && S_ISDIR(st.st_mode) ){
+      json_add_directory(p, zChild, zChildName);
+    }else if( n>4 && strcmp(&azEntry[i][n-4], ".xml")==0
+           && stat(zChild, &st)==0 && S_ISREG(st.st_mode) ){
+      json_add(p, zChild, zChildName, st.st_size);
+    }
+    free(zChild);
+    free(zChildName);
+    free(azEntry[i]);
+  }
+  free(azEntry);
+}
+
+//
+// json_write
+//
+// Write the JSON of a file to zName in directory zDir, creating the
+// directories on its path as needed. Returns 0 on error.
+//
+static int json_write(const char *zDir, const char *zName, const char *json, int nJson){
+  char *zPath = json_malloc(strlen(zDir)+strlen(zName)+2);
+  FILE *f;
+  int ok;
+  int i;
+  
+  sprintf(zPath, "%s/%s", zDir, zName);
+  for(i=1; zPath[i]; i++){
+    if( zPath[i]=='/' ){
+      zPath[i] = 0;
+      mkdir(zPath, 0777);
+      zPath[i] = '/';
+    }
+  }
+  
+  f = fopen(zPath, "wb");
+  free(zPath);
+  if( !f )
+    return 0;
+  ok = fwrite(json, 1, nJson, f)==(size_t)nJson && fputc('\n', f)!=EOF;
+  return fclose(f)==0 && ok;
+}
+
+//
+// json_convert
+//
+// Read and convert file i of the window into worker iWorker's buffer.
+// With -o, the JSON is written by the worker, and the buffer reused for
+// the next file.
+//
+static void json_convert(void *pArg, int iWorker, int i){
+  json_run p = (json_run)pArg;
+  json_worker w = &p->aWorker[iWorker];
+  json_file f = &p->aWindow[i];
+  struct json_buffer out;
+  struct timespec t0;
+  struct timespec t1;
+  element root;
+  char *zNew;
+  long long nAlloc;
+  FILE *in;
+  int n;
+  
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  f->nXml = 0;
+  in = strcmp(f->zPath, "-")==0 ? stdin : fopen(f->zPath, "rb");
+  if( !in ){
+    f->zError = "cannot open file";
+    return;
+  }
+  n = xml_read_file(in, &w->xml, &w->nXmlAlloc);
+  if( in!=stdin )
+    fclose(in);
+  if( n<0 ){
+    f->zError = "read error";
+    return;
+  }
+  f->nXml = n;
+  
+  arena_reset(&w->arena);
+  root = xml_parse(w->xml, n, 0, &w->arena);
+  if( !root ){
+    f->zError = w->arena.nomem ? "out of memory" : "not XML";
+    return;
+  }
+  if( !p->options.schema )
+    xml_group(root, 0, 0);
+  else if( !xml_group_schema(root, p->options.schema, 0) ){
+    f->zError = "out of memory";
+    return;
+  }
+  
+  // A document without elements is null, so that it is still valid JSON
+  memset(&out, 0, sizeof(out));
+  json_output(root, root->next, 0, &out, &p->options);
+  if( out.nJson==0 )
+    out.nJson = 4;
+  if( p->zDir )
+    w->nJson = 0;
+  if( w->nJson+out.nJson+1 > w->nJsonAlloc ){
+    nAlloc = 2*((long long)w->nJson+out.nJson+1);
+    zNew = nAlloc>0x7FFFFFFF ? 0 : realloc(w->json, nAlloc);
+    if( !zNew ){
+      fprintf(stderr, "xml2json: out of memory\n");
+      exit(1);
+    }
+    w->json = zNew;
+    w->nJsonAlloc = nAlloc;
+  }
+  
+  out.json = &w->json[w->nJson];
+  out.nJson = 0;
+  out.depth = 0;
+  json_output(root, root->next, 0, &out, &p->options);
+  if( out.nJson==0 ){
+    memcpy(out.json, "null", 4);
+    out.nJson = 4;
+  }
+  
+  f->iWorker = iWorker;
+  f->iStart = w->nJson;
+  f->nJson = out.nJson;
+  w->nJson += out.nJson;
+  
+  if( p->zDir && !json_write(p->zDir, f->zName, out.json, out.nJson) )
+    f->zError = "cannot write JSON";
+  
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  f->secs = json_seconds(&t0, &t1);
+}
+
+int main(int argc, char **argv){
+  struct json_run r;
+  struct stat st;
+  struct timespec t0;
+  struct timespec t1;
+  json_file f;
+  const char *zSchema = 0;
+  const char *zBase;
+  char *z = 0;
+  int nAlloc = 0;
+  int nThread = sysconf(_SC_NPROCESSORS_ONLN);
+  int indent = -1;
+  int typed = 0;
+  int verbose = 0;
+  int nError = 0;
+  long long nXml = 0;
+  long long nWindow;
+  double secs;
+  FILE *in;
+  int i;
+  int j;
+  int k;
+  
+  memset(&r, 0, sizeof(r));
+  
+  // Options
+  for(i=1; i<argc && argv[i][0]=='-' && argv[i][1]; i++){
+    if( argv[i][2] )
+      usage();
+    if( argv[i][1]=='t' ){
+      typed = 1;
+      continue;
+    }
+    if( argv[i][1]=='v' ){
+      verbose = 1;
+      continue;
+    }
+    if( i+1==argc )
+      usage();
+    switch( argv[i][1] ){
+      case 'o': r.zDir = argv[++i]; break;
+      case 'j': nThread = atoi(argv[++i]); break;
+      case 'i': indent = atoi(argv[++i]); break;
+      case 's': zSchema = argv[++i]; break;
+      default:
+        usage();
+    }
+  }
+  if( nThread<1 )
+    nThread = 1;
+  
+  xml_options_init(&r.options, r.zDir ? indent : -1);
+  r.options.typed = typed;
+  if( zSchema ){
+    in = fopen(zSchema, "rb");
+    if( !in || xml_read_file(in, &z, &nAlloc)<0 ){
+      fprintf(stderr, "xml2json: cannot read schema: %s\n", zSchema);
+      return 1;
+    }
+    fclose(in);
+    r.options.schema = xml_schema_compile(z);
+    free(z);
+    if( !r.options.schema ){
+      fprintf(stderr, "xml2json: bad schema: %s\n", zSchema);
+      return 1;
+    }
+  }
+  
+  // Files, named by their path relative to the argument
+  if( i==argc )
+    json_add(&r, "-", "stdin", 0);
+  for(; i<argc; i++){
+    if( strcmp(argv[i], "-")==0 ){
+      json_add(&r, "-", "stdin", 0);
+    }else if( stat(argv[i], &st)!=0 ){
+      fprintf(stderr, "xml2json: cannot open file: %s\n", argv[i]);
+      return 1;
+    }else if( S_ISDIR(st.st_mode) ){
+      json_add_directory(&r, argv[i], "");
+    }else{
+      zBase = strrchr(argv[i], '/');
+      json_add(&r, argv[i], zBase ? zBase+1 : argv[i], st.st_size);
+    }
+  }
+  
+  r.aWorker = json_malloc(nThread*sizeof(struct json_worker));
+  memset(r.aWorker, 0, nThread*sizeof(struct json_worker));
+  
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for(i=0; i<r.nFile; i=j){
+    // With -o nothing is held between files, so there is a single window
+    nWindow = 0;
+    for(j=i; j<r.nFile && (r.zDir || (j-i<XML2JSON_WINDOW && nWindow<XML2JSON_WINDOW_BYTES)); j++)
+      nWindow += r.aFile[j].nXml;
+  
+    r.aWindow = &r.aFile[i];
+    for(k=0; k<nThread; k++)
+      r.aWorker[k].nJson = 0;
+    pool_run(nThread, j-i, json_convert, &r);
+  
+    for(k=i; k<j; k++){
+      f = &r.aFile[k];
+      if( f->zError ){
+        fprintf(stderr, "xml2json: %s: %s\n", f->zPath, f->zError);
+        nError++;
+      }else if( verbose ){
+        fprintf(stderr, "%s: %lld bytes in %.3f s, %.1f MB/s\n", f->zPath, f->nXml,
+                f->secs, f->secs>0 ? f->nXml/f->secs/1e6 : 0);
+      }
+      if( !r.zDir ){
+        if( f->nJson )
+          fwrite(&r.aWorker[f->iWorker].json[f->iStart], 1, f->nJson, stdout);
+        else
+          fputs("null", stdout);
+        putchar('\n');
+      }
+      nXml += f->nXml;
+    }
+  }
+  if( fflush(stdout) ){
+    fprintf(stderr, "xml2json: cannot write JSON\n");
+    return 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  
+  secs = json_seconds(&t0, &t1);
+  fprintf(stderr, "%d files, %.1f MB in %.2f s, %.1f MB/s\n",
+          r.nFile, nXml/1e6, secs, secs>0 ? nXml/secs/1e6 : 0);
+  
+  for(k=0; k<nThread; k++){
+    arena_free(&r.aWorker[k].arena);
+    free(r.aWorker[k].xml);
+    free(r.aWorker[k].json);
+  }
+  for(k=0; k<r.nFile; k++){
+    free(r.aFile[k].zPath);
+    free(r.aFile[k].zName);
+  }
+  free(r.aFile);
+  free(r.aWorker);
+  free((void *)r.options.schema);
+  return nError ? 1 : 0;
+}
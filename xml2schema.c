@@ -0,0 +1,124 @@
+/*
+** xml2schema.c - infers a schema from sample XML documents
+**
+*************************************************************************
+**
+** MIT License, see xml_to_json.c
+**
+*************************************************************************
+**
+** Usage: xml2schema [OPTIONS] FILE...
+**
+** Each FILE is a sample document, and the schema inferred from them is
+** written to standard output, one entry per line, in the form taken by
+** xml_schema_compile() and the "schema" option of the SQL functions:
+**
+**   -r RECORD_PATH  Each element of each FILE at RECORD_PATH is a sample
+**                   instead, with paths starting at the record, as for
+**                   xml2sqlite and xml_file()
+**   -n SAMPLES      Stop after SAMPLES samples
+**
+** FILE may be - to read standard input. e.g.
+**
+**   xml2schema -r '$.orders.order' -n 10000 orders.xml > orders.schema
+**
+** Elements that repeated in any sample are arrays, and the others single
+** values. Values are typed as numbers or booleans if every sample had one,
+** otherwise as strings, so the JSON of every document of the feed has the
+** same shape and types.
+**
+*************************************************************************
+**
+** To compile with gcc:
+**
+**   gcc -O2 xml2schema.c -o xml2schema
+**
+*************************************************************************
+*/
+
+#include "xml_to_json.c"
+
+static void usage(void){
+  fprintf(stderr,
+    "usage: xml2schema [OPTIONS] FILE...\n"
+    "  -r RECORD_PATH  each element at RECORD_PATH is a sample\n"
+    "  -n SAMPLES      stop after SAMPLES samples\n");
+  exit(1);
+}
+
+int main(int argc, char **argv){
+  struct xml_infer p;
+  struct xml_reader r;
+  const char *zRecord = 0;
+  char *zSchema;
+  char *xml = 0;
+  FILE *f;
+  long nMax = -1;
+  int nAlloc = 0;
+  int n;
+  int i;
+  
+  memset(&p, 0, sizeof(p));
+  
+  // Options
+  for(i=1; i<argc && argv[i][0]=='-' && argv[i][1]; i++){
+    if( i+1==argc || argv[i][2] )
+      usage();
+    switch( argv[i][1] ){
+      case 'r': zRecord = argv[++i]; break;
+      case 'n': nMax = atol(argv[++i]); break;
+      default:
+        usage();
+    }
+  }
+  if( i==argc )
+    usage();
+  
+  for(; i<argc && p.nSample!=nMax; i++){
+    f = strcmp(argv[i], "-")==0 ? stdin : fopen(argv[i], "rb");
+    if( !f ){
+      fprintf(stderr, "xml2schema: cannot open file: %s\n", argv[i]);
+      return 1;
+    }
+  
+    // Each record is a sample
+    if( zRecord ){
+      if( !xml_reader_open(&r, f, zRecord) ){
+        fprintf(stderr, "xml2schema: bad record path: %s\n", zRecord);
+        return 1;
+      }
+      while( p.nSample!=nMax && xml_reader_next(&r) ){
+        if( xml_infer_add(&p, &r.z[r.iRecord], r.nRecord) )
+          r.error = XML_READER_NOMEM;
+      }
+      if( r.error ){
+        fprintf(stderr, "xml2schema: %s: %s\n", argv[i],
+                r.error==XML_READER_NOMEM ? "out of memory" : "read error");
+        return 1;
+      }
+      xml_reader_close(&r);
+      continue;
+    }
+  
+    // The whole file is a sample, read into a buffer reused for each file
+    n = xml_read_file(f, &xml, &nAlloc);
+    if( f!=stdin )
+      fclose(f);
+    if( n<0 || xml_infer_add(&p, xml, n) ){
+      fprintf(stderr, "xml2schema: %s: %s\n", argv[i], n<0 ? "read error" : "out of memory");
+      return 1;
+    }
+  }
+  free(xml);
+  
+  zSchema = xml_infer_text(&p);
+  if( !zSchema ){
+    fprintf(stderr, "xml2schema: out of memory\n");
+    return 1;
+  }
+  fputs(zSchema, stdout);
+  fprintf(stderr, "%d samples\n", p.nSample);
+  free(zSchema);
+  xml_infer_free(&p);
+  return 0;
+}
@@ -0,0 +1,432 @@
+/*
+** xml2sqlite.c - loads the records of an XML file into an SQLite table
+**
+*************************************************************************
+**
+** MIT License, see xml_to_json.c
+**
+*************************************************************************
+**
+** Usage: xml2sqlite [OPTIONS] DATABASE FILE RECORD_PATH
+**
+** Each element of FILE at RECORD_PATH is inserted into a table as a row,
+** with its JSON in the value column and a column for each -c option:
+**
+**   -t TABLE       Table to insert into, "records" by default. It is created
+**                  if it does not exist, with untyped columns
+**   -c NAME=PATH   Column with the value at PATH in each record, as
+**                  returned by xml_extract(), e.g. -c id=$.order.@id
+**   -j THREADS     Threads converting records, one per CPU by default
+**   -b RECORDS     Records inserted per transaction, 10000 by default
+**   -i INDENT      Indent of the JSON, or -1 for minified JSON (default)
+**
+** FILE may be - to read standard input. e.g.
+**
+**   xml2sqlite -c id=$.order.@id orders.db orders.xml '$.orders.order'
+**
+** The file is read with a record reader, a batch at a time. Each batch is
+** converted on the worker threads while the next is read, and a single
+** writer thread inserts each converted batch with a prepared statement in
+** a transaction of its own, so rows are inserted in the order of the file.
+** Batches already inserted stay in the table if a later one fails.
+**
+*************************************************************************
+**
+** To compile with gcc:
+**
+**   gcc -O2 xml2sqlite.c -o xml2sqlite -lsqlite3 -lpthread
+**
+*************************************************************************
+*/
+
+#ifndef THREADS
+#define THREADS
+#endif
+#include "xml_to_json.c"
+
+#include <sqlite3.h>
+#include <time.h>
+
+#define LOAD_BATCH 10000                // Default records per batch
+#define LOAD_BATCH_BYTES (16*1024*1024) // XML that ends a batch early
+#define LOAD_QUEUE_DEPTH 2              // Batches waiting at each stage
+
+typedef struct load_batch *load_batch;
+struct load_batch{
+  char *xml;                            // Records, each zero terminated
+  int nXml;                             // Length of xml
+  int nXmlAlloc;                        // Allocated size of xml
+  int *aStart;                          // Offset of each record, and the end
+  int nRecord;                          // Number of records
+  char **aXml;                          // Each record, once converted
+  int *aOffset;                         // Offset of the JSON of each record
+  char *json;                           // JSON of each record
+  char **azValue;                       // Extracted columns of each record
+  load_batch pNext;                     // Next batch in queue
+};
+
+// Batches passed from one thread to the next
+typedef struct load_queue *load_queue;
+struct load_queue{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  load_batch pFirst;                    // Oldest batch
+  load_batch pLast;                     // Newest batch
+  int nBatch;                           // Number of batches queued
+  int closed;                           // True once no more batches will come
+};
+
+typedef struct loader *loader;
+struct loader{
+  sqlite3 *db;                          // Database connection
+  sqlite3_stmt *pInsert;                // INSERT statement
+  int nCol;                             // Number of extracted columns
+  xml_path *aPath;                      // Path of each extracted column
+  xml_match aMatch;                     // Extracted columns of each worker
+  int nThread;                          // Number of worker threads
+  int indent;                           // Indent of the JSON
+  int nBatch;                           // Records per batch
+  struct load_queue read;               // Batches read, waiting to be converted
+  struct load_queue write;              // Batches converted, waiting to be inserted
+  load_batch pConvert;                  // Batch being converted
+  long long nInserted;                  // Records inserted
+};
+
+static void *load_malloc(size_t n){
+  void *p = malloc(n ? n : 1);
+  if( !p ){
+    fprintf(stderr, "xml2sqlite: out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+static load_batch load_batch_new(int nRecord){
+  load_batch b = load_malloc(sizeof(*b));
+  
+  memset(b, 0, sizeof(*b));
+  b->aStart = load_malloc((nRecord+1)*sizeof(int));
+  return b;
+}
+
+static void load_batch_free(load_batch b, int nCol){
+  int i;
+  
+  if( b->azValue ){
+    for(i=0; i<b->nRecord*nCol; i++)
+      free(b->azValue[i]);
+    free(b->azValue);
+  }
+  free(b->xml);
+  free(b->aStart);
+  free(b->aXml);
+  free(b->aOffset);
+  free(b->json);
+  free(b);
+}
+
+// Copy a record into a batch
+static void load_batch_add(load_batch b, char *zRecord, int nRecord){
+  if( b->nXml+nRecord+1 > b->nXmlAlloc ){
+    b->nXmlAlloc = 2*(b->nXml+nRecord+1);
+    b->xml = realloc(b->xml, b->nXmlAlloc);
+    if( !b->xml ){
+      fprintf(stderr, "xml2sqlite: out of memory\n");
+      exit(1);
+    }
+  }
+  b->aStart[b->nRecord++] = b->nXml;
+  memcpy(&b->xml[b->nXml], zRecord, nRecord);
+  b->nXml += nRecord;
+  b->xml[b->nXml++] = 0;
+}
+
+static void load_queue_init(load_queue q){
+  memset(q, 0, sizeof(*q));
+  pthread_mutex_init(&q->mutex, 0);
+  pthread_cond_init(&q->cond, 0);
+}
+
+// Add a batch, waiting while the queue is full
+static void load_queue_push(load_queue q, load_batch b){
+  pthread_mutex_lock(&q->mutex);
+  while( q->nBatch>=LOAD_QUEUE_DEPTH )
+    pthread_cond_wait(&q->cond, &q->mutex);
+  b->pNext = 0;
+  if( q->pLast )
+    q->pLast->pNext = b;
+  else
+    q->pFirst = b;
+  q->pLast = b;
+  q->nBatch++;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->mutex);
+}
+
+// Take the oldest batch, waiting while the queue is empty. Returns null
+// once the queue is closed and empty.
+static load_batch load_queue_pop(load_queue q){
+  load_batch b;
+  
+  pthread_mutex_lock(&q->mutex);
+  while( q->nBatch==0 && !q->closed )
+    pthread_cond_wait(&q->cond, &q->mutex);
+  b = q->pFirst;
+  if( b ){
+    q->pFirst = b->pNext;
+    if( !q->pFirst )
+      q->pLast = 0;
+    q->nBatch--;
+    pthread_cond_broadcast(&q->cond);
+  }
+  pthread_mutex_unlock(&q->mutex);
+  return b;
+}
+
+static void load_queue_close(load_queue q){
+  pthread_mutex_lock(&q->mutex);
+  q->closed = 1;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->mutex);
+}
+
+// Extract the columns of record i, using worker iWorker's matches
+static void load_extract(void *pArg, int iWorker, int i){
+  loader p = (loader)pArg;
+  load_batch b = p->pConvert;
+  xml_match aMatch = &p->aMatch[iWorker*p->nCol];
+  int is_json;
+  int k;
+  
+  xml_extract_find(b->aXml[i], b->aStart[i+1]-b->aStart[i]-1, aMatch, p->nCol);
+  for(k=0; k<p->nCol; k++)
+    b->azValue[i*p->nCol+k] = xml_match_value(&aMatch[k], &is_json);
+}
+
+//
+// load_convert
+//
+// Converter thread. Each batch read is converted with xml_to_json_batch(),
+// and its columns extracted on the same threads, before being passed to
+// the writer.
+//
+static void *load_convert(void *pArg){
+  loader p = (loader)pArg;
+  load_batch b;
+  int i;
+  
+  while( (b = load_queue_pop(&p->read)) ){
+    b->aXml = load_malloc(b->nRecord*sizeof(char *));
+    for(i=0; i<b->nRecord; i++)
+      b->aXml[i] = &b->xml[b->aStart[i]];
+    b->aStart[b->nRecord] = b->nXml;
+    b->aOffset = load_malloc((b->nRecord+1)*sizeof(int));
+    b->json = xml_to_json_batch(b->aXml, b->nRecord, b->aOffset, p->indent, p->nThread);
+    if( !b->json ){
+      fprintf(stderr, "xml2sqlite: out of memory\n");
+      exit(1);
+    }
+  
+    if( p->nCol ){
+      b->azValue = load_malloc(b->nRecord*p->nCol*sizeof(char *));
+      p->pConvert = b;
+      pool_run(p->nThread, b->nRecord, load_extract, p);
+    }
+    load_queue_push(&p->write, b);
+  }
+  load_queue_close(&p->write);
+  return 0;
+}
+
+// Report an SQLite error and exit
+static void load_error(sqlite3 *db){
+  fprintf(stderr, "xml2sqlite: %s\n", sqlite3_errmsg(db));
+  exit(1);
+}
+
+//
+// load_write
+//
+// Writer thread. Each converted batch is inserted in a transaction of its
+// own, binding the JSON and column values in place.
+//
+static void *load_write(void *pArg){
+  loader p = (loader)pArg;
+  sqlite3_stmt *pInsert = p->pInsert;
+  load_batch b;
+  char *z;
+  int i, k;
+  
+  while( (b = load_queue_pop(&p->write)) ){
+    if( sqlite3_exec(p->db, "BEGIN", 0, 0, 0)!=SQLITE_OK )
+      load_error(p->db);
+    for(i=0; i<b->nRecord; i++){
+      sqlite3_bind_text(pInsert, 1, &b->json[b->aOffset[i]], b->aOffset[i+1]-b->aOffset[i]-1, SQLITE_STATIC);
+      for(k=0; k<p->nCol; k++){
+        z = b->azValue[i*p->nCol+k];
+        if( z )
+          sqlite3_bind_text(pInsert, k+2, z, -1, SQLITE_STATIC);
+        else
+          sqlite3_bind_null(pInsert, k+2);
+      }
+      if( sqlite3_step(pInsert)!=SQLITE_DONE )
+        load_error(p->db);
+      sqlite3_reset(pInsert);
+    }
+    if( sqlite3_exec(p->db, "COMMIT", 0, 0, 0)!=SQLITE_OK )
+      load_error(p->db);
+    p->nInserted += b->nRecord;
+    load_batch_free(b, p->nCol);
+  }
+  return 0;
+}
+
+static void usage(void){
+  fprintf(stderr,
+    "usage: xml2sqlite [OPTIONS] DATABASE FILE RECORD_PATH\n"
+    "  -t TABLE       table to insert into (default records)\n"
+    "  -c NAME=PATH   column with the value at PATH in each record\n"
+    "  -j THREADS     threads converting records (default one per CPU)\n"
+    "  -b RECORDS     records inserted per transaction (default %d)\n"
+    "  -i INDENT      indent of the JSON (default -1, minified)\n", LOAD_BATCH);
+  exit(1);
+}
+
+int main(int argc, char **argv){
+  struct loader l;
+  struct xml_reader r;
+  struct timespec t0, t1;
+  pthread_t convert_thread, write_thread;
+  load_batch b;
+  const char *zTable = "records";
+  char **azName;
+  sqlite3_str *pCreate, *pInsert;
+  char *zSql;
+  FILE *f;
+  double secs;
+  int i, k;
+  
+  memset(&l, 0, sizeof(l));
+  l.indent = -1;
+  l.nBatch = LOAD_BATCH;
+  azName = load_malloc(argc*sizeof(char *));
+  l.aPath = load_malloc(argc*sizeof(xml_path));
+  
+  // Options
+  for(i=1; i<argc && argv[i][0]=='-' && argv[i][1]; i++){
+    if( i+1==argc || argv[i][2] )
+      usage();
+    switch( argv[i][1] ){
+      case 't': zTable = argv[++i]; break;
+      case 'j': l.nThread = atoi(argv[++i]); break;
+      case 'b': l.nBatch = atoi(argv[++i]); break;
+      case 'i': l.indent = atoi(argv[++i]); break;
+      case 'c':
+        azName[l.nCol] = argv[++i];
+        zSql = strchr(argv[i], '=');
+        if( !zSql || zSql==argv[i] )
+          usage();
+        *zSql = 0;
+        l.aPath[l.nCol] = xml_path_compile(zSql+1);
+        if( !l.aPath[l.nCol] ){
+          fprintf(stderr, "xml2sqlite: bad column path: %s\n", zSql+1);
+          return 1;
+        }
+        l.nCol++;
+        break;
+      default:
+        usage();
+    }
+  }
+  if( argc-i!=3 || l.nBatch<1 )
+    usage();
+  if( l.nThread<=0 )
+    l.nThread = sysconf(_SC_NPROCESSORS_ONLN);
+  if( l.nThread<1 )
+    l.nThread = 1;
+  
+  // Matches for each worker, sharing the column paths
+  l.aMatch = load_malloc(l.nThread*l.nCol*sizeof(struct xml_match));
+  for(k=0; k<l.nThread*l.nCol; k++)
+    l.aMatch[k].path = l.aPath[k%l.nCol];
+  
+  f = strcmp(argv[i+1], "-")==0 ? stdin : fopen(argv[i+1], "rb");
+  if( !f ){
+    fprintf(stderr, "xml2sqlite: cannot open file: %s\n", argv[i+1]);
+    return 1;
+  }
+  if( !xml_reader_open(&r, f, argv[i+2]) ){
+    fprintf(stderr, "xml2sqlite: bad record path: %s\n", argv[i+2]);
+    return 1;
+  }
+  
+  if( sqlite3_open(argv[i], &l.db)!=SQLITE_OK )
+    load_error(l.db);
+  
+  // Table and INSERT statement
+  pCreate = sqlite3_str_new(l.db);
+  pInsert = sqlite3_str_new(l.db);
+  sqlite3_str_appendf(pCreate, "CREATE TABLE IF NOT EXISTS \"%w\"(value", zTable);
+  sqlite3_str_appendf(pInsert, "INSERT INTO \"%w\"(value", zTable);
+  for(k=0; k<l.nCol; k++){
+    sqlite3_str_appendf(pCreate, ",\"%w\"", azName[k]);
+    sqlite3_str_appendf(pInsert, ",\"%w\"", azName[k]);
+  }
+  sqlite3_str_appendall(pCreate, ")");
+  sqlite3_str_appendall(pInsert, ") VALUES(?");
+  for(k=0; k<l.nCol; k++)
+    sqlite3_str_appendall(pInsert, ",?");
+  sqlite3_str_appendall(pInsert, ")");
+  zSql = sqlite3_str_finish(pCreate);
+  if( sqlite3_exec(l.db, zSql, 0, 0, 0)!=SQLITE_OK )
+    load_error(l.db);
+  sqlite3_free(zSql);
+  zSql = sqlite3_str_finish(pInsert);
+  if( sqlite3_prepare_v2(l.db, zSql, -1, &l.pInsert, 0)!=SQLITE_OK )
+    load_error(l.db);
+  sqlite3_free(zSql);
+  
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  load_queue_init(&l.read);
+  load_queue_init(&l.write);
+  pthread_create(&convert_thread, 0, load_convert, &l);
+  pthread_create(&write_thread, 0, load_write, &l);
+  
+  // Read records in batches, while earlier ones are converted and inserted
+  b = load_batch_new(l.nBatch);
+  while( xml_reader_next(&r) ){
+    load_batch_add(b, &r.z[r.iRecord], r.nRecord);
+    if( b->nRecord==l.nBatch || b->nXml>=LOAD_BATCH_BYTES ){
+      load_queue_push(&l.read, b);
+      b = load_batch_new(l.nBatch);
+    }
+  }
+  if( b->nRecord )
+    load_queue_push(&l.read, b);
+  else
+    load_batch_free(b, l.nCol);
+  load_queue_close(&l.read);
+  
+  pthread_join(convert_thread, 0);
+  pthread_join(write_thread, 0);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  
+  if( r.error ){
+    fprintf(stderr, "xml2sqlite: %s: %s\n", argv[i+1],
+            r.error==XML_READER_NOMEM ? "out of memory" : "read error");
+    return 1;
+  }
+  secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec)/1e9;
+  fprintf(stderr, "%lld records in %.2f s, %.0f records per minute\n",
+          l.nInserted, secs, secs>0 ? l.nInserted*60/secs : 0);
+  
+  sqlite3_finalize(l.pInsert);
+  sqlite3_close(l.db);
+  xml_reader_close(&r);
+  for(k=0; k<l.nCol; k++)
+    free(l.aPath[k]);
+  free(l.aPath);
+  free(l.aMatch);
+  free(azName);
+  return 0;
+}
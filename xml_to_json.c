@@ -55,10 +55,42 @@
 ** xml_to_json(X, N) takes one or two arguments:
 ** 
 ** * X - XML string UTF-8 encoded
-** * N - Optional indent for pretty printed JSON or -1 for minified JSON
+** * N - Optional indent for pretty printed JSON or -1 for minified JSON,
+**       or a JSON object of options, e.g. {"indent":2,"attribute_prefix":"_",
+**       "text_key":"value"}
 ** 
 ** The input XML is not validated prior to conversion.
 **
+** xml_each(X, P) and xml_tree(X, P) are table-valued functions that return
+** the attributes, text and elements of X, like json_each() and json_tree().
+**
+** xml_extract(X, P1, P2, ...) returns the values at paths P1, P2 etc.
+**
+** xml_file(F, R) is a table-valued function that streams the file F, with
+** a row of JSON for each record element at path R.
+**
+** xml_well_formed(X) returns 1 if X is well formed, otherwise 0, without
+** converting it.
+**
+** xml_to_jsonb(X) converts X to SQLite's binary JSONB format,
+** xml_to_cbor(X) to CBOR and xml_to_msgpack(X) to MessagePack.
+**
+** xml_group_json(X) is an aggregate function returning a JSON array of the
+** JSON of each X.
+**
+** xml_to_jsonb(), xml_to_cbor(), xml_to_msgpack() and xml_group_json()
+** take the same optional N as xml_to_json().
+**
+** xml_infer_schema(X) is an aggregate function returning a schema inferred
+** from each X, to be given as the "schema" option.
+**
+** xml_cache_size(N) keeps the JSON of the last N documents converted by
+** xml_to_json(), so repeated documents are converted once, and
+** xml_cache_stats() returns the hits and misses.
+**
+** Conversions stop with SQLITE_INTERRUPT once sqlite3_interrupt() is
+** called, with SQLite 3.41.0 or later.
+**
 *************************************************************************
 **
 ** To compile with gcc as a run-time loadable extension:
@@ -77,6 +109,8 @@
 ** SELECT xml_to_json('<x><y>abc</y><y>def</y></x>', 2);
 ** SELECT xml_to_json('<x>hello<y>abc</y>world<y>def</y>xyz</x>', 2);
 ** SELECT xml_to_json('<x attr1="attr val 1" attr2="attr val 2">&amp; &gt; &lt; &#39;</x>', 2);
+** SELECT key, value FROM xml_each('<x><y>abc</y><y>def</y></x>', '$.x');
+** SELECT xml_extract('<x><y>abc</y><y>def</y></x>', '$.x.y[1]');
 **
 *************************************************************************
 */
@@ -85,9 +119,11 @@
 #include "sqlite3ext.h"
 SQLITE_EXTENSION_INIT1
 #define MALLOC sqlite3_malloc
+#define REALLOC sqlite3_realloc
 #define FREE sqlite3_free
 #else
 #define MALLOC malloc
+#define REALLOC realloc
 #define FREE free
 #endif
 
@@ -95,11 +131,42 @@ SQLITE_EXTENSION_INIT1
 #include <stdlib.h>
 #include <string.h>
 
+// iovec output is not available in the SQLite extension or on Windows
+#if !defined(SQLITE) && !defined(_WIN32)
+#include <sys/uio.h>
+#define HAVE_IOVEC
+#define IOV_COPY_MAX 32                 // Longest string copied rather than referenced
+#endif
+
+// Arrow output is only in the C library
+#ifndef SQLITE
+#include <stdint.h>
+#include <errno.h>
+#endif
+
+// Tree files are memory mapped, except in the SQLite extension or on Windows
+#if !defined(SQLITE) && !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define HAVE_MMAP
+#endif
+
+#ifdef THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 typedef struct element *element;
 struct element{
   struct element *parent;               // Link to parent element or null
-  char *name;                           // Pointer to element name in original XML string
-  int nName;                            // Length of name
+  struct xml_symbol *symbol;            // Name, shared by elements of the same name
+  int value_type;                       // Type of its text, XML_VALUE_AUTO unless set by a schema
   struct value *first_value;            // Link to first value. Value might be an array of values e.g <x>a<y/>b</x>
   int depth;                            // Depth of element
   int is_parent;                        // True if element has children
@@ -128,936 +195,8751 @@ struct value{
 //   etc.
 //
 //  Constant memory for named special charactes
-//  Dynamically allocated memory for html codes values
+//  Arena memory for html codes values
 //
 typedef struct value_part *value_part;
 struct value_part{
   char *val;                            // Pointer to value part in original XML string (or special characters)
   int nVal;                             // Length of val
-  int free;                             // True if val should be freed
   struct value_part *next_value_part;   // Link to next value part
 };
 
 typedef struct element_attribute *element_attribute;
 struct element_attribute{
-  char *name;                           // Pointer to element name in original XML string
-  int nName;                            // Lenth of name
+  struct xml_symbol *symbol;            // Name, shared by attributes of the same name
+  int value_type;                       // Type of its value, XML_VALUE_AUTO unless set by a schema
   struct value_part *first_value_part;  // Link to first value part
   struct element_attribute *next_attr;  // Link to nect attribute
 };
 
-static value_part get_value_parts(int *i, int j, char *xml, value_part new_value_part, int is_attr);
-static int json_output(element root, char *json, int indent);
+// Symbol table
+//
+// Element and attribute names are interned as they are parsed, so each
+// distinct name is kept once, with its key as json_output() writes it:
+// quoted, escaped and followed by a colon. Keys are then written with a
+// single copy, and names are compared by their symbols when grouping.
+//
+// Symbols are allocated from blocks of XML_SYMBOLS_BLOCK_SIZE bytes, owned
+// by the symbol table embedded in an arena rather than by the arena. The
+// table is freed by arena_free(), and survives arena_reset() so that
+// documents converted one after another share it, unless there are more
+// than XML_SYMBOLS_KEEP symbols.
+//
+#define XML_SYMBOLS_KEEP 4096
+#define XML_SYMBOLS_BLOCK_SIZE 4096
+
+typedef struct xml_symbol *xml_symbol;
+struct xml_symbol{
+  char *name;                           // Name, copied after the symbol
+  int nName;                            // Length of name
+  char *key;                            // Key, e.g. "name": for name
+  int nKey;                             // Length of key
+  unsigned int hash;                    // Hash of name
+  struct xml_symbol *next;              // Next symbol in the same hash bucket
+};
+
+typedef struct xml_symbols *xml_symbols;
+struct xml_symbols{
+  xml_symbol *aHash;                    // First symbol in each bucket
+  int nHash;                            // Number of buckets, a power of 2
+  int nSymbol;                          // Number of symbols
+  struct arena_block *block;            // Block symbols are allocated from, linked to earlier blocks
+};
+
+// Arena allocator
+//
+// Elements, attributes and values are allocated from large blocks, which
+// are freed all at once, or kept by arena_reset() to be reused.
+//
+#define ARENA_BLOCK_SIZE (64*1024)
+
+typedef struct arena_block *arena_block;
+struct arena_block{
+  struct arena_block *next;             // Link to next block
+  int nByte;                            // Size of block, excluding this header
+  int nUsed;                            // Bytes allocated from block
+};
+
+// Interrupt hook
+//
+// Long conversions call xInterrupt(pArg) every XML_INTERRUPT_INTERVAL
+// elements while parsing, grouping and output, and give up once it returns
+// non-zero. The result is sticky, so each later phase stops at once.
+//
+#define XML_INTERRUPT_INTERVAL 4096
+
+typedef struct xml_interrupt *xml_interrupt;
+struct xml_interrupt{
+  int (*xInterrupt)(void*);             // Returns non-zero to stop the conversion
+  void *pArg;                           // Argument of xInterrupt
+  int nCountdown;                       // Elements until xInterrupt is next called
+  int interrupted;                      // True once xInterrupt has returned non-zero
+};
+
+typedef struct arena *arena;
+struct arena{
+  struct arena_block *first;            // Link to first block
+  struct arena_block *current;          // Block being allocated from. Later blocks are free
+  xml_interrupt interrupt;              // Interrupt hook of xml_parse(), or null
+  struct xml_symbols symbols;           // Names of the elements and attributes parsed
+  int nomem;                            // Set once an allocation fails
+};
+
+// Output buffer for json_output()
+//
+// If json is null, then only the space required is calculated.
+//
+// In relative mode, indents are counted rather than output, so that the
+// space required for a fragment can be calculated before the depth it
+// starts at is known:
+//
+//   nJson + indent*(start_depth*nIndent + sum_depth)
+//
+// In iovec mode, strings longer than IOV_COPY_MAX are referenced by their
+// own iovec instead of being copied, and json only receives the remaining
+// generated bytes (brackets, quotes, indents, short values etc.).
+//
+typedef struct json_buffer *json_buffer;
+struct json_buffer{
+  char *json;                           // Output buffer or null
+  int nJson;                            // Length of output written to json
+  int depth;                            // Indent depth
+  int relative;                         // True if counting indents at relative depths
+  int nIndent;                          // Number of indents counted
+  long sum_depth;                       // Sum of relative depths counted
+  int min_depth;                        // Minimum relative depth counted
+#ifdef HAVE_IOVEC
+  int iov_mode;                         // True if building an iovec list
+  struct iovec *iov;                    // iovec list or null
+  int nIov;                             // Number of iovecs
+  int in_gen;                           // True if the last iovec references json
+#endif
+};
+
+typedef struct xml_schema *xml_schema;
+
+// Types of text and attribute values, given by a schema
+#define XML_VALUE_AUTO 0                // Number or boolean if typed output is on, otherwise string
+#define XML_VALUE_STRING 1              // Always a string
+#define XML_VALUE_NUMBER 2              // Number if it is one, otherwise string
+#define XML_VALUE_BOOLEAN 3             // true or false if it is one, otherwise string
+
+// How a value is output, returned by xml_value_kind()
+#define VALUE_STRING 0
+#define VALUE_INTEGER 1
+#define VALUE_REAL 2
+#define VALUE_TRUE 3
+#define VALUE_FALSE 4
+
+// Reasons a conversion failed
+#define XML_ERROR_NOMEM 1               // Out of memory
+#define XML_ERROR_TOOBIG 2              // Result larger than 2 GiB
+
+// Conversion options
+typedef struct xml_options *xml_options;
+struct xml_options{
+  int indent;                           // Indent for pretty printed JSON, or -1 for minified JSON
+  char *attr_prefix;                    // Prefix of attribute keys
+  int nAttrPrefix;                      // Length of attr_prefix
+  char *text_key;                       // Key of text in elements with attributes or children
+  int nTextKey;                         // Length of text_key
+  xml_interrupt interrupt;              // Interrupt hook of json_output(), or null
+  xml_schema schema;                    // Arrays and elements to drop, or null to find arrays
+  int typed;                            // True to output numbers and booleans as JSON numbers and booleans
+  int error;                            // XML_ERROR_NOMEM or _TOOBIG once a conversion with these options fails
+};
+
+static element xml_parse(char *xml, int n, int depth, arena a);
+static void xml_group(element root, int min_depth, xml_interrupt it);
+static int xml_group_schema(element root, xml_schema schema, xml_interrupt it);
+static value_part get_value_parts(int *i, int j, char *xml, value_part new_value_part, int is_attr, arena a);
+static int json_output(element root, element first, element end, json_buffer out, xml_options opt);
+static int xml_value_kind(value_part first, int value_type, int typed);
+
+// Default options, with the given indent
+static void xml_options_init(xml_options opt, int indent){
+  opt->indent = indent;
+  opt->attr_prefix = "@";
+  opt->nAttrPrefix = 1;
+  opt->text_key = "#text";
+  opt->nTextKey = 5;
+  opt->interrupt = 0;
+  opt->schema = 0;
+  opt->typed = 0;
+  opt->error = 0;
+}
+
+static void xml_interrupt_init(xml_interrupt it, int (*xInterrupt)(void*), void *pArg){
+  it->xInterrupt = xInterrupt;
+  it->pArg = pArg;
+  it->nCountdown = XML_INTERRUPT_INTERVAL;
+  it->interrupted = 0;
+}
+
+//
+// xml_interrupted
+//
+// Returns true once the conversion has been interrupted. Called for each
+// element, but only calls the hook every XML_INTERRUPT_INTERVAL calls.
+//
+static int xml_interrupted(xml_interrupt it){
+  if( !it )
+    return 0;
+  if( !it->interrupted && --it->nCountdown<=0 ){
+    it->nCountdown = XML_INTERRUPT_INTERVAL;
+    it->interrupted = it->xInterrupt(it->pArg)!=0;
+  }
+  return it->interrupted;
+}
+
+//
+// arena_alloc
+//
+// Allocate n bytes, aligned to 8 bytes. Returns null, and sets a->nomem,
+// if a new block cannot be allocated.
+//
+static void *arena_alloc(arena a, int n){
+  arena_block block = a->current;
+  arena_block new_block;
+  void *p;
+  
+  n = (n+7) & ~7;
+  if( !block || block->nUsed+n > block->nByte ){
+    // Move on to the next free block, or insert a new one
+    if( block && block->next && block->next->nByte>=n ){
+      block = block->next;
+    }else if( !block && a->first && a->first->nByte>=n ){
+      block = a->first;
+    }else{
+      new_block = (arena_block)MALLOC(sizeof(struct arena_block) + (n>ARENA_BLOCK_SIZE ? n : ARENA_BLOCK_SIZE));
+      if( !new_block ){
+        a->nomem = 1;
+        return 0;
+      }
+      new_block->nByte = n>ARENA_BLOCK_SIZE ? n : ARENA_BLOCK_SIZE;
+      if( block ){
+        new_block->next = block->next;
+        block->next = new_block;
+      }else{
+        new_block->next = a->first;
+        a->first = new_block;
+      }
+      block = new_block;
+    }
+    block->nUsed = 0;
+    a->current = block;
+  }
+  
+  p = (char *)&block[1] + block->nUsed;
+  block->nUsed += n;
+  return p;
+}
+
+static void xml_symbols_free(xml_symbols h){
+  arena_block block;
+  
+  while( h->block ){
+    block = h->block;
+    h->block = block->next;
+    FREE(block);
+  }
+  FREE(h->aHash);
+  memset(h, 0, sizeof(struct xml_symbols));
+}
+
+// Allocate n bytes for a symbol, aligned to 8 bytes. Returns null if memory
+// runs out.
+static void *xml_symbols_alloc(xml_symbols h, int n){
+  arena_block block = h->block;
+  void *p;
+  
+  n = (n+7) & ~7;
+  if( !block || block->nUsed+n > block->nByte ){
+    block = (arena_block)MALLOC(sizeof(struct arena_block) + (n>XML_SYMBOLS_BLOCK_SIZE ? n : XML_SYMBOLS_BLOCK_SIZE));
+    if( !block )
+      return 0;
+    block->nByte = n>XML_SYMBOLS_BLOCK_SIZE ? n : XML_SYMBOLS_BLOCK_SIZE;
+    block->nUsed = 0;
+    block->next = h->block;
+    h->block = block;
+  }
+  
+  p = (char *)&block[1] + block->nUsed;
+  block->nUsed += n;
+  return p;
+}
+
+//
+// xml_symbol_intern
+//
+// Return the symbol of the name z of n bytes, adding it if it is new.
+// Returns null if memory runs out.
+//
+static xml_symbol xml_symbol_intern(xml_symbols h, char *z, int n){
+  xml_symbol symbol;
+  xml_symbol next;
+  xml_symbol *aHash;
+  unsigned int x = 2166136261u;
+  char *zKey;
+  int nKey;
+  int i;
+  
+  for(i=0; i<n; i++)
+    x = (x ^ (unsigned char)z[i]) * 16777619;
+  if( h->nHash ){
+    for(symbol=h->aHash[x & (h->nHash-1)]; symbol; symbol=symbol->next){
+      if( symbol->hash==x && symbol->nName==n && memcmp(symbol->name, z, n)==0 )
+        return symbol;
+    }
+  }
+  
+  // As many buckets as symbols
+  if( h->nSymbol>=h->nHash ){
+    aHash = MALLOC((h->nHash ? 2*h->nHash : 64)*sizeof(xml_symbol));
+    if( !aHash )
+      return 0;
+    memset(aHash, 0, (h->nHash ? 2*h->nHash : 64)*sizeof(xml_symbol));
+    for(i=0; i<h->nHash; i++){
+      for(symbol=h->aHash[i]; symbol; symbol=next){
+        next = symbol->next;
+        symbol->next = aHash[symbol->hash & (2*h->nHash-1)];
+        aHash[symbol->hash & (2*h->nHash-1)] = symbol;
+      }
+    }
+    FREE(h->aHash);
+    h->aHash = aHash;
+    h->nHash = h->nHash ? 2*h->nHash : 64;
+  }
+  
+  // Quotes, backslashes and control characters are escaped in the key
+  nKey = n+3;
+  for(i=0; i<n; i++){
+    if( z[i]=='"' || z[i]=='\\' )
+      nKey++;
+    else if( (unsigned char)z[i]<0x20 )
+      nKey += 5;
+  }
+  
+  symbol = xml_symbols_alloc(h, sizeof(struct xml_symbol) + n + nKey);
+  if( !symbol )
+    return 0;
+  symbol->name = (char *)&symbol[1];
+  symbol->nName = n;
+  memcpy(symbol->name, z, n);
+  symbol->key = zKey = &symbol->name[n];
+  symbol->nKey = nKey;
+  *zKey++ = '"';
+  for(i=0; i<n; i++){
+    if( z[i]=='"' || z[i]=='\\' ){
+      *zKey++ = '\\';
+      *zKey++ = z[i];
+    }else if( (unsigned char)z[i]<0x20 ){
+      memcpy(zKey, "\\u00", 4);
+      zKey[4] = "0123456789abcdef"[(unsigned char)z[i]>>4];
+      zKey[5] = "0123456789abcdef"[z[i]&15];
+      zKey += 6;
+    }else{
+      *zKey++ = z[i];
+    }
+  }
+  *zKey++ = '"';
+  *zKey = ':';
+  
+  symbol->hash = x;
+  symbol->next = h->aHash[x & (h->nHash-1)];
+  h->aHash[x & (h->nHash-1)] = symbol;
+  h->nSymbol++;
+  return symbol;
+}
+
+#if defined(SQLITE) || defined(THREADS)
+// Keep blocks, and symbols unless there are many, to be reused
+static void arena_reset(arena a){
+  a->current = 0;
+  a->nomem = 0;
+  if( a->symbols.nSymbol>XML_SYMBOLS_KEEP )
+    xml_symbols_free(&a->symbols);
+}
+#endif
+
+static void arena_free(arena a){
+  arena_block block;
+  
+  while( a->first ){
+    block = a->first;
+    a->first = block->next;
+    FREE(block);
+  }
+  a->current = 0;
+  a->nomem = 0;
+  xml_symbols_free(&a->symbols);
+}
 
 static int is_space(char *z){
   return z[0]==' ' || z[0]=='\t' || z[0]=='\n' || z[0]=='\f' || z[0]=='\r';
 }
 
-static int print_spaces(char *json, int nJson, int spaces){
+//
+// print_reserve
+//
+// Reserve n bytes of generated output.
+// Returns where to write them, or null if only calculating space required.
+//
+static char *print_reserve(json_buffer out, int n){
+  char *z = out->json ? &out->json[out->nJson] : 0;
+  
+#ifdef HAVE_IOVEC
+  if( out->iov_mode && n>0 ){
+    // Extend the current iovec over json, or start a new one
+    if( !out->in_gen ){
+      if( out->iov ){
+        out->iov[out->nIov].iov_base = z;
+        out->iov[out->nIov].iov_len = 0;
+      }
+      out->nIov++;
+      out->in_gen = 1;
+    }
+    if( out->iov )
+      out->iov[out->nIov-1].iov_len += n;
+  }
+#endif
+  
+  out->nJson += n;
+  return z;
+}
+
+static void print_spaces(json_buffer out, int spaces){
   if( spaces<0 )
-    return 0;
+    return;
   
-  int i;
-  for(i=0; i<spaces; i++){
-    //printf(" ");
-    if( json )
-      json[nJson+i] = ' ';
+  //printf("%*s", spaces, "");
+  char *z = print_reserve(out, spaces);
+  if( z )
+    memset(z, ' ', spaces);
+}
+
+static void print_indent(json_buffer out, int depth, int indent){
+  if( indent<0 )
+    return;
+  
+  if( out->relative ){
+    out->nIndent++;
+    out->sum_depth += depth;
+    if( depth<out->min_depth )
+      out->min_depth = depth;
+    return;
   }
   
-  return spaces;
+  print_spaces(out, depth*indent);
 }
 
-static int print_newline(char *json, int nJson, int print){
+static void print_newline(json_buffer out, int print){
   if( print<0 )
-    return 0;
+    return;
   
   //printf("\n");
-  if( json )
-    json[nJson] = '\n';
-  
-  return 1;
+  char *z = print_reserve(out, 1);
+  if( z )
+    z[0] = '\n';
 }
 
-static int print_char(char *json, int nJson, char c){
+static void print_char(json_buffer out, char c){
   //printf("%c", c);
-  if( json )
-    json[nJson] = c;
-  return 1;
+  char *z = print_reserve(out, 1);
+  if( z )
+    z[0] = c;
 }
 
-static int print_string(char *json, int nJson, char *s, int n){
+//
+// print_string
+//
+// s must either point into the original XML string, or be no longer than
+// IOV_COPY_MAX, as long strings are referenced rather than copied in
+// iovec mode.
+//
+static void print_string(json_buffer out, char *s, int n){
   //printf("%.*s", n, s);
-  if( json )
-    memcpy(&json[nJson], s, n);
-  return n;
+#ifdef HAVE_IOVEC
+  if( out->iov_mode && n>IOV_COPY_MAX ){
+    if( out->iov ){
+      out->iov[out->nIov].iov_base = s;
+      out->iov[out->nIov].iov_len = n;
+    }
+    out->nIov++;
+    out->in_gen = 0;
+    return;
+  }
+#endif
+  
+  char *z = print_reserve(out, n);
+  if( z )
+    memcpy(z, s, n);
+}
+
+//
+// print_key
+//
+// Write the key of an element, or of an attribute with the prefix given,
+// followed by a space if indenting. Keys are always copied, as symbols do
+// not outlive their arena.
+//
+static void print_key(json_buffer out, char *zPrefix, int nPrefix, xml_symbol symbol, int indent){
+  int n = nPrefix + symbol->nKey + (indent<0 ? 0 : 1);
+  char *z = print_reserve(out, n);
+  
+  if( !z )
+    return;
+  if( nPrefix ){
+    z[0] = '"';
+    memcpy(&z[1], zPrefix, nPrefix);
+    memcpy(&z[1+nPrefix], &symbol->key[1], symbol->nKey-1);
+  }else{
+    memcpy(z, symbol->key, symbol->nKey);
+  }
+  if( indent>=0 )
+    z[n-1] = ' ';
+}
+
+//
+// xml_output
+//
+// Output the grouped elements of root as a JSON string with the options
+// given, setting *pnJson to its length if pnJson is not null. Returns null
+// if opt->interrupt stops it, or memory runs out, in which case opt->error
+// is set.
+//
+static char *xml_output(element root, xml_options opt, int *pnJson){
+  struct json_buffer out;
+  char *json;
+  
+  // Calculate space required
+  memset(&out, 0, sizeof(out));
+  json_output(root, root->next, 0, &out, opt);
+  
+  // Construct JSON
+  json = 0;
+  if( !xml_interrupted(opt->interrupt) ){
+    out.json = MALLOC(out.nJson+1);
+    if( !out.json ){
+      opt->error = XML_ERROR_NOMEM;
+      if( pnJson )
+        *pnJson = 0;
+      return 0;
+    }
+    out.nJson = 0;
+    out.depth = 0;
+    json_output(root, root->next, 0, &out, opt);
+    json = out.json;
+    json[out.nJson] = 0;
+    if( xml_interrupted(opt->interrupt) ){
+      FREE(json);
+      json = 0;
+    }
+  }
+  
+  if( pnJson )
+    *pnJson = json ? out.nJson : 0;
+  return json;
+}
+
+//
+// xml_convert
+//
+// Convert XML string of length n, or zero terminated if n is negative, to
+// JSON with the options given. Returns null if opt->interrupt stops it, or
+// memory runs out, in which case opt->error is set.
+//
+static char *xml_convert(char *xml, int n, xml_options opt){
+  element root;
+  struct arena a = {0, 0, opt->interrupt, {0, 0, 0, 0}, 0};
+  char *json;
+  
+  root = xml_parse(xml, n, 0, &a);
+  if( !root ){
+    opt->error = a.nomem ? XML_ERROR_NOMEM : 0;
+    arena_free(&a);
+    return 0;
+  }
+  if( !opt->schema )
+    xml_group(root, 0, opt->interrupt);
+  else if( !xml_group_schema(root, opt->schema, opt->interrupt) ){
+    opt->error = XML_ERROR_NOMEM;
+    arena_free(&a);
+    return 0;
+  }
+  
+  json = xml_output(root, opt, 0);
+  
+  arena_free(&a);
+  
+  return json;
 }
 
+#ifndef SQLITE
 //
 // xml_to_json
 //
-#ifdef SQLITE
-static char *xml_to_json(char *xml, int indent){
-#else
 char *xml_to_json(char *xml, int indent){
+  struct xml_options opt;
+  
+  xml_options_init(&opt, indent);
+  return xml_convert(xml, -1, &opt);
+}
+
+//
+// xml_to_json_interruptible
+//
+// Same as xml_to_json(), but xInterrupt(pArg) is called every
+// XML_INTERRUPT_INTERVAL elements or so, and once it returns non-zero the
+// conversion is abandoned and null returned.
+//
+char *xml_to_json_interruptible(char *xml, int indent, int (*xInterrupt)(void*), void *pArg){
+  struct xml_options opt;
+  struct xml_interrupt it;
+  
+  xml_options_init(&opt, indent);
+  xml_interrupt_init(&it, xInterrupt, pArg);
+  opt.interrupt = &it;
+  return xml_convert(xml, -1, &opt);
+}
+
+//
+// xml_to_json_schema
+//
+// Same as xml_to_json(), but arrays are given by a schema compiled by
+// xml_schema_compile(), rather than found by looking for repeated elements.
+//
+char *xml_to_json_schema(char *xml, int indent, xml_schema schema){
+  struct xml_options opt;
+  
+  xml_options_init(&opt, indent);
+  opt.schema = schema;
+  return xml_convert(xml, -1, &opt);
+}
+
+//
+// xml_to_json_typed
+//
+// Same as xml_to_json_schema(), but values that are numbers, or true or
+// false, are output as JSON numbers and booleans. The schema may be null,
+// or override the type of values at its paths.
+//
+char *xml_to_json_typed(char *xml, int indent, xml_schema schema){
+  struct xml_options opt;
+  
+  xml_options_init(&opt, indent);
+  opt.schema = schema;
+  opt.typed = 1;
+  return xml_convert(xml, -1, &opt);
+}
 #endif
 
+#ifdef HAVE_IOVEC
+//
+// xml_to_json_iov
+//
+// Same as xml_to_json(), but the JSON is returned as a list of *pnIov
+// iovecs to be written with writev().
+//
+// Attribute values and text longer than IOV_COPY_MAX reference the
+// original XML string instead of being copied, so xml must not be freed
+// or modified until the iovecs have been written.
+//
+// The iovec list and the generated bytes it references are allocated as
+// a single block, which must be freed. Returns null if xml is not XML, or
+// memory runs out.
+//
+struct iovec *xml_to_json_iov(char *xml, int indent, int *pnIov){
   element root;
-  element current_node = 0;
-  element new_node;
-  element parent_node;
-  element previous_node;
-  element test_node;
-  element next_node;
-  element previous_sibling;
-  element previous_array_node;
-  element test_node_deepest_node;
+  struct arena a = {0, 0, 0, {0, 0, 0, 0}, 0};
+  struct json_buffer out;
+  struct xml_options opt;
   
-  element_attribute new_attr = 0;
-  element_attribute current_attr = 0;
-  element_attribute next_attr;
+  xml_options_init(&opt, indent);
+  root = xml_parse(xml, -1, 0, &a);
+  if( !root ){
+    arena_free(&a);
+    *pnIov = 0;
+    return 0;
+  }
+  xml_group(root, 0, 0);
   
-  value new_value;
-  value current_value;
-  value next_value;
+  // Calculate number of iovecs and generated bytes required
+  memset(&out, 0, sizeof(out));
+  out.iov_mode = 1;
+  json_output(root, root->next, 0, &out, &opt);
   
-  value_part new_value_part = 0;
-  value_part current_value_part = 0;
-  value_part next_value_part = 0;
-
-  int i, j;
-  int depth = 0;
+  // Construct iovecs, followed by the generated bytes
+  out.iov = MALLOC(out.nIov*sizeof(struct iovec) + out.nJson);
+  if( !out.iov ){
+    arena_free(&a);
+    *pnIov = 0;
+    return 0;
+  }
+  out.json = (char *)&out.iov[out.nIov];
+  out.nJson = 0;
+  out.nIov = 0;
+  out.in_gen = 0;
+  json_output(root, root->next, 0, &out, &opt);
   
-  root = (element)MALLOC(sizeof(struct element));
-  root->parent = 0;
-  root->depth = 0;
-  root->first_value = 0;
-  root->is_parent = 0;
-  root->child_index = 0;
-  root->is_last_child = 1;
-  root->array_index = 0;
-  root->is_array_end = 0;
-  root->next = 0;
-  root->first_attr = 0;
+  arena_free(&a);
   
-  previous_node = root;
+  *pnIov = out.nIov;
+  return out.iov;
+}
+#endif
+
+//
+// Tokenizer
+//
+// Reads an XML string one tag, attribute or text at a time, following the
+// same rules as xml_parse(), but without building any elements. Used when
+// only part of a document is needed, or results are produced one at a
+// time. The string must be zero terminated at xml[n].
+//
+#define XML_EOF 0                       // End of XML string
+#define XML_OPEN 1                      // Element open tag, up to the end of its name
+#define XML_ATTR 2                      // Attribute of the element just opened
+#define XML_CLOSE 3                     // Element close tag, or end of self closing tag
+#define XML_TEXT 4                      // Text
+
+typedef struct xml_tokenizer *xml_tokenizer;
+struct xml_tokenizer{
+  char *xml;                            // XML string
+  int n;                                // Length of XML string
+  int i;                                // Offset of next token
+  int depth;                            // Depth of current element
+  int in_tag;                           // True if reading attributes of an open tag
+  int is_parent;                        // True if the current element has had a child
+  char *name;                           // Element or attribute name
+  int nName;                            // Length of name
+  char *val;                            // Attribute value or text, still encoded
+  int nVal;                             // Length of val
+};
+
+static void xml_token_init(xml_tokenizer t, char *xml, int n){
+  memset(t, 0, sizeof(struct xml_tokenizer));
+  t->xml = xml;
+  t->n = n<0 ? (int)strlen(xml) : n;
+  while( is_space(&xml[t->i]) ) t->i++;
+}
+
+//
+// xml_token_next
+//
+// Read the next token, and return its type.
+//
+static int xml_token_next(xml_tokenizer t){
+  char *xml = t->xml;
+  int n = t->n;
+  int i = t->i;
+  int j;
   
-  i = 0;
-  while( is_space(&xml[i]) ) i++;
-  while(xml[i]){
-    // Element open tag
-    //printf("%.*s\n", 1, &xml[i]);
-    if( xml[i]=='<' && xml[i+1]!='/' ){      
-      // Create node
-      depth++;
-      new_node = (element)MALLOC(sizeof(struct element));
-      
-      // Node name
+  t->name = t->val = 0;
+  t->nName = t->nVal = 0;
+  
+  if( t->in_tag ){
+    while( i<n && is_space(&xml[i]) ) i++;
+    
+    // Attribute
+    if( i<n && xml[i]!='/' && xml[i]!='?' && xml[i]!='>' ){
       j = 1;
-      while( xml[i+j] && !is_space(&xml[i+j]) && !(xml[i+j]=='/' || xml[i+j]=='>') ) j++;
-      j--;
-      new_node->name = &xml[i+1];
-      new_node->nName = j;
-      i += j+1;
-      
-      // Default values
-      new_node->first_value = 0;
-      new_node->depth = depth;
-      new_node->is_parent = 0;
-      new_node->array_index = 0;
-      new_node->is_array_end = 0;
-      new_node->next = 0;
-      new_node->child_index = 0;
-      new_node->is_last_child = 0;
-      new_node->first_attr = 0;
-      
-      // Set parent node
-      parent_node = previous_node;
-      while( parent_node->depth >= new_node->depth && parent_node->parent )
-        parent_node = parent_node->parent;
-      new_node->parent = parent_node;
-      
-      if( !parent_node->is_parent )
-        parent_node->is_parent = 1;
-      
-      // Make new node the current node
-      previous_node->next = new_node;
-      previous_node = new_node;
-      current_node = new_node;
-      
-      // printf("%.*s\n", j, current_node->name);
-      // if( parent_node && parent_node->parent )
-      // printf("  Parent = %.*s\n", parent_node->nName, parent_node->name);
+      while( i+j<n && xml[i+j]!='=' && !is_space(&xml[i+j]) ) j++;
+      t->name = &xml[i];
+      t->nName = j;
+      i += j;
       
-      // Get attributes
-      while( is_space(&xml[i]) ) i++;
-      while( xml[i] && xml[i]!='/' && xml[i]!='?' && xml[i]!='>' ){
-        // Create attribute
-        new_attr = (element_attribute)MALLOC(sizeof(struct element_attribute));
-        if( !current_node->first_attr ){
-          current_node->first_attr = new_attr;
-        }else{
-          current_attr->next_attr = new_attr;
-        }
-        current_attr = new_attr;
-        current_attr->first_value_part = 0;
-        current_attr->next_attr = 0;
-        
-        // Attribute name
-        j = 1;
-        while( xml[i+j] && xml[i+j]!='=' && !is_space(&xml[i+j]) ) j++;
-        current_attr->name = &xml[i];
-        current_attr->nName = j;
+      while( i<n && xml[i]!='"' ) i++;
+      if( i<n ){
+        i++;
+        j = 0;
+        while( i+j<n && xml[i+j]!='"' ) j++;
+        t->val = &xml[i];
+        t->nVal = j;
         i += j;
-        
-        // Ensure attribute value starts
-        while( xml[i] && (xml[i]!='"' || is_space(&xml[i])) ) i++;
-        
-        if( xml[i] ){
-          i++;
-          
-          // Ensure attribute value ends
-          j=0;
-          while( xml[i+j] && xml[i+j]!='"' ) j++;
-          
-          if( xml[i+j] ){
-            // Attribute value
-            do{
-              if( !current_attr->first_value_part ){
-                new_value_part = (value_part)MALLOC(sizeof(struct value_part));
-                new_value_part->next_value_part = 0; 
-                current_attr->first_value_part = new_value_part;
-              }else{
-                new_value_part->next_value_part = (value_part)MALLOC(sizeof(struct value_part));
-                new_value_part = new_value_part->next_value_part;
-                new_value_part->next_value_part = 0;
-              }
-
-              new_value_part = get_value_parts(&i, 0, xml, new_value_part, 1);
-            }while( xml[i] && xml[i]!='"' );
-            
-            if( xml[i] == '"' ){
-              i++;
-              while( is_space(&xml[i]) ) i++;
-            }
-          }
-        }
-      }
-      
-      // Self closing element
-      if( xml[i]=='/' || xml[i]=='?' ){
-        current_node = current_node->parent;
-        depth--;
-        while( xml[i] && xml[i]!='>' ) i++;
+        if( i<n ) i++;
       }
-
+      t->i = i;
+      return XML_ATTR;
+    }
+    
+    // Self closing element
+    t->in_tag = 0;
+    if( i<n && (xml[i]=='/' || xml[i]=='?') ){
+      while( i<n && xml[i]!='>' ) i++;
+      t->i = i;
+      t->depth--;
+      t->is_parent = 1;
+      return XML_CLOSE;
+    }
+  }
+  
+  while( i<n ){
+    // Element open tag
+    if( xml[i]=='<' && xml[i+1]!='/' ){
+      j = 1;
+      while( i+j<n && !is_space(&xml[i+j]) && xml[i+j]!='/' && xml[i+j]!='>' ) j++;
+      t->name = &xml[i+1];
+      t->nName = j-1;
+      t->i = i+j;
+      t->in_tag = 1;
+      t->depth++;
+      t->is_parent = 0;
+      return XML_OPEN;
+    }
+    
     // Element close tag
-    }else if( xml[i]=='<' && xml[i+1]=='/' ){
-      current_node = current_node->parent;
+    if( xml[i]=='<' ){
+      while( i<n && xml[i]!='>' ) i++;
+      t->i = i;
+      t->depth--;
+      t->is_parent = 1;
+      return XML_CLOSE;
+    }
+    
+    // Text, unless it is white space between tags
+    i++;
+    j = 0;
+    while( i+j<n && is_space(&xml[i+j]) ) j++;
+    if( i+j<n && (xml[i+j]!='<' || (!t->is_parent && xml[i+j+1]=='/')) ){
+      j = 0;
+      while( i+j<n && xml[i+j]!='<' ) j++;
+      t->val = &xml[i];
+      t->nVal = j;
+      t->i = i+j;
+      return XML_TEXT;
+    }
+    i += j;
+  }
+  
+  t->i = n;
+  return XML_EOF;
+}
+
+//
+// xml_skip_tag
+//
+// Skip the tag starting at xml[i], in the same way as xml_parse(), and
+// return the offset of the closing '>', or of the end of the string.
+//
+static int xml_skip_tag(char *xml, int i, int *pIsSelfClosing){
+  *pIsSelfClosing = 0;
+  
+  // Element close tag
+  if( xml[i+1]=='/' ){
+    while( xml[i] && xml[i]!='>' ) i++;
+    return i;
+  }
+  
+  // Name
+  i++;
+  while( xml[i] && !is_space(&xml[i]) && xml[i]!='/' && xml[i]!='>' ) i++;
+  
+  // Attributes
+  while( xml[i] && xml[i]!='/' && xml[i]!='?' && xml[i]!='>' ){
+    if( xml[i]=='"' ){
+      i++;
+      while( xml[i] && xml[i]!='"' ) i++;
+      if( !xml[i] ) break;
+    }
+    i++;
+  }
+  
+  *pIsSelfClosing = xml[i]=='/' || xml[i]=='?';
+  while( xml[i] && xml[i]!='>' ) i++;
+  return i;
+}
+
+//
+// xml_token_skip
+//
+// Skip the rest of the element just opened, scanning only for tags.
+// Returns XML_CLOSE, or XML_EOF if the string ends first.
+//
+static int xml_token_skip(xml_tokenizer t){
+  char *xml = t->xml;
+  char *z;
+  int i = t->i;
+  int depth = 1;
+  int is_self_closing;
+  
+  // Rest of the open tag
+  if( t->in_tag ){
+    while( i<t->n && xml[i]!='/' && xml[i]!='?' && xml[i]!='>' ){
+      if( xml[i]=='"' ){
+        i++;
+        while( i<t->n && xml[i]!='"' ) i++;
+      }
+      if( i<t->n ) i++;
+    }
+    t->in_tag = 0;
+    if( i<t->n && xml[i]!='>' ){
+      while( i<t->n && xml[i]!='>' ) i++;
+      depth = 0;
+    }
+  }
+  
+  while( depth>0 && (z = memchr(&xml[i], '<', t->n-i)) ){
+    i = xml_skip_tag(xml, z-xml, &is_self_closing);
+    if( z[1]=='/' )
       depth--;
-      while( xml[i] && xml[i]!='>' ) i++;
-      
+    else if( !is_self_closing )
+      depth++;
+  }
+  
+  if( depth>0 ){
+    t->i = t->n;
+    return XML_EOF;
+  }
+  t->i = i;
+  t->depth--;
+  t->is_parent = 1;
+  return XML_CLOSE;
+}
+
+//
+// xml_decode
+//
+// Decode the XML entities in z, writing the text to zOut, which must have
+// room for n bytes. Returns the length of the text.
+//
+static int xml_decode(const char *z, int n, char *zOut){
+  static const struct { const char *zEntity; int nEntity; char c; } aEntity[] = {
+    {"&amp;", 5, '&'},
+    {"&gt;", 4, '>'},
+    {"&lt;", 4, '<'},
+    {"&quot;", 6, '"'},
+    {"&apos;", 6, '\''},
+  };
+  unsigned long x;
+  int i, j, k;
+  int nOut = 0;
+  
+  for(i=0; i<n; i++){
+    if( z[i]!='&' ){
+      zOut[nOut++] = z[i];
+      continue;
+    }
+    
+    for(k=0; k<5; k++){
+      if( i+aEntity[k].nEntity<=n && memcmp(&z[i], aEntity[k].zEntity, aEntity[k].nEntity)==0 )
+        break;
+    }
+    if( k<5 ){
+      zOut[nOut++] = aEntity[k].c;
+      i += aEntity[k].nEntity-1;
+      continue;
+    }
+    
+    // Character reference, written as UTF-8
+    x = 0;
+    j = i+2;
+    if( i+2<n && z[i+1]=='#' && (z[i+2]=='x' || z[i+2]=='X') ){
+      for(j=i+3; j<n && j<i+11 && strchr("0123456789abcdefABCDEF", z[j]) && z[j]; j++)
+        x = x*16 + (z[j]<='9' ? z[j]-'0' : (z[j]|0x20)-'a'+10);
+      if( j==i+3 ) j = n;
+    }else if( i+1<n && z[i+1]=='#' ){
+      for(j=i+2; j<n && j<i+10 && z[j]>='0' && z[j]<='9'; j++)
+        x = x*10 + z[j]-'0';
+      if( j==i+2 ) j = n;
+    }else{
+      j = n;
+    }
+    if( j>=n || z[j]!=';' || x>0x10FFFF ){
+      zOut[nOut++] = '&';
+      continue;
+    }
+    
+    if( x<0x80 ){
+      zOut[nOut++] = x;
+    }else if( x<0x800 ){
+      zOut[nOut++] = 0xC0 | (x>>6);
+      zOut[nOut++] = 0x80 | (x & 0x3F);
+    }else if( x<0x10000 ){
+      zOut[nOut++] = 0xE0 | (x>>12);
+      zOut[nOut++] = 0x80 | ((x>>6) & 0x3F);
+      zOut[nOut++] = 0x80 | (x & 0x3F);
     }else{
+      zOut[nOut++] = 0xF0 | (x>>18);
+      zOut[nOut++] = 0x80 | ((x>>12) & 0x3F);
+      zOut[nOut++] = 0x80 | ((x>>6) & 0x3F);
+      zOut[nOut++] = 0x80 | (x & 0x3F);
+    }
+    i = j;
+  }
+  
+  return nOut;
+}
+
+//
+// Paths
+//
+// A path selects an element, attribute or text by the keys it has in the
+// JSON output, e.g. $.order.item[1].@id or $.order.#text. Names that
+// contain '.' or '[' are quoted, e.g. $."a.b". Unlike a JSON path, an
+// element is selected by its position among siblings of the same name,
+// whether or not they become an array, so $.a.b is the same as $.a.b[0].
+//
+typedef struct xml_path_step *xml_path_step;
+struct xml_path_step{
+  char *name;                           // Element or attribute name
+  int nName;                            // Length of name
+  int index;                            // Position among siblings of the same name
+  int type;                             // XML_OPEN, XML_ATTR or XML_TEXT
+};
+
+typedef struct xml_path *xml_path;
+struct xml_path{
+  xml_path_step aStep;                  // Steps from the root
+  int nStep;                            // Number of steps
+};
+
+//
+// xml_path_compile
+//
+// Compile a path. Returns null if it is not valid, or if memory runs out,
+// in which case *pNomem is set if pNomem is not null. The result must be
+// freed.
+//
+static xml_path xml_path_compile(const char *zPath, int *pNomem){
+  xml_path path;
+  xml_path_step step;
+  int n = strlen(zPath);
+  int nMax = 1;
+  char *z;
+  int i, j;
+  
+  for(i=0; i<n; i++)
+    nMax += zPath[i]=='.';
+  path = MALLOC(sizeof(struct xml_path) + nMax*sizeof(struct xml_path_step) + n+1);
+  if( !path ){
+    if( pNomem )
+      *pNomem = 1;
+    return 0;
+  }
+  path->aStep = (xml_path_step)&path[1];
+  path->nStep = 0;
+  z = (char *)&path->aStep[nMax];
+  memcpy(z, zPath, n+1);
+  
+  if( z[0]!='$' ){
+    FREE(path);
+    return 0;
+  }
+  
+  for(i=1; z[i]; ){
+    // Attributes and text have no children
+    if( z[i]!='.' || (path->nStep && path->aStep[path->nStep-1].type!=XML_OPEN) ){
+      FREE(path);
+      return 0;
+    }
+    i++;
+    
+    step = &path->aStep[path->nStep++];
+    step->type = XML_OPEN;
+    step->index = 0;
+    if( z[i]=='@' ){
+      step->type = XML_ATTR;
       i++;
-      
-      // Get value if it exists, or find the start of the next element
-      j = 0;
-      while( is_space(&xml[i+j]) ) j++;
-      
-      if( xml[i+j]!='<' || (!current_node->is_parent && xml[i+j]=='<' && xml[i+j+1]=='/') ){
-        
-        // Determine the deepest value of this element
-        current_value = current_node->first_value;
-        while( current_value && current_value->next_value )
-          current_value = current_value->next_value;
-        
-        new_value = (value)MALLOC(sizeof(struct value));
-        
-        // Either make the new value the first value of the element,
-        // or link the new value to the previous one
-        if( !current_node->first_value ){
-          current_node->first_value = new_value;
-        }else{
-          current_value->next_value = new_value;
-        }
-        
-        new_value->first_value_part = 0;
-        new_value->next_value = 0;
+    }
+    
+    if( z[i]=='"' ){
+      i++;
+      for(j=0; z[i+j] && z[i+j]!='"'; j++);
+      step->name = &z[i];
+      step->nName = j;
+      i += z[i+j] ? j+1 : j;
+    }else{
+      for(j=0; z[i+j] && z[i+j]!='.' && z[i+j]!='['; j++);
+      step->name = &z[i];
+      step->nName = j;
+      i += j;
+      if( step->type==XML_OPEN && j==5 && memcmp(step->name, "#text", 5)==0 )
+        step->type = XML_TEXT;
+    }
+    
+    if( z[i]=='[' && step->type!=XML_ATTR ){
+      for(i++; z[i]>='0' && z[i]<='9'; i++)
+        step->index = step->index*10 + z[i]-'0';
+      if( z[i]!=']' ){
+        FREE(path);
+        return 0;
+      }
+      i++;
+    }
+    
+    if( step->nName==0 ){
+      FREE(path);
+      return 0;
+    }
+  }
+  
+  return path;
+}
 
-        // Value
-        new_value_part = 0;
-        while( xml[i] && xml[i]!='<' ){
-          if( !new_value->first_value_part ){
-            new_value_part = (value_part)MALLOC(sizeof(struct value_part));
-            new_value_part->next_value_part = 0; 
-            new_value->first_value_part = new_value_part;
+//
+// Extraction
+//
+// Several paths are resolved in a single pass of the tokenizer. Each path
+// keeps track of how many of its steps have been matched, so only the
+// subtrees that some path descends into are tokenized, and the rest are
+// skipped by scanning for tags. The pass stops once every path is resolved.
+//
+typedef struct xml_match *xml_match;
+struct xml_match{
+  xml_path path;                        // Path to resolve
+  int nMatched;                         // Number of steps matched
+  int nSeen;                            // Siblings seen matching the next step
+  int type;                             // XML_OPEN, XML_ATTR or XML_TEXT once found, or XML_EOF
+  int resolved;                         // True once found, or known not to exist
+  char *val;                            // Start of element's XML, attribute value or text
+  int nVal;                             // Length of val
+  int nomem;                            // Set if xml_match_value() ran out of memory
+};
+
+// Resolve a path, returning the number of paths left
+static int xml_match_resolve(xml_match m, int type, char *val, int nVal, int nLeft){
+  m->type = type;
+  m->val = val;
+  m->nVal = nVal;
+  m->resolved = 1;
+  return nLeft-1;
+}
+
+//
+// xml_extract_find
+//
+// Find each path in the XML string. aMatch[i].path must be set for each
+// path, and the rest of each xml_match is filled in.
+//
+static void xml_extract_find(char *xml, int n, xml_match aMatch, int nMatch){
+  struct xml_tokenizer t;
+  xml_path_step step;
+  xml_match m;
+  char *start;
+  int nLeft = nMatch;
+  int type;
+  int descend;
+  int i;
+  
+  for(i=0; i<nMatch; i++){
+    m = &aMatch[i];
+    m->nMatched = m->nSeen = 0;
+    m->type = XML_EOF;
+    m->resolved = 0;
+    m->val = 0;
+    m->nVal = 0;
+    
+    // The whole document
+    if( m->path->nStep==0 )
+      nLeft = xml_match_resolve(m, XML_OPEN, xml, n<0 ? (int)strlen(xml) : n, nLeft);
+  }
+  
+  xml_token_init(&t, xml, n);
+  while( nLeft>0 && (type = xml_token_next(&t))!=XML_EOF ){
+    switch( type ){
+      case XML_OPEN:
+        // Advance the paths waiting for an element of this name
+        start = t.name-1;
+        descend = 0;
+        for(i=0; i<nMatch; i++){
+          m = &aMatch[i];
+          if( m->resolved || m->nMatched!=t.depth-1 ) continue;
+          step = &m->path->aStep[m->nMatched];
+          if( step->type!=XML_OPEN || step->nName!=t.nName
+           || memcmp(step->name, t.name, t.nName)!=0 || m->nSeen++!=step->index )
+            continue;
+          
+          m->nMatched++;
+          m->nSeen = 0;
+          if( m->nMatched==m->path->nStep ){
+            m->type = XML_OPEN;
+            m->val = start;
           }else{
-            new_value_part->next_value_part = (value_part)MALLOC(sizeof(struct value_part));
-            new_value_part = new_value_part->next_value_part;
-            new_value_part->next_value_part = 0;
+            descend = 1;
           }
-          new_value_part = get_value_parts(&i, 0, xml, new_value_part, 0);
-          j = 0;
         }
         
-        // if( new_value_part )
-        //   printf("%.*s=%.*s\n", current_node->nName,
-        //                         current_node->name,
-        //                         new_value_part->nVal,
-        //                         new_value_part->val);
-      }
-      i += j;
+        if( descend )
+          break;
+        type = xml_token_skip(&t);
+        // fall through
+        
+      case XML_CLOSE:
+        // Resolve the paths inside the element just closed
+        for(i=0; i<nMatch; i++){
+          m = &aMatch[i];
+          if( m->resolved || m->nMatched!=t.depth+1 ) continue;
+          if( m->type==XML_OPEN )
+            nLeft = xml_match_resolve(m, XML_OPEN, m->val, &xml[t.i+1] - m->val, nLeft);
+          else
+            nLeft = xml_match_resolve(m, XML_EOF, 0, 0, nLeft);
+        }
+        if( type==XML_EOF )
+          nLeft = 0;
+        break;
+        
+      case XML_ATTR:
+      case XML_TEXT:
+        for(i=0; i<nMatch; i++){
+          m = &aMatch[i];
+          if( m->resolved || m->nMatched!=t.depth || m->nMatched==m->path->nStep ) continue;
+          step = &m->path->aStep[m->nMatched];
+          if( step->type!=type ) continue;
+          if( type==XML_ATTR ? (step->nName==t.nName && memcmp(step->name, t.name, t.nName)==0)
+                             : m->nSeen++==step->index )
+            nLeft = xml_match_resolve(m, type, t.val, t.nVal, nLeft);
+        }
+        break;
     }
   }
   
-  //
-  // Determine first/last nodes in a family
-  //
-  current_node = root;
-  while(current_node->next){
-    current_node = current_node->next;
-    if( !current_node->child_index ){
-      i = 1;
-      test_node = current_node;
-      previous_node = 0;
-      do{
-        if( current_node->parent == test_node->parent ){
-          if( !current_node->child_index )
-            current_node->child_index = 1;
-          
-          if( current_node != test_node )
-            test_node->child_index = ++i;
-          
-          previous_node = test_node;
-        }
-        
-        test_node = test_node->next;
-      }while(test_node && test_node->depth >= current_node->depth );
-      
-      if( previous_node )
-        previous_node->is_last_child = 1;
+  // Elements still open at the end of the string
+  for(i=0; i<nMatch; i++){
+    m = &aMatch[i];
+    if( !m->resolved && m->type==XML_OPEN )
+      m->nVal = &xml[t.n] - m->val;
+  }
+}
+
+// Find the text of an element found for a path. Sets *pVal and *pnVal to
+// its undecoded text and returns 1 if it has only text, returns 0 if it has
+// no content, or -1 if it has attributes or children.
+static int xml_match_text(xml_match m, char **pVal, int *pnVal){
+  struct xml_tokenizer t;
+  int type;
+  
+  xml_token_init(&t, m->val, m->nVal);
+  xml_token_next(&t);
+  type = xml_token_next(&t);
+  if( type==XML_CLOSE )
+    return 0;
+  if( type!=XML_TEXT )
+    return -1;
+  *pVal = t.val;
+  *pnVal = t.nVal;
+  return xml_token_next(&t)==XML_CLOSE ? 1 : -1;
+}
+
+//
+// xml_match_value
+//
+// Return the value found for a path, or null if there is none. Attributes,
+// text and elements with only text are decoded text, and other elements
+// are converted to JSON, in which case *pIsJson is set. Must be freed.
+// Also returns null, and sets m->nomem, if memory runs out.
+//
+static char *xml_match_value(xml_match m, int *pIsJson){
+  struct arena a = {0, 0, 0, {0, 0, 0, 0}, 0};
+  struct json_buffer out;
+  struct xml_options opt;
+  element root;
+  char *val;
+  char *z;
+  int text;
+  int n;
+  
+  *pIsJson = 0;
+  m->nomem = 0;
+  if( m->type==XML_EOF )
+    return 0;
+  
+  if( m->type==XML_OPEN ){
+    // Text or null for an element with only text, or no content
+    text = m->path->nStep ? xml_match_text(m, &val, &n) : -1;
+    if( text==0 )
+      return 0;
+    if( text>0 ){
+      z = MALLOC(n+1);
+      if( !z ){
+        m->nomem = 1;
+        return 0;
+      }
+      z[xml_decode(val, n, z)] = 0;
+      return z;
+    }
+    
+    // The element's JSON, without its name, or the whole document
+    root = xml_parse(m->val, m->nVal, 0, &a);
+    if( !root ){
+      m->nomem = a.nomem;
+      arena_free(&a);
+      return 0;
+    }
+    xml_group(root, 0, 0);
+    xml_options_init(&opt, -1);
+    memset(&out, 0, sizeof(out));
+    n = json_output(root, root->next, 0, &out, &opt);
+    out.json = MALLOC(n+1);
+    if( !out.json ){
+      arena_free(&a);
+      m->nomem = 1;
+      return 0;
     }
+    out.nJson = 0;
+    json_output(root, root->next, 0, &out, &opt);
+    if( m->path->nStep && root->next ){
+      n -= root->next->symbol->nKey + 2;
+      memmove(out.json, &out.json[root->next->symbol->nKey+1], n);
+    }
+    out.json[n] = 0;
+    arena_free(&a);
+    
+    *pIsJson = 1;
+    return out.json;
   }
   
-  //
-  // Determine and group arrays
-  //
-  current_node = root;
-  while(current_node->next){
-    current_node = current_node->next;
-    if( !current_node->array_index ){
-      i = 1;
-      test_node = current_node;
-      previous_array_node = 0;
-      while(test_node->next && test_node->depth >= current_node->depth){
-        test_node = test_node->next;
-        if( current_node->parent == test_node->parent 
-            && current_node->nName == test_node->nName 
-            && memcmp(current_node->name, test_node->name, test_node->nName) == 0){
-          if( !current_node->array_index ){
-            current_node->array_index = 1;
-            previous_array_node = current_node; 
-          }
-          test_node->array_index = ++i;
-          
-          //
-          // Re-order if array elements are separated
-          //
-          // e.g. <a>
-          //        <b>1</b>
-          //        <c/>
-          //        <b>2</b>
-          //      </a>
-          //
-          //      becomes:
-          //
-          //      <a>
-          //        <b>1</b>
-          //        <b>2</b>
-          //        <c/>
-          //      </a>
-          //
-          if( test_node->child_index != previous_array_node->child_index+1 ){
-            
-            next_node = previous_array_node->next;
-            previous_sibling = next_node;
+  z = MALLOC(m->nVal+1);
+  if( !z ){
+    m->nomem = 1;
+    return 0;
+  }
+  z[xml_decode(m->val, m->nVal, z)] = 0;
+  return z;
+}
 
-            //
-            // Get the node that the furthest child of the test node points to
-            //
-            test_node_deepest_node = test_node;
-            if( test_node_deepest_node->next ){
-              while( test_node_deepest_node->next->depth > test_node->depth)
-                test_node_deepest_node = test_node_deepest_node->next;
-            }
-            
-            // Shift up each sibling node that sits between the previous array element and the test node
-            while( next_node->next != test_node ){
-              if( previous_array_node->parent == next_node->parent ){
-                previous_sibling = next_node;
-                previous_sibling->child_index++;
-              }
-              next_node = next_node->next;
-            }
-            if( previous_array_node->parent == next_node->parent ){
-              previous_sibling = next_node;
-              previous_sibling->child_index++;
-            }
-            
-            // Set test node's previous node to point to the test node's next node
-            next_node->next = test_node_deepest_node->next;
-            
-            // If the test node was the last child,
-            // then flag the last array element as the last child,
-            // and un-flag the test node
-            if( test_node->is_last_child ){
-              previous_sibling->is_last_child = 1;
-              test_node->is_last_child = 0;
-            }
-            
-            // Set the test node to be the next adjacent sibling to the 
-            // previous array element
-            test_node->child_index = previous_array_node->child_index+1;
+//
+// xml_extract
+//
+// Return the value at a path in the XML string, reading only as much of
+// the XML as needed. Attributes, text and elements with only text are
+// returned as text, and other elements as JSON. Returns null if the path
+// is not valid or not found, or the element is empty. Must be freed.
+//
+//   e.g. xml_extract("<a><b id=\"1\">x</b></a>", "$.a.b.@id") returns "1"
+//
+// The SQLite extension has xml_extract() as an SQL function instead.
+//
+#ifndef SQLITE
+char *xml_extract(char *xml, const char *zPath){
+  struct xml_match m;
+  char *z;
+  int is_json;
+  
+  m.path = xml_path_compile(zPath, 0);
+  if( !m.path )
+    return 0;
+  
+  xml_extract_find(xml, -1, &m, 1);
+  z = xml_match_value(&m, &is_json);
+  FREE(m.path);
+  return z;
+}
+#endif
 
-            //
-            // Get the node that the furthest child of the previous array node points to
-            //
-            next_node = previous_array_node;
-            do{
-              previous_node = next_node;
-              next_node = next_node->next;
-            }while( next_node->parent != previous_array_node->parent );
-            
-            previous_node->next = test_node;
-            test_node_deepest_node->next = next_node;
-          }
+//
+// Schemas
+//
+// A schema fixes the shape of the JSON, so that arrays do not have to be
+// found by xml_group(). It is a list of paths, separated by spaces or
+// commas, in the same form as for xml_extract():
+//
+//   $.a.b[]    b elements in a are an array, even if there is only one
+//   $.a.b      b elements in a are never an array, and only the first is kept
+//   -$.a.b     b elements in a are dropped, with their children
+//   -$.a.@c    c attributes of a are dropped
+//
+// An element or attribute may be followed by :string, :number or :boolean,
+// e.g. $.a.b[]:number or $.a.@c:string, to override how its values are
+// typed (see xml_value_kind()). Names ending in one of these are quoted.
+//
+// Elements not in the schema are an array if they repeat, as they are
+// without a schema. Text from a # to the end of the line is a comment.
+//
+#define XML_SCHEMA_ANY 0                // Only on the path to others, so as without a schema
+#define XML_SCHEMA_SCALAR 1
+#define XML_SCHEMA_ARRAY 2
+#define XML_SCHEMA_DROP 3
+
+struct xml_schema{
+  char *name;                           // Element or attribute name, or the schema's text at the root
+  int nName;                            // Length of name
+  int type;                             // XML_SCHEMA_ANY, _SCALAR, _ARRAY or _DROP
+  int is_attr;                          // True for an attribute
+  int value_type;                       // XML_VALUE_AUTO, _STRING, _NUMBER or _BOOLEAN
+  int index;                            // Position among its parent's children
+  int nChild;                           // Number of children
+  struct xml_schema *first_child;       // Link to first child
+  struct xml_schema *next_sibling;      // Link to next child of the same parent
+};
+
+// Child of a schema node with the name given, or null
+static xml_schema xml_schema_child(xml_schema parent, char *z, int n, int is_attr){
+  xml_schema child;
+  
+  for(child=parent->first_child; child; child=child->next_sibling){
+    if( child->nName==n && child->is_attr==is_attr && memcmp(child->name, z, n)==0 )
+      break;
+  }
+  return child;
+}
+
+//
+// xml_schema_compile
+//
+// Compile a schema. Returns null if it is not valid. The result is a single
+// allocation, which must be freed.
+//
+#ifdef SQLITE
+static xml_schema xml_schema_compile(const char *zSchema){
+#else
+xml_schema xml_schema_compile(const char *zSchema){
+#endif
+  xml_schema schema;
+  xml_schema node;
+  xml_schema child;
+  xml_path path;
+  xml_path_step step;
+  char *zEntry;
+  char *zName;
+  int n = strlen(zSchema);
+  static const char *azType[] = {0, ":string", ":number", ":boolean"};
+  int nNode = 1;
+  int nEntry;
+  int nType;
+  int type;
+  int value_type;
+  int in_quote;
+  int i, j, k;
+  
+  // Each step of each path may add a node, and names are copied after them
+  for(i=0; i<n; i++)
+    nNode += zSchema[i]=='.';
+  schema = MALLOC(nNode*sizeof(struct xml_schema) + 2*(n+1));
+  zEntry = MALLOC(n+1);
+  if( !schema || !zEntry ){
+    FREE(schema);
+    FREE(zEntry);
+    return 0;
+  }
+  memset(schema, 0, sizeof(struct xml_schema));
+  zName = (char *)&schema[nNode];
+  memcpy(zName, zSchema, n+1);
+  schema->name = zName;
+  schema->nName = n;
+  zName += n+1;
+  nNode = 1;
+  
+  for(i=0; zSchema[i]; i=j){
+    while( zSchema[i]==',' || is_space((char *)&zSchema[i]) ) i++;
+    if( !zSchema[i] )
+      break;
+    
+    // Comments, to the end of the line
+    if( zSchema[i]=='#' ){
+      for(j=i; zSchema[j] && zSchema[j]!='\n'; j++);
+      continue;
+    }
+    for(j=i, in_quote=0; zSchema[j] && (in_quote || (zSchema[j]!=',' && !is_space((char *)&zSchema[j]))); j++){
+      if( zSchema[j]=='"' )
+        in_quote = !in_quote;
+    }
+    
+    type = XML_SCHEMA_SCALAR;
+    if( zSchema[i]=='-' ){
+      type = XML_SCHEMA_DROP;
+      i++;
+    }
+    nEntry = j-i;
+    memcpy(zEntry, &zSchema[i], nEntry);
+    zEntry[nEntry] = 0;
+    
+    // Type of its values
+    value_type = XML_VALUE_AUTO;
+    for(k=XML_VALUE_STRING; k<=XML_VALUE_BOOLEAN; k++){
+      nType = strlen(azType[k]);
+      if( nEntry>nType && memcmp(&zEntry[nEntry-nType], azType[k], nType)==0 ){
+        value_type = k;
+        nEntry -= nType;
+        zEntry[nEntry] = 0;
+        break;
+      }
+    }
+    if( type==XML_SCHEMA_SCALAR && nEntry>2 && zEntry[nEntry-2]=='[' && zEntry[nEntry-1]==']' ){
+      type = XML_SCHEMA_ARRAY;
+      zEntry[nEntry-2] = 0;
+    }
+    
+    // Only elements, and attributes to drop or type, without positions
+    path = type==XML_SCHEMA_DROP && value_type ? 0 : xml_path_compile(zEntry, 0);
+    for(k=0, in_quote=0; path && zEntry[k]; k++){
+      if( zEntry[k]=='"' )
+        in_quote = !in_quote;
+      if( zEntry[k]=='[' && !in_quote ){
+        FREE(path);
+        path = 0;
+      }
+    }
+    for(k=0; path && k<path->nStep; k++){
+      step = &path->aStep[k];
+      if( step->type==XML_TEXT || (step->type==XML_ATTR && type!=XML_SCHEMA_DROP
+                                   && (type!=XML_SCHEMA_SCALAR || !value_type)) ){
+        FREE(path);
+        path = 0;
+      }
+    }
+    if( !path || path->nStep==0 ){
+      FREE(path);
+      FREE(zEntry);
+      FREE(schema);
+      return 0;
+    }
+    
+    node = schema;
+    for(k=0; k<path->nStep; k++){
+      step = &path->aStep[k];
+      child = xml_schema_child(node, step->name, step->nName, step->type==XML_ATTR);
+      if( !child ){
+        child = &schema[nNode++];
+        memset(child, 0, sizeof(struct xml_schema));
+        memcpy(zName, step->name, step->nName);
+        child->name = zName;
+        child->nName = step->nName;
+        child->is_attr = step->type==XML_ATTR;
+        child->index = node->nChild++;
+        child->next_sibling = node->first_child;
+        node->first_child = child;
+        zName += step->nName;
+      }
+      node = child;
+    }
+    node->type = type;
+    node->value_type = value_type;
+    FREE(path);
+  }
+  
+  FREE(zEntry);
+  return schema;
+}
+
+//
+// Schema inference
+//
+// Infers a schema from sample documents, read with the tokenizer. For each
+// path, records whether it repeats within its parent, has attributes or
+// mixed text, and whether its values are all numbers or booleans. The
+// schema lists each element as an array if it repeated in any sample,
+// otherwise as a single value, and the type of the values of each element
+// and attribute, so the output has the same shape and types for every
+// document of the feed, e.g.
+//
+//   $.order
+//   $.order.@id:number
+//   $.order.item[]       # attributes, mixed text
+//   $.order.item.@sku:string
+//
+// Empty values are ignored, as they are empty strings with any type.
+//
+#define XML_INFER_DEPTH 256             // Depth of elements recorded
+
+typedef struct infer_node *infer_node;
+struct infer_node{
+  char *name;                           // Element or attribute name, copied after the node
+  int nName;                            // Length of name
+  int is_attr;                          // True for an attribute
+  int repeats;                          // True if it repeated within a parent
+  int has_attr;                         // True if it had attributes
+  int is_mixed;                         // True if it had text and children
+  int nValue;                           // Number of values, not counting empty ones
+  int nNumber;                          // Number of values that are numbers
+  int nBoolean;                         // Number of values that are true or false
+  unsigned int last_parent;             // Instance of the parent it was last seen in
+  struct infer_node *parent;            // Parent, or null at the root
+  struct infer_node *first_child;       // Children, in the order first seen
+  struct infer_node *last_child;
+  struct infer_node *next_sibling;
+  struct infer_node *next_hash;         // Next in the same hash bucket
+};
+
+typedef struct xml_infer *xml_infer;
+struct xml_infer{
+  struct infer_node root;               // Document, whose children are document elements
+  infer_node *aHash;                    // Nodes by parent and name
+  int nHash;                            // Number of buckets, a power of 2
+  int nNode;                            // Number of nodes
+  unsigned int nInstance;               // Elements seen, to number each one
+  int nSample;                          // Samples added
+};
+
+static void xml_infer_free(xml_infer p){
+  infer_node node;
+  int i;
+  
+  for(i=0; i<p->nHash; i++){
+    while( (node = p->aHash[i]) ){
+      p->aHash[i] = node->next_hash;
+      FREE(node);
+    }
+  }
+  FREE(p->aHash);
+  memset(p, 0, sizeof(struct xml_infer));
+}
+
+static unsigned int xml_infer_hash(infer_node parent, char *z, int n, int is_attr){
+  unsigned int x = (unsigned int)(size_t)parent ^ is_attr;
+  int i;
+  
+  for(i=0; i<n; i++)
+    x = (x ^ (unsigned char)z[i]) * 16777619;
+  return x;
+}
+
+// Child of parent with the name given, added if it is new. Returns null if
+// out of memory.
+static infer_node xml_infer_child(xml_infer p, infer_node parent, char *z, int n, int is_attr){
+  infer_node node;
+  infer_node *aHash;
+  unsigned int x = xml_infer_hash(parent, z, n, is_attr);
+  int i;
+  
+  for(node=p->nHash ? p->aHash[x & (p->nHash-1)] : 0; node; node=node->next_hash){
+    if( node->parent==parent && node->is_attr==is_attr && node->nName==n && memcmp(node->name, z, n)==0 )
+      return node;
+  }
+  
+  // Twice as many buckets as nodes
+  if( p->nNode*2 >= p->nHash ){
+    aHash = MALLOC((p->nHash ? p->nHash*2 : 64)*sizeof(infer_node));
+    if( !aHash )
+      return 0;
+    memset(aHash, 0, (p->nHash ? p->nHash*2 : 64)*sizeof(infer_node));
+    for(i=0; i<p->nHash; i++){
+      while( (node = p->aHash[i]) ){
+        p->aHash[i] = node->next_hash;
+        node->next_hash = aHash[xml_infer_hash(node->parent, node->name, node->nName, node->is_attr) & (p->nHash*2-1)];
+        aHash[xml_infer_hash(node->parent, node->name, node->nName, node->is_attr) & (p->nHash*2-1)] = node;
+      }
+    }
+    FREE(p->aHash);
+    p->aHash = aHash;
+    p->nHash = p->nHash ? p->nHash*2 : 64;
+  }
+  
+  node = MALLOC(sizeof(struct infer_node) + n);
+  if( !node )
+    return 0;
+  memset(node, 0, sizeof(struct infer_node));
+  node->name = (char *)&node[1];
+  memcpy(node->name, z, n);
+  node->nName = n;
+  node->is_attr = is_attr;
+  node->parent = parent;
+  if( parent->last_child )
+    parent->last_child->next_sibling = node;
+  else
+    parent->first_child = node;
+  parent->last_child = node;
+  node->next_hash = p->aHash[x & (p->nHash-1)];
+  p->aHash[x & (p->nHash-1)] = node;
+  p->nNode++;
+  return node;
+}
+
+// Record the type of a value, still encoded. Values with references are
+// always strings, as they are when converted.
+static void xml_infer_value(infer_node node, char *z, int n){
+  struct value_part part;
+  int kind;
+  
+  if( n==0 )
+    return;
+  node->nValue++;
+  if( memchr(z, '&', n) )
+    return;
+  part.val = z;
+  part.nVal = n;
+  part.next_value_part = 0;
+  kind = xml_value_kind(&part, XML_VALUE_AUTO, 1);
+  if( kind==VALUE_INTEGER || kind==VALUE_REAL )
+    node->nNumber++;
+  else if( kind==VALUE_TRUE || kind==VALUE_FALSE )
+    node->nBoolean++;
+}
+
+//
+// xml_infer_add
+//
+// Add a sample XML string of length n, or zero terminated if n is
+// negative. Returns 0, or 1 if out of memory.
+//
+static int xml_infer_add(xml_infer p, char *xml, int n){
+  struct xml_tokenizer t;
+  infer_node aNode[XML_INFER_DEPTH];
+  unsigned int aInstance[XML_INFER_DEPTH];
+  unsigned char aText[XML_INFER_DEPTH];
+  unsigned char aChild[XML_INFER_DEPTH];
+  infer_node node;
+  int nFrame = 1;
+  int nSkip = 0;
+  int type;
+  
+  aNode[0] = &p->root;
+  aInstance[0] = ++p->nInstance;
+  aText[0] = aChild[0] = 0;
+  p->nSample++;
+  
+  xml_token_init(&t, xml, n);
+  while( (type = xml_token_next(&t))!=XML_EOF ){
+    // Elements deeper than XML_INFER_DEPTH are not recorded
+    if( nSkip ){
+      nSkip += type==XML_OPEN ? 1 : type==XML_CLOSE ? -1 : 0;
+      continue;
+    }
+    
+    switch( type ){
+      case XML_OPEN:
+        if( nFrame==XML_INFER_DEPTH ){
+          nSkip = 1;
+          break;
+        }
+        node = xml_infer_child(p, aNode[nFrame-1], t.name, t.nName, 0);
+        if( !node )
+          return 1;
+        if( node->last_parent==aInstance[nFrame-1] )
+          node->repeats = 1;
+        node->last_parent = aInstance[nFrame-1];
+        aChild[nFrame-1] = 1;
+        aNode[nFrame] = node;
+        aInstance[nFrame] = ++p->nInstance;
+        aText[nFrame] = aChild[nFrame] = 0;
+        nFrame++;
+        break;
         
-          previous_array_node = test_node;
+      case XML_ATTR:
+        node = xml_infer_child(p, aNode[nFrame-1], t.name, t.nName, 1);
+        if( !node )
+          return 1;
+        aNode[nFrame-1]->has_attr = 1;
+        xml_infer_value(node, t.val, t.nVal);
+        break;
+        
+      case XML_TEXT:
+        if( nFrame>1 ){
+          aText[nFrame-1] = 1;
+          xml_infer_value(aNode[nFrame-1], t.val, t.nVal);
         }
-      }
-      if( previous_array_node )
-        previous_array_node->is_array_end = 1;
+        break;
+        
+      case XML_CLOSE:
+        if( nFrame>1 ){
+          nFrame--;
+          if( aText[nFrame] && aChild[nFrame] )
+            aNode[nFrame]->is_mixed = 1;
+        }
+        break;
     }
   }
+  return 0;
+}
+
+// True if a name must be quoted in a path
+static int xml_infer_quote(infer_node node){
+  static const char *azType[] = {":string", ":number", ":boolean"};
+  int i, k;
   
-#ifdef DEBUG
-  current_node = root;
-  while(current_node->next){
-    current_node = current_node->next;
-   
-    printf("%.*s\n", current_node->nName, current_node->name);
-    if( current_node->parent && current_node->parent->parent )
-      printf("  Parent = %.*s\n", current_node->parent->nName, current_node->parent->name);
+  for(i=0; i<node->nName; i++){
+    if( strchr(".[],\"", node->name[i]) )
+      return 1;
+  }
+  for(k=0; k<3; k++){
+    i = strlen(azType[k]);
+    if( node->nName>=i && memcmp(&node->name[node->nName-i], azType[k], i)==0 )
+      return 1;
+  }
+  return 0;
+}
+
+// Write the path of node to z, if z is not null, and return its length
+static int xml_infer_path(infer_node node, char *z){
+  int n = 0;
+  int q;
+  
+  if( !node->parent ){
+    if( z )
+      z[0] = '$';
+    return 1;
+  }
+  n = xml_infer_path(node->parent, z);
+  q = xml_infer_quote(node);
+  if( z ){
+    z[n] = '.';
+    if( node->is_attr )
+      z[n+1] = '@';
+    if( q )
+      z[n+1+node->is_attr] = '"';
+    memcpy(&z[n+1+node->is_attr+q], node->name, node->nName);
+    if( q )
+      z[n+1+node->is_attr+q+node->nName] = '"';
+  }
+  return n + 1 + node->is_attr + 2*q + node->nName;
+}
+
+// Write the schema entries of node and its descendants to z, if z is not
+// null, and return their length
+static int xml_infer_entries(infer_node node, char *z){
+  infer_node child;
+  const char *zType = 0;
+  char zNote[40];
+  int n = 0;
+  int nPath;
+  
+  if( node->parent ){
+    if( node->nValue==0 )
+      zType = "";
+    else if( node->nNumber==node->nValue )
+      zType = ":number";
+    else if( node->nBoolean==node->nValue )
+      zType = ":boolean";
+    else
+      zType = ":string";
     
-    printf("  depth = %d\n", current_node->depth);
-    printf("  is_parent = %d\n", current_node->is_parent);
-    printf("  child_index = %d\n", current_node->child_index);
+    // Names with quotes can not be in a path, and attributes need a type
+    if( memchr(node->name, '"', node->nName) || (node->is_attr && !*zType) ){
+      zType = 0;
+    }else{
+      zNote[0] = 0;
+      if( node->has_attr || node->is_mixed ){
+        strcpy(zNote, "  #");
+        if( node->has_attr )
+          strcat(zNote, " attributes,");
+        if( node->is_mixed )
+          strcat(zNote, " mixed text,");
+        zNote[strlen(zNote)-1] = 0;
+      }
+      nPath = xml_infer_path(node, z);
+      n = nPath + (node->repeats ? 2 : 0) + strlen(zType) + strlen(zNote) + 1;
+      if( z ){
+        sprintf(&z[nPath], "%s%s%s\n", node->repeats ? "[]" : "", zType, zNote);
+        z += n;
+      }
+    }
+  }
+  
+  // Children of elements whose names can not be in a path are left out
+  if( zType || !node->parent ){
+    for(child=node->first_child; child; child=child->next_sibling){
+      nPath = xml_infer_entries(child, z);
+      n += nPath;
+      if( z )
+        z += nPath;
+    }
+  }
+  return n;
+}
+
+//
+// xml_infer_text
+//
+// Return the schema inferred from the samples added, one entry per line,
+// which must be freed. Returns null if out of memory.
+//
+static char *xml_infer_text(xml_infer p){
+  int n = xml_infer_entries(&p->root, 0);
+  char *z = MALLOC(n+1);
+  
+  if( z ){
+    xml_infer_entries(&p->root, z);
+    z[n] = 0;
+  }
+  return z;
+}
+
+#ifndef SQLITE
+//
+// xml_infer_schema
+//
+// Infer a schema from nXml sample XML strings, in the form taken by
+// xml_schema_compile(). The result must be freed. Returns null if out of
+// memory.
+//
+char *xml_infer_schema(char **aXml, int nXml){
+  struct xml_infer p;
+  char *zSchema = 0;
+  int i;
+  
+  memset(&p, 0, sizeof(p));
+  for(i=0; i<nXml; i++){
+    if( xml_infer_add(&p, aXml[i], -1) )
+      break;
+  }
+  if( i==nXml )
+    zSchema = xml_infer_text(&p);
+  xml_infer_free(&p);
+  return zSchema;
+}
+#endif
+
+//
+// Well formed check
+//
+// Checks an XML string by the rules of the converter, scanning it without
+// building elements. Text and attribute values are searched for the bytes
+// that need a closer look eight at a time, with the bytes of a 64-bit word
+// compared in parallel, and only tags and references are read a byte at a
+// time.
+//
+#define XML_WELL_FORMED_DEPTH 64        // Open elements tracked without allocating
+
+#define WF_NAME_START 1                 // Byte may start a name
+#define WF_NAME 2                       // Byte may be in a name
+#define WF_SPACE 4                      // White space
+
+// Classes of bytes: 3 is WF_NAME_START | WF_NAME
+static const unsigned char aWellFormedClass[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 4, 4, 0, 4, 4, 0, 0,   // 00
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,   // 10
+  4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 0,   // 20
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 0, 0, 0, 0, 0,   // 30
+  0, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,   // 40
+  3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 0, 0, 0, 0, 3,   // 50
+  0, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,   // 60
+  3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 0, 0, 0, 0, 0,   // 70
+  3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,   // 80
+  3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,   // 90
+  3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,   // a0
+  3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,   // b0
+  3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,   // c0
+  3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,   // d0
+  3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,   // e0
+  3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3    // f0
+};
+
+// True if a word has a byte equal to the byte repeated in b
+#define WORD_ONES 0x0101010101010101ULL
+#define WORD_HIGHS 0x8080808080808080ULL
+#define WORD_HAS(w, b) ((((w)^(b)) - WORD_ONES) & ~((w)^(b)) & WORD_HIGHS)
+
+// Find the first c1, c2 or c3 in z, or return end
+static const char *xml_scan3(const char *z, const char *end, char c1, char c2, char c3){
+  unsigned long long w;
+  unsigned long long b1 = WORD_ONES * (unsigned char)c1;
+  unsigned long long b2 = WORD_ONES * (unsigned char)c2;
+  unsigned long long b3 = WORD_ONES * (unsigned char)c3;
+#ifdef __SSE2__
+  __m128i v;
+  __m128i v1 = _mm_set1_epi8(c1);
+  __m128i v2 = _mm_set1_epi8(c2);
+  __m128i v3 = _mm_set1_epi8(c3);
+  int mask;
+  
+  while( end-z>=16 ){
+    v = _mm_loadu_si128((const __m128i *)z);
+    mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, v1),
+                                                       _mm_cmpeq_epi8(v, v2)),
+                                          _mm_cmpeq_epi8(v, v3)));
+    if( mask )
+      return z + __builtin_ctz(mask);
+    z += 16;
+  }
+#endif
+  
+  while( end-z>=8 ){
+    memcpy(&w, z, 8);
+    if( WORD_HAS(w, b1) | WORD_HAS(w, b2) | WORD_HAS(w, b3) )
+      break;
+    z += 8;
+  }
+  while( z<end && *z!=c1 && *z!=c2 && *z!=c3 ) z++;
+  return z;
+}
+
+// Length of the name at z, or 0 if there is none
+static int xml_name_length(const char *z, const char *end){
+  const char *p = z;
+  
+  if( p==end || !(aWellFormedClass[(unsigned char)*p] & WF_NAME_START) )
+    return 0;
+  for(p++; p<end && (aWellFormedClass[(unsigned char)*p] & WF_NAME); p++);
+  return p-z;
+}
+
+// Skip the reference after the '&' at z[-1], returning the end of it, or
+// null if it is not a character reference or a predefined entity
+static const char *xml_reference(const char *z, const char *end){
+  static const struct { const char *zName; int nName; } aEntity[] = {
+    {"amp;", 4}, {"lt;", 3}, {"gt;", 3}, {"quot;", 5}, {"apos;", 5},
+  };
+  const char *p;
+  int k;
+  
+  if( z<end && *z=='#' ){
+    p = ++z;
+    if( z<end && *z=='x' ){
+      for(p = ++z; z<end && ((*z>='0' && *z<='9') || ((*z|0x20)>='a' && (*z|0x20)<='f')); z++);
+    }else{
+      for(; z<end && *z>='0' && *z<='9'; z++);
+    }
+    return z>p && z<end && *z==';' ? z+1 : 0;
+  }
+  for(k=0; k<5; k++){
+    if( end-z>=aEntity[k].nName && memcmp(z, aEntity[k].zName, aEntity[k].nName)==0 )
+      return z+aEntity[k].nName;
+  }
+  return 0;
+}
+
+//
+// xml_well_formed
+//
+// Return 1 if the XML string of length n, or zero terminated if n is
+// negative, is well formed, otherwise 0. There must be one root element,
+// with close tags matching open tags, attribute values in double quotes,
+// and no '<' or unknown entities in text or attribute values. <?xml ...?>
+// declarations may come before the root. As the converter does not read
+// comments, CDATA sections or DOCTYPE, they are not well formed here, and
+// neither are elements nested more than 100,000 deep. Duplicate attributes
+// are not checked for. Nothing is allocated unless elements are nested
+// more than XML_WELL_FORMED_DEPTH deep.
+//
+#ifdef SQLITE
+static int xml_well_formed(const char *xml, int n){
+#else
+int xml_well_formed(const char *xml, int n){
+#endif
+  int aStatic[XML_WELL_FORMED_DEPTH];
+  int *aOpen = aStatic;
+  int nOpenAlloc = XML_WELL_FORMED_DEPTH;
+  int depth = 0;
+  int nRoot = 0;
+  int ok = 0;
+  const char *end;
+  const char *z;
+  const char *p;
+  int nName;
+  int *aNew;
+  
+  if( n<0 )
+    n = strlen(xml);
+  z = xml;
+  end = xml+n;
+  
+  for(;;){
+    // White space outside the root, or text with references
+    if( depth==0 ){
+      while( z<end && (aWellFormedClass[(unsigned char)*z] & WF_SPACE) ) z++;
+    }else{
+      while( (z = xml_scan3(z, end, '<', '&', '<'))<end && *z=='&' ){
+        z = xml_reference(z+1, end);
+        if( !z )
+          goto well_formed_end;
+      }
+    }
+    if( z==end )
+      break;
+    if( *z!='<' )
+      goto well_formed_end;
+    z++;
+    
+    // Declaration before the root element
+    if( z<end && *z=='?' ){
+      if( nRoot>0 || depth>0 || !xml_name_length(z+1, end) )
+        goto well_formed_end;
+      for(p=z; (p = memchr(p, '>', end-p)) && p[-1]!='?'; p++);
+      if( !p )
+        goto well_formed_end;
+      z = p+1;
+      continue;
+    }
+    
+    // Close tag, which must match the open tag
+    if( z<end && *z=='/' ){
+      z++;
+      nName = xml_name_length(z, end);
+      if( depth==0 || nName==0 )
+        goto well_formed_end;
+      p = &xml[aOpen[--depth]];
+      if( memcmp(p, z, nName)!=0 || xml_name_length(p, end)!=nName )
+        goto well_formed_end;
+      for(z+=nName; z<end && (aWellFormedClass[(unsigned char)*z] & WF_SPACE); z++);
+      if( z==end || *z!='>' )
+        goto well_formed_end;
+      z++;
+      continue;
+    }
+    
+    // Open tag
+    nName = xml_name_length(z, end);
+    if( nName==0 || (depth==0 && nRoot++>0) )
+      goto well_formed_end;
+    if( depth==nOpenAlloc ){
+      if( depth>=100000 )
+        goto well_formed_end;
+      aNew = MALLOC(2*nOpenAlloc*sizeof(int));
+      if( !aNew )
+        goto well_formed_end;
+      memcpy(aNew, aOpen, depth*sizeof(int));
+      if( aOpen!=aStatic )
+        FREE(aOpen);
+      aOpen = aNew;
+      nOpenAlloc *= 2;
+    }
+    aOpen[depth++] = z-xml;
+    z += nName;
+    
+    // Attributes, each after white space
+    for(;;){
+      p = z;
+      while( z<end && (aWellFormedClass[(unsigned char)*z] & WF_SPACE) ) z++;
+      if( z==end )
+        goto well_formed_end;
+      if( *z=='>' ){
+        z++;
+        break;
+      }
+      if( *z=='/' ){
+        if( z+1==end || z[1]!='>' )
+          goto well_formed_end;
+        depth--;
+        z += 2;
+        break;
+      }
+      nName = xml_name_length(z, end);
+      if( p==z || nName==0 )
+        goto well_formed_end;
+      for(z+=nName; z<end && (aWellFormedClass[(unsigned char)*z] & WF_SPACE); z++);
+      if( z==end || *z!='=' )
+        goto well_formed_end;
+      for(z++; z<end && (aWellFormedClass[(unsigned char)*z] & WF_SPACE); z++);
+      if( z==end || *z!='"' )
+        goto well_formed_end;
+      
+      // Value, with references but no '<'
+      z++;
+      while( (z = xml_scan3(z, end, '"', '&', '<'))<end && *z=='&' ){
+        z = xml_reference(z+1, end);
+        if( !z )
+          goto well_formed_end;
+      }
+      if( z==end || *z!='"' )
+        goto well_formed_end;
+      z++;
+    }
+  }
+  ok = depth==0 && nRoot==1;
+  
+well_formed_end:
+  if( aOpen!=aStatic )
+    FREE(aOpen);
+  return ok;
+}
+
+//
+// Record reader
+//
+// Streams the elements at a record path from a file, reading it a chunk at
+// a time and keeping only the current record in memory. Only tags are
+// looked at, with the same rules as xml_skip_tag(), and elements off the
+// record path are skipped without being parsed. Positions in the record
+// path are ignored, so every element at the path is a record.
+//
+#define XML_READER_CHUNK (64*1024)      // Bytes read from the file at a time
+#define XML_READER_NOMEM 1              // Out of memory
+#define XML_READER_IOERR 2              // Error reading the file
+
+typedef struct xml_reader *xml_reader;
+struct xml_reader{
+  FILE *f;                              // File, or null once read to the end
+  int error;                            // XML_READER_NOMEM, XML_READER_IOERR or 0
+  char *z;                              // Buffered part of file, zero terminated
+  int n;                                // Length of z
+  int nAlloc;                           // Allocated size of z
+  int i;                                // Offset in z of the next tag
+  xml_path record;                      // Record path
+  int nMatched;                         // Open elements matching the record path
+  int iRecord;                          // Offset in z of the current record, or -1
+  int nRecord;                          // Length of the current record
+};
+
+//
+// xml_reader_open
+//
+// Start reading the records at path zRecord from file f, which is closed
+// by xml_reader_close(). Returns 0 if the record path is not valid or
+// selects an attribute or text. xml_reader_close() must be called either
+// way.
+//
+#ifdef SQLITE
+static int xml_reader_open(xml_reader r, FILE *f, const char *zRecord){
+#else
+int xml_reader_open(xml_reader r, FILE *f, const char *zRecord){
+#endif
+  int i;
+  
+  memset(r, 0, sizeof(*r));
+  r->f = f;
+  r->iRecord = -1;
+  r->record = xml_path_compile(zRecord, 0);
+  for(i=0; r->record && i<r->record->nStep; i++){
+    if( r->record->aStep[i].type!=XML_OPEN )
+      break;
+  }
+  return r->record && r->record->nStep>0 && i==r->record->nStep;
+}
+
+//
+// xml_reader_close
+//
+// Close the file and free the reader's buffer and record path.
+//
+#ifdef SQLITE
+static void xml_reader_close(xml_reader r){
+#else
+void xml_reader_close(xml_reader r){
+#endif
+  if( r->f )
+    fclose(r->f);
+  FREE(r->z);
+  FREE(r->record);
+  memset(r, 0, sizeof(*r));
+  r->iRecord = -1;
+}
+
+//
+// xml_reader_read
+//
+// Read the next chunk of the file, after discarding what has been read
+// before the current record or next tag. Returns the number of bytes read.
+//
+static int xml_reader_read(xml_reader r){
+  int keep = r->iRecord>=0 ? r->iRecord : r->i;
+  long long nAlloc;
+  size_t nRead;
+  char *z;
+  
+  if( !r->f )
+    return 0;
+  
+  if( keep>0 ){
+    memmove(r->z, &r->z[keep], r->n-keep);
+    r->n -= keep;
+    r->i -= keep;
+    if( r->iRecord>=0 )
+      r->iRecord -= keep;
+  }
+  if( r->n + XML_READER_CHUNK + 1 > r->nAlloc ){
+    nAlloc = 2*(long long)r->nAlloc + XML_READER_CHUNK + 1;
+    z = nAlloc<0x7fffffff ? REALLOC(r->z, nAlloc) : 0;
+    if( !z ){
+      r->error = XML_READER_NOMEM;
+      return 0;
+    }
+    r->z = z;
+    r->nAlloc = nAlloc;
+  }
+  
+  nRead = fread(&r->z[r->n], 1, XML_READER_CHUNK, r->f);
+  r->n += nRead;
+  r->z[r->n] = 0;
+  if( nRead==0 ){
+    if( ferror(r->f) )
+      r->error = XML_READER_IOERR;
+    fclose(r->f);
+    r->f = 0;
+  }
+  return nRead;
+}
+
+//
+// xml_reader_tag
+//
+// Find the next tag, reading more of the file until the whole tag is in the
+// buffer. Returns XML_OPEN or XML_CLOSE, and sets *piTag to its offset, or
+// returns XML_EOF at the end of the file.
+//
+static int xml_reader_tag(xml_reader r, int *piTag, int *pIsSelfClosing){
+  char *z;
+  int iEnd;
+  
+  for(;;){
+    z = r->i<r->n ? memchr(&r->z[r->i], '<', r->n - r->i) : 0;
+    if( z ){
+      *piTag = z - r->z;
+      iEnd = xml_skip_tag(r->z, *piTag, pIsSelfClosing);
+      if( iEnd<r->n ){
+        r->i = iEnd+1;
+        return z[1]=='/' ? XML_CLOSE : XML_OPEN;
+      }
+      r->i = *piTag;
+    }else{
+      r->i = r->n;
+    }
+    if( xml_reader_read(r)==0 ){
+      r->i = r->n;
+      return XML_EOF;
+    }
+  }
+}
+
+// Skip to the end of the element just opened
+static void xml_reader_skip(xml_reader r){
+  int depth = 1;
+  int iTag;
+  int is_self_closing;
+  int type;
+  
+  while( depth>0 && (type = xml_reader_tag(r, &iTag, &is_self_closing))!=XML_EOF ){
+    if( type==XML_CLOSE )
+      depth--;
+    else if( !is_self_closing )
+      depth++;
+  }
+}
+
+//
+// xml_reader_next
+//
+// Find the next element at the record path. Returns 1 with the record's
+// XML at &r->z[r->iRecord], r->nRecord bytes long and followed by readable
+// bytes, until the next call. Returns 0 at the end of the file, or on an
+// error, which is left in r->error.
+//
+#ifdef SQLITE
+static int xml_reader_next(xml_reader r){
+#else
+int xml_reader_next(xml_reader r){
+#endif
+  xml_path_step step;
+  char *zName;
+  int nName;
+  int iTag;
+  int is_self_closing;
+  
+  r->iRecord = -1;
+  for(;;){
+    switch( xml_reader_tag(r, &iTag, &is_self_closing) ){
+      case XML_EOF:
+        return 0;
+      case XML_CLOSE:
+        if( r->nMatched>0 )
+          r->nMatched--;
+        continue;
+    }
+    
+    zName = &r->z[iTag+1];
+    for(nName=0; zName[nName] && !is_space(&zName[nName]) && zName[nName]!='/' && zName[nName]!='>'; nName++);
+    step = &r->record->aStep[r->nMatched];
+    
+    // Elements off the record path are skipped
+    if( step->nName!=nName || memcmp(step->name, zName, nName)!=0 ){
+      if( !is_self_closing )
+        xml_reader_skip(r);
+      continue;
+    }
+    
+    if( r->nMatched+1<r->record->nStep ){
+      if( !is_self_closing )
+        r->nMatched++;
+      continue;
+    }
+    
+    // Record, which is kept in the buffer until the next one is read
+    r->iRecord = iTag;
+    if( !is_self_closing )
+      xml_reader_skip(r);
+    r->nRecord = r->i - r->iRecord;
+    return 1;
+  }
+}
+
+#ifndef SQLITE
+//
+// xml_read_file
+//
+// Read the whole of file f into *pz, zero terminated, a chunk at a time.
+// *pz is reused if the file fits in its *pnAlloc bytes, and grown
+// otherwise, so that one buffer can be kept for many files. *pz must be
+// freed. Returns the length read, or -1 if memory runs out, the file is
+// 2 GiB or larger, or it cannot be read.
+//
+int xml_read_file(FILE *f, char **pz, int *pnAlloc){
+  long long n = 0;
+  long long nAlloc;
+  size_t nRead;
+  char *z;
+  
+  do{
+    if( n + XML_READER_CHUNK + 1 > *pnAlloc ){
+      nAlloc = 2*(long long)*pnAlloc + XML_READER_CHUNK + 1;
+      z = nAlloc<0x7fffffff ? REALLOC(*pz, nAlloc) : 0;
+      if( !z )
+        return -1;
+      *pz = z;
+      *pnAlloc = nAlloc;
+    }
+    nRead = fread(&(*pz)[n], 1, XML_READER_CHUNK, f);
+    n += nRead;
+  }while( nRead>0 );
+  
+  if( ferror(f) )
+    return -1;
+  (*pz)[n] = 0;
+  return n;
+}
+#endif
+
+#ifndef SQLITE
+//
+// Arrow output
+//
+// Streams the records at a record path from a file into Apache Arrow record
+// batches, exported through the Arrow C Data Interface, without producing
+// any JSON. Each column has a path, resolved against each record by
+// xml_extract_find(), and an Arrow format: "u" (utf8), "l" (int64), "g"
+// (float64) or "b" (boolean). Attributes, text and elements with only
+// text are decoded straight into the column buffers. Missing values, empty
+// elements, elements with attributes or children, and values that are not
+// valid for the column's type are null.
+//
+// The buffers of a batch are owned by it until the consumer has released
+// the batch and any columns moved out of it, after which they are reused
+// for a later batch. Batches must not be released while another thread is
+// in xml_arrow_next().
+//
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema{
+  const char *format;
+  const char *name;
+  const char *metadata;
+  int64_t flags;
+  int64_t n_children;
+  struct ArrowSchema **children;
+  struct ArrowSchema *dictionary;
+  void (*release)(struct ArrowSchema*);
+  void *private_data;
+};
+
+struct ArrowArray{
+  int64_t length;
+  int64_t null_count;
+  int64_t offset;
+  int64_t n_buffers;
+  int64_t n_children;
+  const void **buffers;
+  struct ArrowArray **children;
+  struct ArrowArray *dictionary;
+  void (*release)(struct ArrowArray*);
+  void *private_data;
+};
+#endif
+
+#define XML_ARROW_BATCH 65536           // Default rows in a batch
+
+typedef struct xml_arrow *xml_arrow;
+typedef struct arrow_batch *arrow_batch;
+
+typedef struct arrow_column *arrow_column;
+struct arrow_column{
+  struct ArrowArray array;              // Exported column
+  const void *aBuffer[3];               // Buffers of array
+  unsigned char *aValid;                // Validity bitmap
+  void *aValue;                         // Values, or offsets of utf8 text
+  char *zText;                          // Text of a utf8 column
+  int nText;                            // Length of zText
+  int nTextAlloc;                       // Allocated size of zText
+  int nNull;                            // Number of null values
+};
+
+struct arrow_batch{
+  const void *aBuffer[1];               // Buffers of the struct array, i.e. no validity bitmap
+  struct ArrowArray **apChild;          // Children of the struct array
+  struct arrow_column *aCol;            // Columns
+  int nRef;                             // Batch and columns not yet released
+  xml_arrow owner;                      // Converter the batch is returned to
+  arrow_batch next;                     // Next batch free to be reused
+};
+
+struct xml_arrow{
+  struct xml_reader reader;             // Record reader
+  int nCol;                             // Number of columns
+  char **azName;                        // Column names
+  char *aFormat;                        // Column formats
+  xml_match aMatch;                     // Path and value of each column
+  int nBatch;                           // Rows in a full batch
+  char *zScratch;                       // Decoded number or boolean
+  int nScratchAlloc;                    // Allocated size of zScratch
+  arrow_batch pFree;                    // Batches free to be reused
+  int nOpen;                            // Batches not yet released
+  int closed;                           // True once xml_arrow_close() is called
+};
+
+static void arrow_batch_free(arrow_batch b, int nCol){
+  int k;
+  
+  for(k=0; k<nCol; k++){
+    FREE(b->aCol[k].aValid);
+    FREE(b->aCol[k].aValue);
+    FREE(b->aCol[k].zText);
+  }
+  FREE(b);
+}
+
+// Allocate a batch with room for a full batch of rows
+static arrow_batch arrow_batch_new(xml_arrow p){
+  arrow_batch b;
+  arrow_column col;
+  int nValue;
+  int k;
+  
+  b = MALLOC(sizeof(struct arrow_batch) + p->nCol*(sizeof(struct arrow_column) + sizeof(struct ArrowArray *)));
+  if( !b )
+    return 0;
+  memset(b, 0, sizeof(struct arrow_batch) + p->nCol*sizeof(struct arrow_column));
+  b->aCol = (arrow_column)&b[1];
+  b->apChild = (struct ArrowArray **)&b->aCol[p->nCol];
+  b->owner = p;
+  
+  for(k=0; k<p->nCol; k++){
+    col = &b->aCol[k];
+    switch( p->aFormat[k] ){
+      case 'b': nValue = (p->nBatch+7)/8; break;
+      case 'u': nValue = (p->nBatch+1)*sizeof(int32_t); break;
+      default:  nValue = p->nBatch*8;
+    }
+    col->aValid = MALLOC((p->nBatch+7)/8);
+    col->aValue = MALLOC(nValue);
+    if( !col->aValid || !col->aValue ){
+      arrow_batch_free(b, k+1);
+      return 0;
+    }
+    b->apChild[k] = &col->array;
+  }
+  return b;
+}
+
+// Release one reference to a batch, returning it to its converter at the last
+static void arrow_batch_unref(arrow_batch b){
+  xml_arrow p = b->owner;
+  
+  if( --b->nRef>0 )
+    return;
+  p->nOpen--;
+  if( p->closed ){
+    arrow_batch_free(b, p->nCol);
+    if( p->nOpen==0 )
+      FREE(p);
+  }else{
+    b->next = p->pFree;
+    p->pFree = b;
+  }
+}
+
+static void arrow_column_release(struct ArrowArray *array){
+  array->release = 0;
+  arrow_batch_unref((arrow_batch)array->private_data);
+}
+
+static void arrow_batch_release(struct ArrowArray *array){
+  int k;
+  
+  // Columns moved out of the batch are released on their own
+  for(k=0; k<array->n_children; k++){
+    if( array->children[k]->release )
+      array->children[k]->release(array->children[k]);
+  }
+  array->release = 0;
+  arrow_batch_unref((arrow_batch)array->private_data);
+}
+
+// Reserve space for n more bytes of a utf8 column's text. Returns null if
+// it cannot grow, as its offsets are 32 bits, or if memory runs out.
+static char *arrow_text_reserve(arrow_column col, int n){
+  long long nAlloc;
+  char *z;
+  
+  if( !col->zText || (long long)col->nText+n > col->nTextAlloc ){
+    if( (long long)col->nText+n > 0x7FFFFFFF )
+      return 0;
+    nAlloc = 2*((long long)col->nText+n) + 256;
+    if( nAlloc>0x7FFFFFFF )
+      nAlloc = 0x7FFFFFFF;
+    z = REALLOC(col->zText, nAlloc);
+    if( !z )
+      return 0;
+    col->zText = z;
+    col->nTextAlloc = nAlloc;
+  }
+  return &col->zText[col->nText];
+}
+
+// Set row iRow of an int64, float64 or boolean column, returning 0 if z is
+// not valid for the column's type
+static int arrow_value_set(arrow_column col, int format, int iRow, char *z){
+  char *zEnd;
+  long long iVal;
+  double rVal;
+  
+  switch( format ){
+    case 'l':
+      errno = 0;
+      iVal = strtoll(z, &zEnd, 10);
+      while( is_space(zEnd) ) zEnd++;
+      if( zEnd==z || *zEnd || errno )
+        return 0;
+      ((int64_t *)col->aValue)[iRow] = iVal;
+      return 1;
+      
+    case 'g':
+      rVal = strtod(z, &zEnd);
+      while( is_space(zEnd) ) zEnd++;
+      if( zEnd==z || *zEnd )
+        return 0;
+      ((double *)col->aValue)[iRow] = rVal;
+      return 1;
+      
+    default:
+      if( strcmp(z, "true")==0 || strcmp(z, "1")==0 ){
+        ((unsigned char *)col->aValue)[iRow/8] |= 1<<(iRow%8);
+        return 1;
+      }
+      return strcmp(z, "false")==0 || strcmp(z, "0")==0;
+  }
+}
+
+//
+// arrow_column_append
+//
+// Append the value found for a column's path as row iRow. Returns 0 if
+// memory runs out, or the column's text would pass 2 GB.
+//
+static int arrow_column_append(xml_arrow p, arrow_column col, int format, int iRow, xml_match m){
+  char *val = m->val;
+  int nVal = m->nVal;
+  int type = m->type;
+  int valid = 0;
+  long long nAlloc;
+  char *z;
+  
+  // Elements with only text are their text, and other elements are null
+  if( type==XML_OPEN && (!m->path->nStep || xml_match_text(m, &val, &nVal)<=0) )
+    type = XML_EOF;
+  
+  if( type!=XML_EOF && format=='u' ){
+    z = arrow_text_reserve(col, nVal);
+    if( !z )
+      return 0;
+    col->nText += xml_decode(val, nVal, z);
+    valid = 1;
+  }else if( type!=XML_EOF ){
+    if( nVal+1 > p->nScratchAlloc ){
+      nAlloc = (long long)nVal + 64;
+      if( nAlloc>0x7FFFFFFF )
+        nAlloc = 0x7FFFFFFF;
+      z = REALLOC(p->zScratch, nAlloc);
+      if( !z )
+        return 0;
+      p->zScratch = z;
+      p->nScratchAlloc = nAlloc;
+    }
+    z = p->zScratch;
+    z[xml_decode(val, nVal, z)] = 0;
+    valid = arrow_value_set(col, format, iRow, z);
+  }
+  if( format=='u' )
+    ((int32_t *)col->aValue)[iRow+1] = col->nText;
+  
+  if( valid )
+    col->aValid[iRow/8] |= 1<<(iRow%8);
+  else
+    col->nNull++;
+  return 1;
+}
+
+//
+// xml_arrow_close
+//
+// Close the file and free the converter. Batches not yet released stay
+// valid, and are freed once they are.
+//
+void xml_arrow_close(xml_arrow p){
+  arrow_batch b;
+  int k;
+  
+  xml_reader_close(&p->reader);
+  for(k=0; k<p->nCol; k++){
+    FREE(p->azName[k]);
+    FREE(p->aMatch[k].path);
+  }
+  while( (b = p->pFree) ){
+    p->pFree = b->next;
+    arrow_batch_free(b, p->nCol);
+  }
+  FREE(p->zScratch);
+  p->closed = 1;
+  if( p->nOpen==0 )
+    FREE(p);
+}
+
+//
+// xml_arrow_open
+//
+// Start converting the records at path zRecord in file f to Arrow batches of
+// up to nBatch rows, or XML_ARROW_BATCH if nBatch is 0. Column k is named
+// azName[k], has the value at path azPath[k] in each record, e.g.
+// "$.order.@id" for records at "$.orders.order", and has Arrow format
+// azFormat[k]. File f is closed by xml_arrow_close(). Returns null, after
+// closing f, if a path or format is not valid, or if memory runs out.
+//
+xml_arrow xml_arrow_open(FILE *f, const char *zRecord, int nCol, const char **azName, const char **azPath, const char **azFormat, int nBatch){
+  xml_arrow p;
+  int ok;
+  int k;
+  
+  p = MALLOC(sizeof(struct xml_arrow) + nCol*(sizeof(char *) + sizeof(struct xml_match) + 1));
+  if( !p ){
+    fclose(f);
+    return 0;
+  }
+  memset(p, 0, sizeof(struct xml_arrow) + nCol*(sizeof(char *) + sizeof(struct xml_match) + 1));
+  p->nCol = nCol;
+  p->aMatch = (xml_match)&p[1];
+  p->azName = (char **)&p->aMatch[nCol];
+  p->aFormat = (char *)&p->azName[nCol];
+  p->nBatch = nBatch>0 ? nBatch : XML_ARROW_BATCH;
+  
+  ok = xml_reader_open(&p->reader, f, zRecord);
+  for(k=0; ok && k<nCol; k++){
+    p->aFormat[k] = azFormat[k][0];
+    p->azName[k] = MALLOC(strlen(azName[k])+1);
+    if( !p->azName[k] ){
+      ok = 0;
+      break;
+    }
+    strcpy(p->azName[k], azName[k]);
+    p->aMatch[k].path = xml_path_compile(azPath[k], 0);
+    ok = p->aMatch[k].path && azFormat[k][0] && !azFormat[k][1] && strchr("ulgb", azFormat[k][0]);
+  }
+  if( !ok ){
+    xml_arrow_close(p);
+    return 0;
+  }
+  return p;
+}
+
+// Release a schema, and any children not moved out of it
+static void arrow_schema_release(struct ArrowSchema *schema){
+  int i;
+  
+  for(i=0; i<schema->n_children; i++){
+    if( schema->children[i]->release )
+      schema->children[i]->release(schema->children[i]);
+  }
+  FREE(schema->private_data);
+  schema->release = 0;
+}
+
+//
+// xml_arrow_schema
+//
+// Export the schema of the batches, a struct of the columns, to *pSchema,
+// which the consumer must release. Returns 0 if out of memory.
+//
+int xml_arrow_schema(xml_arrow p, struct ArrowSchema *pSchema){
+  struct ArrowSchema **apChild;
+  struct ArrowSchema *child;
+  char *z;
+  int k;
+  
+  apChild = MALLOC(p->nCol*(sizeof(struct ArrowSchema *) + sizeof(struct ArrowSchema)));
+  if( !apChild )
+    return 0;
+  memset(pSchema, 0, sizeof(struct ArrowSchema));
+  pSchema->format = "+s";
+  pSchema->name = "";
+  pSchema->children = apChild;
+  pSchema->release = arrow_schema_release;
+  pSchema->private_data = apChild;
+  
+  // Each column owns its name, so it can be moved out of the struct
+  for(k=0; k<p->nCol; k++){
+    child = &((struct ArrowSchema *)&apChild[p->nCol])[k];
+    z = MALLOC(strlen(p->azName[k]) + 3);
+    if( !z ){
+      arrow_schema_release(pSchema);
+      return 0;
+    }
+    memset(child, 0, sizeof(struct ArrowSchema));
+    z[0] = p->aFormat[k];
+    z[1] = 0;
+    strcpy(&z[2], p->azName[k]);
+    child->format = z;
+    child->name = &z[2];
+    child->flags = ARROW_FLAG_NULLABLE;
+    child->release = arrow_schema_release;
+    child->private_data = z;
+    apChild[k] = child;
+    pSchema->n_children++;
+  }
+  return 1;
+}
+
+//
+// xml_arrow_next
+//
+// Convert up to a full batch of records, and export them to *pArray, a
+// struct array of the columns, which the consumer must release. Returns the
+// number of rows, or 0 at the end of the file, when *pArray is not set.
+// Returns -1 if out of memory or the file can not be read.
+//
+int xml_arrow_next(xml_arrow p, struct ArrowArray *pArray){
+  struct xml_reader *r = &p->reader;
+  arrow_batch b;
+  arrow_column col;
+  int nRow = 0;
+  int ok = 1;
+  int k;
+  
+  b = p->pFree ? p->pFree : arrow_batch_new(p);
+  if( !b )
+    return -1;
+  p->pFree = b->next;
+  
+  for(k=0; k<p->nCol; k++){
+    col = &b->aCol[k];
+    memset(col->aValid, 0, (p->nBatch+7)/8);
+    if( p->aFormat[k]=='b' )
+      memset(col->aValue, 0, (p->nBatch+7)/8);
+    if( p->aFormat[k]=='u' )
+      ((int32_t *)col->aValue)[0] = 0;
+    col->nText = 0;
+    col->nNull = 0;
+  }
+  
+  while( ok && nRow<p->nBatch && xml_reader_next(r) ){
+    xml_extract_find(&r->z[r->iRecord], r->nRecord, p->aMatch, p->nCol);
+    for(k=0; ok && k<p->nCol; k++)
+      ok = arrow_column_append(p, &b->aCol[k], p->aFormat[k], nRow, &p->aMatch[k]);
+    nRow++;
+  }
+  
+  if( nRow==0 || r->error || !ok ){
+    b->next = p->pFree;
+    p->pFree = b;
+    return r->error || !ok ? -1 : 0;
+  }
+  
+  for(k=0; k<p->nCol; k++){
+    col = &b->aCol[k];
+    memset(&col->array, 0, sizeof(struct ArrowArray));
+    col->aBuffer[0] = col->aValid;
+    col->aBuffer[1] = col->aValue;
+    col->aBuffer[2] = col->zText ? col->zText : "";
+    col->array.length = nRow;
+    col->array.null_count = col->nNull;
+    col->array.n_buffers = p->aFormat[k]=='u' ? 3 : 2;
+    col->array.buffers = col->aBuffer;
+    col->array.release = arrow_column_release;
+    col->array.private_data = b;
+  }
+  b->aBuffer[0] = 0;
+  b->nRef = p->nCol+1;
+  p->nOpen++;
+  
+  memset(pArray, 0, sizeof(struct ArrowArray));
+  pArray->length = nRow;
+  pArray->n_buffers = 1;
+  pArray->buffers = b->aBuffer;
+  pArray->n_children = p->nCol;
+  pArray->children = b->apChild;
+  pArray->release = arrow_batch_release;
+  pArray->private_data = b;
+  return nRow;
+}
+#endif
+
+#ifdef THREADS
+//
+// Work stealing thread pool
+//
+// The items to be processed are divided into a range for each worker.
+// Workers take items from the front of their own range, and once it is
+// empty, steal the back half of the largest range left. Each range has
+// its own mutex, so workers only wait for each other while stealing.
+//
+typedef struct pool_range *pool_range;
+struct pool_range{
+  pthread_mutex_t mutex;                // Held while the range is changed
+  int iFirst;                           // Next item in range
+  int iEnd;                             // Item after the range
+};
+
+typedef struct pool *pool;
+struct pool{
+  pool_range aRange;                    // Range of each worker
+  int nWorker;                          // Number of workers
+  int iNextWorker;                      // Next worker to be claimed by a thread
+  void (*xItem)(void*, int, int);       // Item callback: xItem(pArg, iWorker, iItem)
+  void *pArg;                           // First argument to xItem
+};
+
+//
+// pool_next
+//
+// Take the next item for worker iWorker, stealing from another worker if
+// its own range is empty. Returns -1 once all items have been taken.
+//
+static int pool_next(pool p, int iWorker){
+  pool_range range = &p->aRange[iWorker];
+  pool_range victim;
+  int iItem = -1;
+  int iEnd = 0;
+  int n, nMax, i;
+  
+  pthread_mutex_lock(&range->mutex);
+  if( range->iFirst<range->iEnd )
+    iItem = range->iFirst++;
+  pthread_mutex_unlock(&range->mutex);
+  
+  while( iItem<0 ){
+    // Find the largest range
+    victim = 0;
+    nMax = 0;
+    for(i=0; i<p->nWorker; i++){
+      pthread_mutex_lock(&p->aRange[i].mutex);
+      n = p->aRange[i].iEnd - p->aRange[i].iFirst;
+      pthread_mutex_unlock(&p->aRange[i].mutex);
+      if( n>nMax ){
+        nMax = n;
+        victim = &p->aRange[i];
+      }
+    }
+    if( !victim )
+      break;
+    
+    // Steal its back half, which may have been taken in the meantime
+    pthread_mutex_lock(&victim->mutex);
+    n = victim->iEnd - victim->iFirst;
+    if( n>0 ){
+      iEnd = victim->iEnd;
+      victim->iEnd -= (n+1)/2;
+      iItem = victim->iEnd;
+    }
+    pthread_mutex_unlock(&victim->mutex);
+    
+    if( iItem>=0 ){
+      pthread_mutex_lock(&range->mutex);
+      range->iFirst = iItem+1;
+      range->iEnd = iEnd;
+      pthread_mutex_unlock(&range->mutex);
+    }
+  }
+  
+  return iItem;
+}
+
+static void pool_work(pool p, int iWorker){
+  int iItem;
+  
+  while( (iItem = pool_next(p, iWorker))>=0 )
+    p->xItem(p->pArg, iWorker, iItem);
+}
+
+static void *pool_thread(void *pArg){
+  pool p = (pool)pArg;
+  
+  pool_work(p, __sync_fetch_and_add(&p->iNextWorker, 1));
+  return 0;
+}
+
+//
+// pool_run
+//
+// Call xItem(pArg, iWorker, iItem) for each of nItem items on up to
+// nThread threads, including this one, which is worker 0. Workers are
+// numbered from 0 to nThread-1, so callers can keep state per worker.
+// The items are processed serially if the pool cannot be allocated.
+//
+static void pool_run(int nThread, int nItem, void (*xItem)(void*, int, int), void *pArg){
+  struct pool p;
+  pthread_t *aThread;
+  int nStarted = 0;
+  int i;
+  
+  if( nThread>nItem )
+    nThread = nItem;
+  if( nThread>1 ){
+    p.aRange = MALLOC(nThread*sizeof(struct pool_range));
+    aThread = MALLOC(nThread*sizeof(pthread_t));
+    if( !p.aRange || !aThread ){
+      FREE(p.aRange);
+      FREE(aThread);
+      nThread = 1;
+    }
+  }
+  if( nThread<=1 ){
+    for(i=0; i<nItem; i++)
+      xItem(pArg, 0, i);
+    return;
+  }
+  
+  p.nWorker = nThread;
+  p.iNextWorker = 1;
+  p.xItem = xItem;
+  p.pArg = pArg;
+  for(i=0; i<nThread; i++){
+    pthread_mutex_init(&p.aRange[i].mutex, 0);
+    p.aRange[i].iFirst = (int)((long)nItem*i/nThread);
+    p.aRange[i].iEnd = (int)((long)nItem*(i+1)/nThread);
+  }
+  
+  // Ranges of threads that fail to start are stolen by the others
+  for(i=1; i<nThread; i++){
+    if( pthread_create(&aThread[nStarted], 0, pool_thread, &p)==0 )
+      nStarted++;
+  }
+  
+  pool_work(&p, 0);
+  
+  for(i=0; i<nStarted; i++)
+    pthread_join(aThread[i], 0);
+  for(i=0; i<nThread; i++)
+    pthread_mutex_destroy(&p.aRange[i].mutex);
+  FREE(aThread);
+  FREE(p.aRange);
+}
+
+//
+// Parallel conversion
+//
+// The children of the document element are found with a structural scan
+// of the XML string, which is itself run in parallel on byte ranges that
+// are checked and joined afterwards, and divided into chunks. Each chunk is parsed and
+// grouped on a worker thread, before the chunks are spliced into a single
+// document and the children of the document element are grouped.
+//
+// The document is then divided into chunks again, this time in output
+// order. Each worker calculates the space its chunk requires at a relative
+// indent depth, then writes its chunk straight into the JSON string once
+// the offset and depth it starts at are known.
+//
+// Documents that cannot be split, such as when the document element has
+// text of its own, are parsed serially and output in parallel.
+//
+#ifndef PARALLEL_MIN_SIZE
+#define PARALLEL_MIN_SIZE (1<<20)       // Smallest XML string converted in parallel
+#endif
+#define PARALLEL_CHUNKS 4               // Chunks per thread, to balance uneven subtrees
+
+// A child of the document element
+typedef struct xml_subtree *xml_subtree;
+struct xml_subtree{
+  element first;                        // The child
+  element last;                         // Last element of the child's subtree
+  int nByte;                            // Length of the child in the XML string
+};
+
+// A run of children parsed, or output, by a single worker
+typedef struct xml_chunk *xml_chunk;
+struct xml_chunk{
+  char *xml;                            // Start of chunk in original XML string
+  int n;                                // Length of chunk
+  int iSub;                             // Index of first child in chunk
+  int nSub;                             // Number of children in chunk
+  element root;                         // Parsed chunk
+  struct arena arena;                   // Arena chunk is parsed into
+  element first;                        // First element to output
+  element end;                          // Element after the last to output
+  struct json_buffer out;               // JSON output of chunk
+};
+
+// Tag or text found by a speculative scan
+#define SHARD_OPEN 0
+#define SHARD_SELF_CLOSING 1
+#define SHARD_CLOSE 2
+#define SHARD_TEXT 3
+
+typedef struct xml_shard_event *xml_shard_event;
+struct xml_shard_event{
+  int i;                                // Offset of tag or text
+  int depth;                            // Relative depth before open tag, or after close tag
+  int type;                             // SHARD_OPEN, SHARD_CLOSE etc.
+};
+
+// A byte range scanned speculatively by a single worker
+//
+// Only tags and text at the lowest depth seen, or one above it if the
+// lowest depth was reached later, can be at the document element's
+// depth. The first shard is known to start at depth 0, so it keeps tags
+// and text at depths 0 and 1 instead.
+//
+typedef struct xml_shard *xml_shard;
+struct xml_shard{
+  int iStart;                           // Offset of byte range
+  int iEnd;                             // Offset after byte range
+  int exact;                            // True if iStart is known to be at depth 0
+  int iSync;                            // Offset of first tag in range
+  int iStop;                            // Offset of first tag after range
+  int depth;                            // Depth at iStop, relative to iSync
+  int min_depth;                        // Lowest relative depth
+  xml_shard_event aEvent;               // Events at min_depth
+  int nEvent;                           // Number of events at min_depth
+  int nAlloc;                           // Allocated size of aEvent
+  xml_shard_event aPrev;                // Events at min_depth+1, before min_depth was reached
+  int nPrev;                            // Number of events at min_depth+1
+  int nPrevAlloc;                       // Allocated size of aPrev
+  int nomem;                            // True if events could not be kept
+};
+
+#define PARALLEL_SCAN 0
+#define PARALLEL_PARSE 1
+#define PARALLEL_OUTPUT 2
+
+typedef struct xml_parallel *xml_parallel;
+struct xml_parallel{
+  char *xml;                            // Original XML string
+  element doc;                          // Document element
+  element root;                         // Root of document
+  struct arena arena;                   // Arena document element is parsed into
+  xml_subtree aSub;                     // Children of document element
+  xml_shard aShard;                     // Shards to scan
+  xml_chunk aChunk;                     // Chunks to parse or output
+  int nTask;                            // Number of shards or chunks
+  int task;                             // PARALLEL_SCAN, PARALLEL_PARSE or PARALLEL_OUTPUT
+  struct xml_options options;           // Conversion options
+  int failed;                           // True if parsing did not match the scan, set atomically
+};
+
+static void xml_parallel_run(xml_parallel p, int nThread);
+
+//
+// xml_split
+//
+// Structural scan to find the children of the document element.
+//
+// Sets *paChild to the offsets of the children, *pnChild to the number of
+// children, and *piEnd to the offset of the document element close tag.
+// *paChild must be freed.
+//
+// Returns 0 if the children cannot be split from the document element,
+// i.e. the document element has text of its own, or something other than
+// white space follows it, or out of memory.
+//
+static int xml_split(char *xml, int **paChild, int *pnChild, int *piEnd){
+  int *aChild = 0;
+  int *aNew;
+  int nChild = 0;
+  int nAlloc = 0;
+  int depth = 0;
+  int is_doc = 0;
+  int is_self_closing;
+  int i = 0;
+  int j;
+  
+  *piEnd = -1;
+  
+  while( xml[i] ){
+    // Text, which is only allowed outside of the document element
+    j = i;
+    while( xml[j] && xml[j]!='<' ) j++;
+    if( is_doc && depth<=1 ){
+      while( i<j && is_space(&xml[i]) ) i++;
+      if( i<j ) break;
+    }
+    i = j;
+    if( !xml[i] ) break;
+    
+    // Element close tag
+    if( xml[i+1]=='/' ){
+      if( --depth<0 ) break;
+      if( is_doc && depth==0 ) *piEnd = i;
+      i = xml_skip_tag(xml, i, &is_self_closing);
+      
+    // Element open tag
+    }else{
+      if( *piEnd>=0 ) break;
+      if( is_doc && depth==1 ){
+        if( nChild==nAlloc ){
+          nAlloc = nAlloc ? nAlloc*2 : 1024;
+          aNew = REALLOC(aChild, nAlloc*sizeof(int));
+          if( !aNew ){
+            nChild = 0;
+            break;
+          }
+          aChild = aNew;
+        }
+        aChild[nChild++] = i;
+      }
+      
+      i = xml_skip_tag(xml, i, &is_self_closing);
+      
+      if( !is_self_closing ){
+        if( depth==0 ){
+          // Only one document element
+          if( is_doc ) break;
+          is_doc = 1;
+        }
+        depth++;
+      }
+    }
+    if( xml[i] ) i++;
+  }
+  
+  *paChild = aChild;
+  *pnChild = nChild;
+  return !xml[i] && depth==0 && *piEnd>=0 && nChild>0;
+}
+
+//
+// xml_shard_add
+//
+// Keep a tag or text found by xml_shard_scan(), if it may be at the
+// document element's depth.
+//
+static void xml_shard_add(xml_shard shard, int i, int depth, int type){
+  struct xml_shard_event *aSwap;
+  int nSwap;
+  
+  if( shard->nomem )
+    return;
+  if( shard->exact ){
+    if( depth>1 )
+      return;
+  }else{
+    if( depth>shard->min_depth )
+      return;
+    
+    // New lowest depth, which is only ever reached by closing a tag, so
+    // the events kept at the previous lowest depth are now one above it
+    if( depth<shard->min_depth ){
+      aSwap = shard->aPrev;
+      shard->aPrev = shard->aEvent;
+      shard->aEvent = aSwap;
+      nSwap = shard->nPrevAlloc;
+      shard->nPrevAlloc = shard->nAlloc;
+      shard->nAlloc = nSwap;
+      shard->nPrev = shard->nEvent;
+      shard->nEvent = 0;
+      shard->min_depth = depth;
+    }
+  }
+  
+  if( shard->nEvent==shard->nAlloc ){
+    nSwap = shard->nAlloc ? shard->nAlloc*2 : 256;
+    aSwap = REALLOC(shard->aEvent, nSwap*sizeof(struct xml_shard_event));
+    if( !aSwap ){
+      // Fail the speculation, so the document is split serially
+      shard->nomem = 1;
+      return;
+    }
+    shard->aEvent = aSwap;
+    shard->nAlloc = nSwap;
+  }
+  shard->aEvent[shard->nEvent].i = i;
+  shard->aEvent[shard->nEvent].depth = depth;
+  shard->aEvent[shard->nEvent].type = type;
+  shard->nEvent++;
+}
+
+//
+// xml_shard_scan
+//
+// Speculative structural scan of a byte range.
+//
+// Resynchronize at the first '<' in the range, assuming it starts a tag,
+// and scan tags that start within the range, tracking depth relative to
+// the first tag. Scanning stops at the first '<' after the range, which
+// the next shard must have resynchronized at for the speculation to hold.
+//
+static void xml_shard_scan(char *xml, xml_shard shard){
+  int is_self_closing;
+  int depth = 0;
+  int i, j, k;
+  
+  i = shard->iStart;
+  if( !shard->exact ){
+    while( xml[i] && xml[i]!='<' ) i++;
+  }
+  shard->iSync = i;
+  
+  while( xml[i] ){
+    // Text
+    j = i;
+    while( xml[j] && xml[j]!='<' ) j++;
+    k = i;
+    while( k<j && is_space(&xml[k]) ) k++;
+    if( k<j )
+      xml_shard_add(shard, k, depth, SHARD_TEXT);
+    i = j;
+    if( !xml[i] || i>=shard->iEnd ) break;
+    
+    // Tag
+    j = xml_skip_tag(xml, i, &is_self_closing);
+    if( xml[i+1]=='/' ){
+      depth--;
+      xml_shard_add(shard, i, depth, SHARD_CLOSE);
+    }else if( is_self_closing ){
+      xml_shard_add(shard, i, depth, SHARD_SELF_CLOSING);
+    }else{
+      xml_shard_add(shard, i, depth, SHARD_OPEN);
+      depth++;
+    }
+    i = j;
+    if( xml[i] ) i++;
+  }
+  
+  shard->iStop = i;
+  shard->depth = depth;
+}
+
+//
+// xml_split_sharded
+//
+// Same as xml_split(), but the XML string of length n is divided into
+// byte ranges that are scanned speculatively in parallel.
+//
+// The shards are then checked in order: each must have resynchronized
+// where the previous shard stopped, which gives the depth it started at.
+// Returns 0 if the speculation failed, or the children cannot be split.
+//
+static int xml_split_sharded(xml_parallel p, char *xml, int n, int nThread, int **paChild, int *pnChild, int *piEnd){
+  xml_shard shard;
+  xml_shard_event aEvent;
+  int *aChild = 0;
+  int *aNew;
+  int nChild = 0;
+  int nAlloc = 0;
+  int is_doc = 0;
+  int depth = 0;
+  int ok = 1;
+  int nEvent;
+  int d;
+  int i, k;
+  
+  *piEnd = -1;
+  *paChild = 0;
+  *pnChild = 0;
+  
+  p->nTask = nThread;
+  p->aShard = MALLOC(p->nTask*sizeof(struct xml_shard));
+  if( !p->aShard )
+    return 0;
+  memset(p->aShard, 0, p->nTask*sizeof(struct xml_shard));
+  for(k=0; k<p->nTask; k++){
+    p->aShard[k].iStart = (int)((long)n*k/p->nTask);
+    p->aShard[k].iEnd = (int)((long)n*(k+1)/p->nTask);
+  }
+  p->aShard[0].exact = 1;
+  
+  p->task = PARALLEL_SCAN;
+  xml_parallel_run(p, nThread);
+  
+  for(k=0; ok && k<p->nTask; k++){
+    shard = &p->aShard[k];
+    if( shard->nomem || (k>0 && shard->iSync!=p->aShard[k-1].iStop) ){
+      ok = 0;
+      break;
+    }
+    
+    // Events kept one above the lowest depth come first
+    for(d=0; ok && d<2; d++){
+      aEvent = d ? shard->aEvent : shard->aPrev;
+      nEvent = d ? shard->nEvent : shard->nPrev;
+      
+      for(i=0; ok && i<nEvent; i++){
+        int depth_event = depth + aEvent[i].depth;
+        if( depth_event>1 )
+          continue;
+        
+        switch( aEvent[i].type ){
+          case SHARD_TEXT:
+            if( is_doc ) ok = 0;
+            break;
+          case SHARD_CLOSE:
+            if( depth_event<0 ) ok = 0;
+            if( is_doc && depth_event==0 ) *piEnd = aEvent[i].i;
+            break;
+          default:
+            if( *piEnd>=0 ){
+              ok = 0;
+            }else if( is_doc && depth_event==1 ){
+              if( nChild==nAlloc ){
+                nAlloc = nAlloc ? nAlloc*2 : 1024;
+                aNew = REALLOC(aChild, nAlloc*sizeof(int));
+                if( !aNew ){
+                  ok = 0;
+                  break;
+                }
+                aChild = aNew;
+              }
+              aChild[nChild++] = aEvent[i].i;
+            }else if( depth_event==0 && aEvent[i].type==SHARD_OPEN ){
+              // Only one document element, which must open in the first
+              // shard, as only the first shard keeps its children
+              if( is_doc || k>0 ) ok = 0;
+              is_doc = 1;
+            }
+        }
+      }
+    }
+    
+    depth += shard->depth;
+  }
+  
+  if( ok )
+    ok = depth==0 && *piEnd>=0 && nChild>0 && !xml[p->aShard[p->nTask-1].iStop];
+  
+  for(k=0; k<p->nTask; k++){
+    FREE(p->aShard[k].aEvent);
+    FREE(p->aShard[k].aPrev);
+  }
+  FREE(p->aShard);
+  p->aShard = 0;
+  
+  if( !ok ){
+    FREE(aChild);
+    aChild = 0;
+  }
+  *paChild = aChild;
+  *pnChild = nChild;
+  return ok;
+}
+
+//
+// xml_parallel_item
+//
+// Scan, parse or output shard or chunk i.
+//
+static void xml_parallel_item(void *pArg, int iWorker, int i){
+  xml_parallel p = (xml_parallel)pArg;
+  xml_chunk chunk;
+  element node;
+  
+  (void)iWorker;
+  if( p->task==PARALLEL_SCAN ){
+    xml_shard_scan(p->xml, &p->aShard[i]);
+    return;
+  }
+  
+  chunk = &p->aChunk[i];
+  if( p->task==PARALLEL_OUTPUT ){
+    json_output(p->root, chunk->first, chunk->end, &chunk->out, &p->options);
+    return;
+  }
+  
+  // Parse the chunk at the depth of the document element's children,
+  // leaving those children to be grouped once all chunks are parsed
+  chunk->root = xml_parse(chunk->xml, chunk->n, p->doc->depth, &chunk->arena);
+  if( !chunk->root ){
+    __atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  xml_group(chunk->root, p->doc->depth+2, 0);
+  
+  // Find each child's subtree
+  i = chunk->iSub-1;
+  for(node=chunk->root->next; node; node=node->next){
+    if( node->parent==chunk->root ){
+      if( ++i>=chunk->iSub+chunk->nSub ) break;
+      p->aSub[i].first = node;
+    }
+    p->aSub[i].last = node;
+  }
+  if( i!=chunk->iSub+chunk->nSub-1 )
+    __atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+}
+
+//
+// xml_parallel_run
+//
+// Run xml_parallel_item() for each shard or chunk on up to nThread
+// threads, including this one.
+//
+static void xml_parallel_run(xml_parallel p, int nThread){
+  pool_run(nThread, p->nTask, xml_parallel_item, p);
+}
+
+//
+// xml_parallel_output
+//
+// Output the chunks, whose first and end elements are set, on up to
+// nThread threads.
+//
+// The space each chunk requires is calculated at a relative indent depth,
+// then the offset and depth each chunk starts at are found by summing
+// those of the chunks before it. Each chunk is then written straight into
+// its place in the JSON string.
+//
+// Returns 0 if the chunks cannot be output separately, or out of memory.
+//
+static char *xml_parallel_output(xml_parallel p, int nThread){
+  xml_chunk chunk;
+  char *json;
+  int nTotal = 0;
+  int depth = 0;
+  int n, k;
+  
+  for(k=0; k<p->nTask; k++){
+    memset(&p->aChunk[k].out, 0, sizeof(struct json_buffer));
+    p->aChunk[k].out.relative = 1;
+  }
+  
+  // Calculate space required by each chunk
+  p->task = PARALLEL_OUTPUT;
+  xml_parallel_run(p, nThread);
+  
+  // Determine the offset and depth each chunk starts at. The offset is
+  // kept in nJson until the JSON string is allocated.
+  for(k=0; k<p->nTask; k++){
+    chunk = &p->aChunk[k];
+    
+    if( depth+chunk->out.min_depth < 0 )
+      return 0;
+    
+    n = chunk->out.nJson;
+    if( p->options.indent>=0 )
+      n += p->options.indent*(depth*chunk->out.nIndent + chunk->out.sum_depth);
+    
+    depth += chunk->out.depth;
+    chunk->out.depth = depth - chunk->out.depth;
+    chunk->out.relative = 0;
+    chunk->out.nJson = nTotal;
+    nTotal += n;
+  }
+  
+  json = MALLOC(nTotal+1);
+  if( !json )
+    return 0;
+  for(k=0; k<p->nTask; k++){
+    p->aChunk[k].out.json = &json[p->aChunk[k].out.nJson];
+    p->aChunk[k].out.nJson = 0;
+  }
+  
+  // Output each chunk
+  xml_parallel_run(p, nThread);
+  json[nTotal] = 0;
+  
+  return json;
+}
+
+//
+// xml_parallel_serial
+//
+// Parse a document that cannot be split serially, then output it in
+// parallel, in chunks of roughly equal numbers of elements.
+//
+static char *xml_parallel_serial(xml_parallel p, int nThread){
+  element node;
+  char *json;
+  int nNode = 0;
+  int i, k;
+  
+  p->root = xml_parse(p->xml, -1, 0, &p->arena);
+  if( !p->root ){
+    arena_free(&p->arena);
+    return xml_convert(p->xml, -1, &p->options);
+  }
+  xml_group(p->root, 0, 0);
+  for(node=p->root->next; node; node=node->next)
+    nNode++;
+  
+  p->nTask = nThread*PARALLEL_CHUNKS < nNode ? nThread*PARALLEL_CHUNKS : nNode;
+  if( p->nTask<1 )
+    p->nTask = 1;
+  p->aChunk = MALLOC(p->nTask*sizeof(struct xml_chunk));
+  if( !p->aChunk ){
+    arena_free(&p->arena);
+    return xml_convert(p->xml, -1, &p->options);
+  }
+  memset(p->aChunk, 0, p->nTask*sizeof(struct xml_chunk));
+  node = p->root->next;
+  for(k=0; k<p->nTask; k++){
+    p->aChunk[k].first = node;
+    for(i=(int)((long)nNode*k/p->nTask); i<(long)nNode*(k+1)/p->nTask; i++)
+      node = node->next;
+    p->aChunk[k].end = node;
+  }
+  
+  json = xml_parallel_output(p, nThread);
+  
+  arena_free(&p->arena);
+  FREE(p->aChunk);
+  
+  return json ? json : xml_convert(p->xml, -1, &p->options);
+}
+
+//
+// xml_to_json_parallel
+//
+// Same as xml_to_json(), but large documents are converted on up to
+// nThread threads. If nThread is 0, then one thread per CPU is used.
+//
+// Offsets into the document are ints, so it must be smaller than 2 GiB.
+// Null is returned for larger documents.
+//
+char *xml_to_json_parallel(char *xml, int indent, int nThread){
+  struct xml_parallel p;
+  size_t nXml;
+  int *aChild = 0;
+  int nChild;
+  int iEnd;
+  int *aOrder;
+  char *is_grouped;
+  int nTarget, nByte;
+  int i, j, k, n;
+  element node;
+  char *json;
+  
+  if( nThread<=0 )
+    nThread = sysconf(_SC_NPROCESSORS_ONLN);
+  
+  memset(&p, 0, sizeof(p));
+  p.xml = xml;
+  xml_options_init(&p.options, indent);
+  
+  // Find the children of the document element, scanning serially if the
+  // speculative parallel scan fails
+  nXml = strlen(xml);
+  if( nXml>0x7FFFFFFF )
+    return 0;
+  n = (int)nXml;
+  if( nThread<=1 || n<PARALLEL_MIN_SIZE )
+    return xml_convert(xml, -1, &p.options);
+  if( !xml_split_sharded(&p, xml, n, nThread, &aChild, &nChild, &iEnd)
+      && !xml_split(xml, &aChild, &nChild, &iEnd) ){
+    FREE(aChild);
+    return xml_parallel_serial(&p, nThread);
+  }
+  
+  //
+  // Parse up to the first child. The document element is the last element.
+  //
+  p.root = xml_parse(xml, aChild[0], 0, &p.arena);
+  if( !p.root ){
+    FREE(aChild);
+    arena_free(&p.arena);
+    return xml_convert(xml, -1, &p.options);
+  }
+  xml_group(p.root, 0, 0);
+  for(node=p.root; node->next; node=node->next);
+  p.doc = node;
+  p.doc->is_parent = 1;
+  
+  //
+  // Parse chunks of children, of roughly equal length
+  //
+  p.aSub = MALLOC(nChild*sizeof(struct xml_subtree));
+  p.nTask = nThread*PARALLEL_CHUNKS < nChild ? nThread*PARALLEL_CHUNKS : nChild;
+  p.aChunk = MALLOC(p.nTask*sizeof(struct xml_chunk));
+  if( !p.aSub || !p.aChunk ){
+    FREE(aChild);
+    arena_free(&p.arena);
+    FREE(p.aChunk);
+    FREE(p.aSub);
+    return xml_convert(xml, -1, &p.options);
+  }
+  for(i=0; i<nChild; i++)
+    p.aSub[i].nByte = (i+1<nChild ? aChild[i+1] : iEnd) - aChild[i];
+  
+  memset(p.aChunk, 0, p.nTask*sizeof(struct xml_chunk));
+  nTarget = (iEnd - aChild[0]) / p.nTask + 1;
+  for(i=0, k=0; k<p.nTask; k++){
+    p.aChunk[k].iSub = i;
+    p.aChunk[k].xml = &xml[aChild[i]];
+    nByte = 0;
+    while( i<nChild && (nByte<nTarget || k==p.nTask-1) && nChild-i>p.nTask-k-1 )
+      nByte += p.aSub[i++].nByte;
+    p.aChunk[k].n = nByte;
+    p.aChunk[k].nSub = i - p.aChunk[k].iSub;
+  }
+  FREE(aChild);
+  
+  p.task = PARALLEL_PARSE;
+  xml_parallel_run(&p, nThread);
+  
+  if( p.failed ){
+    for(k=0; k<p.nTask; k++)
+      arena_free(&p.aChunk[k].arena);
+    arena_free(&p.arena);
+    FREE(p.aChunk);
+    FREE(p.aSub);
+    memset(&p, 0, sizeof(p));
+    p.xml = xml;
+    xml_options_init(&p.options, indent);
+    return xml_parallel_serial(&p, nThread);
+  }
+  
+  //
+  // Group the children of the document element, and link them in order.
+  // Chunks have their own symbols, so names are compared by their bytes.
+  //
+  aOrder = MALLOC(nChild*sizeof(int));
+  is_grouped = MALLOC(nChild);
+  if( !aOrder || !is_grouped ){
+    FREE(aOrder);
+    FREE(is_grouped);
+    json = 0;
+    goto parallel_end;
+  }
+  memset(is_grouped, 0, nChild);
+  for(i=0, n=0; i<nChild; i++){
+    if( is_grouped[i] )
+      continue;
+    
+    k = n;
+    aOrder[n++] = i;
+    node = p.aSub[i].first;
+    for(j=i+1; j<nChild; j++){
+      if( !is_grouped[j]
+          && node->symbol->nName == p.aSub[j].first->symbol->nName
+          && memcmp(node->symbol->name, p.aSub[j].first->symbol->name, node->symbol->nName) == 0 ){
+        is_grouped[j] = 1;
+        aOrder[n++] = j;
+      }
+    }
+    
+    if( n-k > 1 ){
+      for(j=k; j<n; j++)
+        p.aSub[aOrder[j]].first->array_index = j-k+1;
+      p.aSub[aOrder[n-1]].first->is_array_end = 1;
+    }
+  }
+  
+  node = p.doc;
+  for(i=0; i<nChild; i++){
+    p.aSub[aOrder[i]].first->child_index = i+1;
+    p.aSub[aOrder[i]].first->parent = p.doc;
+    node->next = p.aSub[aOrder[i]].first;
+    node = p.aSub[aOrder[i]].last;
+  }
+  node->next = 0;
+  p.aSub[aOrder[nChild-1]].first->is_last_child = 1;
+  
+  //
+  // Output chunks of children, of roughly equal length, in their new order
+  //
+  for(i=0, k=0; k<p.nTask; k++){
+    p.aChunk[k].first = k ? p.aSub[aOrder[i]].first : p.root->next;
+    nByte = 0;
+    while( i<nChild && (nByte<nTarget || k==p.nTask-1) && nChild-i>p.nTask-k-1 )
+      nByte += p.aSub[aOrder[i++]].nByte;
+    p.aChunk[k].end = i<nChild ? p.aSub[aOrder[i]].first : 0;
+  }
+  FREE(aOrder);
+  FREE(is_grouped);
+  
+  json = xml_parallel_output(&p, nThread);
+  
+parallel_end:
+  for(k=0; k<p.nTask; k++)
+    arena_free(&p.aChunk[k].arena);
+  arena_free(&p.arena);
+  FREE(p.aChunk);
+  FREE(p.aSub);
+  
+  return json ? json : xml_convert(xml, -1, &p.options);
+}
+
+// State kept by each worker of xml_to_json_batch()
+typedef struct batch_worker *batch_worker;
+struct batch_worker{
+  struct arena arena;                   // Arena reused for each document
+  char *json;                           // JSON of documents converted by worker
+  int nJson;                            // Length of json
+  int nAlloc;                           // Allocated size of json
+};
+
+typedef struct xml_batch *xml_batch;
+struct xml_batch{
+  char **aXml;                          // XML strings
+  int *aOffset;                         // Offset of each JSON string
+  int *aWorker;                         // Worker that converted each document
+  int *aStart;                          // Offset of each JSON string in worker's json
+  batch_worker aBatchWorker;            // State of each worker
+  char *json;                           // Joined JSON strings
+  struct xml_options options;           // Conversion options
+  int nomem;                            // Set once a worker runs out of memory, atomically
+};
+
+//
+// xml_batch_convert
+//
+// Convert document i into worker iWorker's buffer, recording its length
+// in aOffset[i+1] until the offsets are known.
+//
+static void xml_batch_convert(void *pArg, int iWorker, int i){
+  xml_batch p = (xml_batch)pArg;
+  batch_worker w = &p->aBatchWorker[iWorker];
+  struct json_buffer out;
+  element root;
+  char *xml = p->aXml[i] ? p->aXml[i] : "";
+  char *zNew;
+  long long nAlloc;
+  
+  p->aOffset[i+1] = 0;
+  if( __atomic_load_n(&p->nomem, __ATOMIC_RELAXED) )
+    return;
+  arena_reset(&w->arena);
+  root = xml_parse(xml, -1, 0, &w->arena);
+  if( !root && w->arena.nomem ){
+    __atomic_store_n(&p->nomem, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  
+  // Documents that are not XML are null
+  memset(&out, 0, sizeof(out));
+  if( root ){
+    xml_group(root, 0, 0);
+    json_output(root, root->next, 0, &out, &p->options);
+  }else{
+    out.nJson = 4;
+  }
+  if( w->nJson+out.nJson+1 > w->nAlloc ){
+    nAlloc = 2*((long long)w->nJson+out.nJson+1);
+    zNew = nAlloc>0x7FFFFFFF ? 0 : REALLOC(w->json, nAlloc);
+    if( !zNew ){
+      __atomic_store_n(&p->nomem, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    w->json = zNew;
+    w->nAlloc = nAlloc;
+  }
+  
+  out.json = &w->json[w->nJson];
+  if( root ){
+    out.nJson = 0;
+    out.depth = 0;
+    json_output(root, root->next, 0, &out, &p->options);
+  }else{
+    memcpy(out.json, "null", 4);
+  }
+  
+  p->aWorker[i] = iWorker;
+  p->aStart[i] = w->nJson;
+  p->aOffset[i+1] = out.nJson;
+  w->nJson += out.nJson;
+}
+
+static void xml_batch_copy(void *pArg, int iWorker, int i){
+  xml_batch p = (xml_batch)pArg;
+  int n = p->aOffset[i+1] - p->aOffset[i] - 1;
+  
+  (void)iWorker;
+  memcpy(&p->json[p->aOffset[i]], &p->aBatchWorker[p->aWorker[i]].json[p->aStart[i]], n);
+  p->json[p->aOffset[i]+n] = 0;
+}
+
+//
+// xml_to_json_batch
+//
+// Convert nXml XML strings on up to nThread threads. If nThread is 0,
+// then one thread per CPU is used. Each worker reuses its own arena and
+// output buffer from one document to the next.
+//
+// The JSON strings are returned in a single buffer, which must be freed,
+// or null if memory runs out. The JSON for aXml[i] is the zero terminated
+// string at aOffset[i], so aOffset must have room for nXml+1 offsets, the
+// last being the size of the buffer. Strings that are not XML give null.
+//
+// The size of a document's JSON is only known once it is parsed, so each
+// worker outputs into its own buffer, and the buffers are copied into
+// place once all the offsets are known. Writing straight into place, as
+// xml_to_json_parallel() does for its chunks, would mean keeping every
+// document's parsed elements until all of them are sized, and those take
+// several times the memory of the JSON.
+//
+char *xml_to_json_batch(char **aXml, int nXml, int *aOffset, int indent, int nThread){
+  struct xml_batch p;
+  long long nJson;
+  int i;
+  
+  if( nThread<=0 )
+    nThread = sysconf(_SC_NPROCESSORS_ONLN);
+  if( nThread>nXml )
+    nThread = nXml;
+  if( nThread<1 )
+    nThread = 1;
+  
+  memset(&p, 0, sizeof(p));
+  p.aXml = aXml;
+  p.aOffset = aOffset;
+  xml_options_init(&p.options, indent);
+  p.aWorker = MALLOC(2*(nXml+1)*sizeof(int));
+  p.aBatchWorker = MALLOC(nThread*sizeof(struct batch_worker));
+  if( p.aWorker && p.aBatchWorker ){
+    p.aStart = &p.aWorker[nXml+1];
+    memset(p.aBatchWorker, 0, nThread*sizeof(struct batch_worker));
+    pool_run(nThread, nXml, xml_batch_convert, &p);
+  
+    nJson = 0;
+    for(i=0; i<nXml; i++)
+      nJson += aOffset[i+1] + 1;
+    if( !p.nomem && nJson<=0x7FFFFFFF ){
+      aOffset[0] = 0;
+      for(i=0; i<nXml; i++)
+        aOffset[i+1] += aOffset[i] + 1;
+      p.json = MALLOC(aOffset[nXml] ? aOffset[nXml] : 1);
+      if( p.json )
+        pool_run(nThread, nXml, xml_batch_copy, &p);
+    }
+  
+    for(i=0; i<nThread; i++){
+      arena_free(&p.aBatchWorker[i].arena);
+      FREE(p.aBatchWorker[i].json);
+    }
+  }
+  FREE(p.aBatchWorker);
+  FREE(p.aWorker);
+  
+  return p.json;
+}
+#endif
+
+//
+// xml_parse
+//
+// Parse XML string into a linked list of elements.
+//
+// The returned root element is not part of the XML. root->next is the
+// first element. Elements link to the original XML string, so it must
+// not be freed before the elements.
+//
+// Parsing stops after n bytes, or at the end of the string if n<0. The
+// root element is given the depth passed in, so that a fragment can be
+// parsed at the depth it will later be linked into a document.
+//
+// Returns null if the string is not XML, with text or a close tag outside
+// of any element, or if memory runs out, in which case a->nomem is set.
+//
+static element xml_parse(char *xml, int n, int depth, arena a){
+  element root;
+  element current_node = 0;
+  element new_node;
+  element parent_node;
+  element previous_node;
+  
+  element_attribute new_attr = 0;
+  element_attribute current_attr = 0;
+  
+  value new_value;
+  value current_value;
+  
+  value_part new_value_part = 0;
+
+  int i, j;
+  
+  root = (element)arena_alloc(a, sizeof(struct element));
+  if( !root )
+    return 0;
+  root->parent = 0;
+  root->depth = depth;
+  root->first_value = 0;
+  root->is_parent = 0;
+  root->child_index = 0;
+  root->is_last_child = 1;
+  root->array_index = 0;
+  root->is_array_end = 0;
+  root->next = 0;
+  root->first_attr = 0;
+  root->value_type = XML_VALUE_AUTO;
+  root->symbol = 0;
+  
+  previous_node = root;
+  
+  i = 0;
+  while( is_space(&xml[i]) ) i++;
+  while(xml[i] && (n<0 || i<n) && !xml_interrupted(a->interrupt)){
+    // Element open tag
+    //printf("%.*s\n", 1, &xml[i]);
+    if( xml[i]=='<' && xml[i+1]!='/' ){      
+      // Create node
+      depth++;
+      new_node = (element)arena_alloc(a, sizeof(struct element));
+      if( !new_node )
+        return 0;
+      
+      // Node name
+      j = 1;
+      while( xml[i+j] && !is_space(&xml[i+j]) && !(xml[i+j]=='/' || xml[i+j]=='>') ) j++;
+      j--;
+      new_node->symbol = xml_symbol_intern(&a->symbols, &xml[i+1], j);
+      if( !new_node->symbol ){
+        a->nomem = 1;
+        return 0;
+      }
+      i += j+1;
+      
+      // Default values
+      new_node->first_value = 0;
+      new_node->depth = depth;
+      new_node->is_parent = 0;
+      new_node->array_index = 0;
+      new_node->is_array_end = 0;
+      new_node->next = 0;
+      new_node->child_index = 0;
+      new_node->is_last_child = 0;
+      new_node->first_attr = 0;
+      new_node->value_type = XML_VALUE_AUTO;
+      
+      // Set parent node
+      parent_node = previous_node;
+      while( parent_node->depth >= new_node->depth && parent_node->parent )
+        parent_node = parent_node->parent;
+      new_node->parent = parent_node;
+      
+      if( !parent_node->is_parent )
+        parent_node->is_parent = 1;
+      
+      // Make new node the current node
+      previous_node->next = new_node;
+      previous_node = new_node;
+      current_node = new_node;
+      
+      // printf("%.*s\n", j, current_node->symbol->name);
+      // if( parent_node && parent_node->parent )
+      // printf("  Parent = %.*s\n", parent_node->symbol->nName, parent_node->symbol->name);
+      
+      // Get attributes
+      while( is_space(&xml[i]) ) i++;
+      while( xml[i] && xml[i]!='/' && xml[i]!='?' && xml[i]!='>' ){
+        // Create attribute
+        new_attr = (element_attribute)arena_alloc(a, sizeof(struct element_attribute));
+        if( !new_attr )
+          return 0;
+        if( !current_node->first_attr ){
+          current_node->first_attr = new_attr;
+        }else{
+          current_attr->next_attr = new_attr;
+        }
+        current_attr = new_attr;
+        current_attr->first_value_part = 0;
+        current_attr->next_attr = 0;
+        current_attr->value_type = XML_VALUE_AUTO;
+        
+        // Attribute name
+        j = 1;
+        while( xml[i+j] && xml[i+j]!='=' && !is_space(&xml[i+j]) ) j++;
+        current_attr->symbol = xml_symbol_intern(&a->symbols, &xml[i], j);
+        if( !current_attr->symbol ){
+          a->nomem = 1;
+          return 0;
+        }
+        i += j;
+        
+        // Ensure attribute value starts
+        while( xml[i] && (xml[i]!='"' || is_space(&xml[i])) ) i++;
+        
+        if( xml[i] ){
+          i++;
+          
+          // Ensure attribute value ends
+          j=0;
+          while( xml[i+j] && xml[i+j]!='"' ) j++;
+          
+          if( xml[i+j] ){
+            // Attribute value
+            do{
+              if( !current_attr->first_value_part ){
+                new_value_part = (value_part)arena_alloc(a, sizeof(struct value_part));
+                if( !new_value_part )
+                  return 0;
+                new_value_part->next_value_part = 0; 
+                current_attr->first_value_part = new_value_part;
+              }else{
+                new_value_part->next_value_part = (value_part)arena_alloc(a, sizeof(struct value_part));
+                new_value_part = new_value_part->next_value_part;
+                if( !new_value_part )
+                  return 0;
+                new_value_part->next_value_part = 0;
+              }
+
+              new_value_part = get_value_parts(&i, 0, xml, new_value_part, 1, a);
+              if( !new_value_part )
+                return 0;
+            }while( xml[i] && xml[i]!='"' );
+            
+            if( xml[i] == '"' ){
+              i++;
+              while( is_space(&xml[i]) ) i++;
+            }
+          }
+        }
+      }
+      
+      // Self closing element
+      if( xml[i]=='/' || xml[i]=='?' ){
+        current_node = current_node->parent;
+        depth--;
+        while( xml[i] && xml[i]!='>' ) i++;
+      }
+
+    // Element close tag
+    }else if( xml[i]=='<' && xml[i+1]=='/' ){
+      if( !current_node )
+        return 0;
+      current_node = current_node->parent;
+      depth--;
+      while( xml[i] && xml[i]!='>' ) i++;
+      
+    }else{
+      if( !current_node )
+        return 0;
+      i++;
+      
+      // Get value if it exists, or find the start of the next element
+      j = 0;
+      while( is_space(&xml[i+j]) ) j++;
+      
+      if( xml[i+j]!='<' || (!current_node->is_parent && xml[i+j]=='<' && xml[i+j+1]=='/') ){
+        
+        // Determine the deepest value of this element
+        current_value = current_node->first_value;
+        while( current_value && current_value->next_value )
+          current_value = current_value->next_value;
+        
+        new_value = (value)arena_alloc(a, sizeof(struct value));
+        if( !new_value )
+          return 0;
+        
+        // Either make the new value the first value of the element,
+        // or link the new value to the previous one
+        if( !current_node->first_value ){
+          current_node->first_value = new_value;
+        }else{
+          current_value->next_value = new_value;
+        }
+        
+        new_value->first_value_part = 0;
+        new_value->next_value = 0;
+
+        // Value
+        new_value_part = 0;
+        while( xml[i] && xml[i]!='<' ){
+          if( !new_value->first_value_part ){
+            new_value_part = (value_part)arena_alloc(a, sizeof(struct value_part));
+            if( !new_value_part )
+              return 0;
+            new_value_part->next_value_part = 0; 
+            new_value->first_value_part = new_value_part;
+          }else{
+            new_value_part->next_value_part = (value_part)arena_alloc(a, sizeof(struct value_part));
+            new_value_part = new_value_part->next_value_part;
+            if( !new_value_part )
+              return 0;
+            new_value_part->next_value_part = 0;
+          }
+          new_value_part = get_value_parts(&i, 0, xml, new_value_part, 0, a);
+          if( !new_value_part )
+            return 0;
+          j = 0;
+        }
+        
+        // if( new_value_part )
+        //   printf("%.*s=%.*s\n", current_node->symbol->nName,
+        //                         current_node->symbol->name,
+        //                         new_value_part->nVal,
+        //                         new_value_part->val);
+      }
+      i += j;
+    }
+  }
+  
+  return root;
+}
+
+//
+// xml_group
+//
+// Determine sibling indexes and group arrays.
+//
+// Elements shallower than min_depth are skipped, and left for the caller
+// to index.
+//
+static void xml_group(element root, int min_depth, xml_interrupt it){
+  element current_node;
+  element previous_node;
+  element test_node;
+  element next_node;
+  element previous_sibling;
+  element previous_array_node;
+  element test_node_deepest_node;
+#ifdef DEBUG
+  element_attribute current_attr;
+#endif
+  
+  int i;
+  
+  //
+  // Determine first/last nodes in a family
+  //
+  current_node = root;
+  while(current_node->next && !xml_interrupted(it)){
+    current_node = current_node->next;
+    if( !current_node->child_index && current_node->depth >= min_depth ){
+      i = 1;
+      test_node = current_node;
+      previous_node = 0;
+      do{
+        if( current_node->parent == test_node->parent ){
+          if( !current_node->child_index )
+            current_node->child_index = 1;
+          
+          if( current_node != test_node )
+            test_node->child_index = ++i;
+          
+          previous_node = test_node;
+        }
+        
+        test_node = test_node->next;
+      }while(test_node && test_node->depth >= current_node->depth && !xml_interrupted(it));
+      
+      if( previous_node )
+        previous_node->is_last_child = 1;
+    }
+  }
+  
+  //
+  // Determine and group arrays
+  //
+  current_node = root;
+  while(current_node->next && !xml_interrupted(it)){
+    current_node = current_node->next;
+    if( !current_node->array_index && current_node->depth >= min_depth ){
+      i = 1;
+      test_node = current_node;
+      previous_array_node = 0;
+      while(test_node->next && test_node->depth >= current_node->depth && !xml_interrupted(it)){
+        test_node = test_node->next;
+        if( current_node->parent == test_node->parent 
+            && current_node->symbol == test_node->symbol ){
+          if( !current_node->array_index ){
+            current_node->array_index = 1;
+            previous_array_node = current_node; 
+          }
+          test_node->array_index = ++i;
+          
+          //
+          // Re-order if array elements are separated
+          //
+          // e.g. <a>
+          //        <b>1</b>
+          //        <c/>
+          //        <b>2</b>
+          //      </a>
+          //
+          //      becomes:
+          //
+          //      <a>
+          //        <b>1</b>
+          //        <b>2</b>
+          //        <c/>
+          //      </a>
+          //
+          if( test_node->child_index != previous_array_node->child_index+1 ){
+            
+            next_node = previous_array_node->next;
+            previous_sibling = next_node;
+
+            //
+            // Get the node that the furthest child of the test node points to
+            //
+            test_node_deepest_node = test_node;
+            while( test_node_deepest_node->next && test_node_deepest_node->next->depth > test_node->depth)
+              test_node_deepest_node = test_node_deepest_node->next;
+            
+            // Shift up each sibling node that sits between the previous array element and the test node
+            while( next_node->next != test_node ){
+              if( previous_array_node->parent == next_node->parent ){
+                previous_sibling = next_node;
+                previous_sibling->child_index++;
+              }
+              next_node = next_node->next;
+            }
+            if( previous_array_node->parent == next_node->parent ){
+              previous_sibling = next_node;
+              previous_sibling->child_index++;
+            }
+            
+            // Set test node's previous node to point to the test node's next node
+            next_node->next = test_node_deepest_node->next;
+            
+            // If the test node was the last child,
+            // then flag the last array element as the last child,
+            // and un-flag the test node
+            if( test_node->is_last_child ){
+              previous_sibling->is_last_child = 1;
+              test_node->is_last_child = 0;
+            }
+            
+            // Set the test node to be the next adjacent sibling to the 
+            // previous array element
+            test_node->child_index = previous_array_node->child_index+1;
+
+            //
+            // Get the node that the furthest child of the previous array node points to
+            //
+            next_node = previous_array_node;
+            do{
+              previous_node = next_node;
+              next_node = next_node->next;
+            }while( next_node->parent != previous_array_node->parent );
+            
+            previous_node->next = test_node;
+            test_node_deepest_node->next = next_node;
+          }
+        
+          previous_array_node = test_node;
+        }
+      }
+      if( previous_array_node )
+        previous_array_node->is_array_end = 1;
+    }
+  }
+  
+#ifdef DEBUG
+  current_node = root;
+  while(current_node->next){
+    current_node = current_node->next;
+   
+    printf("%.*s\n", current_node->symbol->nName, current_node->symbol->name);
+    if( current_node->parent && current_node->parent->parent )
+      printf("  Parent = %.*s\n", current_node->parent->symbol->nName, current_node->parent->symbol->name);
+    
+    printf("  depth = %d\n", current_node->depth);
+    printf("  is_parent = %d\n", current_node->is_parent);
+    printf("  child_index = %d\n", current_node->child_index);
     printf("  is_last_child = %d\n", current_node->is_last_child);
     printf("  array_index = %d\n", current_node->array_index);
     printf("  is_array_end = %d\n", current_node->is_array_end);
     
-    current_attr = current_node->first_attr;
-    while( current_attr ){
-      printf("  @%.*s=%.*s\n", current_attr->nName, current_attr->name, current_attr->nName, current_attr->name);
-      current_attr = current_attr->next_attr;
+    current_attr = current_node->first_attr;
+    while( current_attr ){
+      printf("  @%.*s=%.*s\n", current_attr->symbol->nName, current_attr->symbol->name, current_attr->symbol->nName, current_attr->symbol->name);
+      current_attr = current_attr->next_attr;
+    }
+    
+    printf("  \"#text\":\"%.*s\"\n", current_node->symbol->nName, current_node->symbol->name);
+  }
+#endif
+}
+
+//
+// xml_group_schema
+//
+// Determine sibling indexes and arrays from a schema, in place of
+// xml_group(), in a single pass over the elements. Dropped elements and
+// attributes are unlinked. Elements not in the schema are an array if
+// their name repeats among their siblings, as with xml_group(), which is
+// found with a hash table of the names of the open elements' children
+// rather than by searching the siblings. An element of an array that does not
+// follow the one before it is moved after it once its own children are
+// done, as xml_group() would reorder it.
+//
+// Returns 0 if memory runs out, when grouping stops, as if interrupted,
+// and the elements must not be output.
+//
+typedef struct schema_frame *schema_frame;
+struct schema_frame{
+  element node;                         // Element
+  xml_schema schema;                    // Its schema, or null if not in the schema
+  element prev;                         // Element before it
+  element move_after;                   // Element to move it after at its end, or null
+  int iSlot;                            // Slot of its name among its siblings
+  int iChildSlot;                       // First slot of its children's names
+  element last;                         // Last child not moved, or null
+  int nChild;                           // Number of children kept
+};
+
+// Children of an element with the same name
+typedef struct schema_slot *schema_slot;
+struct schema_slot{
+  element parent;                       // Parent element
+  element tail;                         // Last child of the name kept
+  element end;                          // Last descendant of tail, once it is done
+  unsigned int hash;                    // Hash of parent and name
+  int next;                             // Next slot in the same hash bucket, or -1
+};
+
+// Slots of the children of the open elements. Slots are added and removed
+// last in first out, so a slot removed is always first in its bucket.
+typedef struct schema_names *schema_names;
+struct schema_names{
+  schema_slot aSlot;                    // Slots
+  int nSlot;                            // Number of slots
+  int *aHash;                           // First slot in each bucket, or -1
+  int nHash;                            // Number of buckets, a power of 2
+};
+
+static unsigned int schema_names_hash(element parent, xml_symbol symbol){
+  return ((unsigned int)(size_t)parent ^ symbol->hash) * 16777619;
+}
+
+//
+// schema_names_find
+//
+// Find the slot of node's name among its siblings, or add one if there is
+// none. Returns the slot, and sets *pIsNew if it was added. Returns -1 if
+// memory runs out.
+//
+static int schema_names_find(schema_names h, element node, int *pIsNew){
+  schema_slot slot;
+  schema_slot aSlot;
+  int *aHash;
+  unsigned int x;
+  int i;
+  
+  x = schema_names_hash(node->parent, node->symbol);
+  for(i=h->aHash[x & (h->nHash-1)]; i>=0; i=slot->next){
+    slot = &h->aSlot[i];
+    if( slot->parent==node->parent && slot->tail->symbol==node->symbol ){
+      *pIsNew = 0;
+      return i;
+    }
+  }
+  
+  // Twice as many buckets as slots
+  if( h->nSlot*2 >= h->nHash ){
+    aSlot = REALLOC(h->aSlot, h->nHash*sizeof(struct schema_slot));
+    if( !aSlot )
+      return -1;
+    h->aSlot = aSlot;
+    aHash = REALLOC(h->aHash, 2*h->nHash*sizeof(int));
+    if( !aHash )
+      return -1;
+    h->aHash = aHash;
+    h->nHash *= 2;
+    memset(h->aHash, 0xff, h->nHash*sizeof(int));
+    for(i=0; i<h->nSlot; i++){
+      slot = &h->aSlot[i];
+      slot->next = h->aHash[slot->hash & (h->nHash-1)];
+      h->aHash[slot->hash & (h->nHash-1)] = i;
+    }
+  }
+  
+  i = h->nSlot++;
+  slot = &h->aSlot[i];
+  slot->parent = node->parent;
+  slot->tail = node;
+  slot->end = 0;
+  slot->hash = x;
+  slot->next = h->aHash[x & (h->nHash-1)];
+  h->aHash[x & (h->nHash-1)] = i;
+  *pIsNew = 1;
+  return i;
+}
+
+static int xml_group_schema(element root, xml_schema schema, xml_interrupt it){
+  struct schema_frame aStatic[32];
+  struct schema_names names;
+  schema_frame aFrame = aStatic;
+  schema_frame aNew;
+  schema_frame f;
+  schema_frame pf;
+  schema_slot slot;
+  xml_schema s;
+  xml_schema sa;
+  element node;
+  element prev;
+  element end;
+  element_attribute *pAttr;
+  int nFrame = 1;
+  int nFrameAlloc = 32;
+  int iSlot;
+  int is_new;
+  int ok = 1;
+  
+  names.nSlot = 0;
+  names.nHash = 64;
+  names.aSlot = MALLOC((names.nHash/2)*sizeof(struct schema_slot));
+  names.aHash = MALLOC(names.nHash*sizeof(int));
+  if( !names.aSlot || !names.aHash ){
+    FREE(names.aSlot);
+    FREE(names.aHash);
+    return 0;
+  }
+  memset(names.aHash, 0xff, names.nHash*sizeof(int));
+  
+  memset(aFrame, 0, sizeof(struct schema_frame));
+  aFrame[0].node = root;
+  aFrame[0].schema = schema;
+  
+  prev = root;
+  node = root->next;
+  for(;;){
+    if( xml_interrupted(it) )
+      break;
+    
+    // End the elements that node is not inside of
+    while( nFrame>1 && (!node || aFrame[nFrame-1].node->depth >= node->depth) ){
+      f = &aFrame[--nFrame];
+      end = prev;
+      if( f->last )
+        f->last->is_last_child = 1;
+      else
+        f->node->is_parent = 0;
+      
+      if( f->move_after ){
+        f->prev->next = end->next;
+        end->next = f->move_after->next;
+        f->move_after->next = f->node;
+        prev = f->prev;
+      }else{
+        aFrame[nFrame-1].last = f->node;
+      }
+      names.aSlot[f->iSlot].end = end;
+      
+      // Slots of its children's names
+      while( names.nSlot>f->iChildSlot ){
+        slot = &names.aSlot[--names.nSlot];
+        names.aHash[slot->hash & (names.nHash-1)] = slot->next;
+      }
+    }
+    if( !node )
+      break;
+    pf = &aFrame[nFrame-1];
+    
+    s = pf->schema ? xml_schema_child(pf->schema, node->symbol->name, node->symbol->nName, 0) : 0;
+    iSlot = -1;
+    if( !s || s->type!=XML_SCHEMA_DROP ){
+      iSlot = schema_names_find(&names, node, &is_new);
+      if( iSlot<0 ){
+        ok = 0;
+        break;
+      }
+    }
+    
+    // Dropped elements, and elements after the first that are not an array
+    if( iSlot<0 || (s && s->type==XML_SCHEMA_SCALAR && !is_new) ){
+      end = node;
+      while( end->next && end->next->depth > node->depth )
+        end = end->next;
+      prev->next = end->next;
+      node = end->next;
+      continue;
+    }
+    
+    if( nFrame==nFrameAlloc ){
+      if( aFrame==aStatic ){
+        aNew = MALLOC(2*nFrameAlloc*sizeof(struct schema_frame));
+        if( aNew )
+          memcpy(aNew, aStatic, sizeof(aStatic));
+      }else{
+        aNew = REALLOC(aFrame, 2*nFrameAlloc*sizeof(struct schema_frame));
+      }
+      if( !aNew ){
+        ok = 0;
+        break;
+      }
+      aFrame = aNew;
+      nFrameAlloc *= 2;
+      pf = &aFrame[nFrame-1];
+    }
+    f = &aFrame[nFrame++];
+    memset(f, 0, sizeof(struct schema_frame));
+    f->node = node;
+    f->schema = s;
+    f->prev = prev;
+    f->iSlot = iSlot;
+    f->iChildSlot = names.nSlot;
+    
+    node->child_index = ++pf->nChild;
+    node->is_last_child = 0;
+    node->array_index = 0;
+    node->is_array_end = 0;
+    
+    // Arrays, from the schema or a repeated name
+    slot = &names.aSlot[iSlot];
+    if( !is_new ){
+      if( !slot->tail->array_index )
+        slot->tail->array_index = 1;
+      node->array_index = slot->tail->array_index+1;
+      node->is_array_end = 1;
+      slot->tail->is_array_end = 0;
+      if( prev!=slot->end )
+        f->move_after = slot->end;
+      slot->tail = node;
+    }else if( s && s->type==XML_SCHEMA_ARRAY ){
+      node->array_index = 1;
+      node->is_array_end = 1;
+    }
+    
+    // Attributes to drop or type
+    if( s && s->nChild ){
+      for(pAttr=&node->first_attr; *pAttr; ){
+        sa = xml_schema_child(s, (*pAttr)->symbol->name, (*pAttr)->symbol->nName, 1);
+        if( sa && sa->type==XML_SCHEMA_DROP ){
+          *pAttr = (*pAttr)->next_attr;
+        }else{
+          if( sa )
+            (*pAttr)->value_type = sa->value_type;
+          pAttr = &(*pAttr)->next_attr;
+        }
+      }
+    }
+    if( s )
+      node->value_type = s->value_type;
+    
+    prev = node;
+    node = node->next;
+  }
+  
+  // The document element
+  if( aFrame[0].last )
+    aFrame[0].last->is_last_child = 1;
+  
+  if( aFrame!=aStatic )
+    FREE(aFrame);
+  FREE(names.aSlot);
+  FREE(names.aHash);
+  return ok;
+}
+
+//
+// html_code_to_str()
+//
+// Convert a html code to a char array.
+//
+//   e.g. &#39; to '
+//
+// Allocated from the arena. Returns 0 if memory runs out.
+//
+static int html_code_to_str(int *i, value_part value_part, const char *xml, arena a){
+  // find end of html code
+  int start = *i+1;
+  int len = 0;
+  while( xml[start+len]!=';' )
+    len++;
+
+  // advance through xml
+  *i += 2+len;
+  
+  // str to int
+  int m = 1; // multiplier 1, 10, 100 etc.
+  unsigned long x = 0;
+  while( len>0 ){
+    x += (xml[start+len-1]-48)*m;
+    m *= 10;
+    len--;
+  }
+
+  // int to char array
+  char *str;
+  if( x < 1 << 8 ){
+    value_part->nVal = 1;
+    str = arena_alloc(a, 2);
+    if( !str )
+      return 0;
+    str[0] = x & 0xFF;
+    str[1] = 0;
+  }else if( x < 1 << 16 ){
+    value_part->nVal = 2;
+    str = arena_alloc(a, 3);
+    if( !str )
+      return 0;
+    str[0] = (x >> 8) & 0xFF;
+    str[1] = x & 0xFF;
+    str[2] = 0;
+  }else if( x < 1 << 16 ){
+    value_part->nVal = 3;
+    str = arena_alloc(a, 4);
+    if( !str )
+      return 0;
+    str[0] = (x >> 16) & 0xFF;
+    str[1] = (x >> 8) & 0xFF;
+    str[2] = x & 0xFF;
+    str[3] = 0;
+  }else{
+    value_part->nVal = 4;
+    str = arena_alloc(a, 5);
+    if( !str )
+      return 0;
+    str[0] = (x >> 24) & 0xFF;
+    str[1] = (x >> 16) & 0xFF;
+    str[2] = (x >> 8) & 0xFF;
+    str[3] = x & 0xFF;
+    str[4] = 0;
+  }
+  value_part->val = str;
+  return 1;
+}
+
+static value_part get_value_parts(int *i, int j, char *xml, value_part new_value_part, int is_attr, arena a){
+
+  while( xml[*i+j] && !(xml[*i+j]=='<'
+                    || xml[*i+j]=='&'
+                    || xml[*i+j]=='\b'
+                    || xml[*i+j]=='\t'
+                    || xml[*i+j]=='\n'
+                    || xml[*i+j]=='\f'
+                    || xml[*i+j]=='\r'
+                    || xml[*i+j]=='"'
+                    || xml[*i+j]=='\\') )
+    j++;
+
+  //printf("%.*s\n", j, &xml[*i]);
+  
+  new_value_part->nVal = j;
+  new_value_part->val = &xml[*i];
+  *i += j;
+  
+  // Special characters
+  if( xml[*i]=='&'
+   || xml[*i]=='\b'
+   || xml[*i]=='\t'
+   || xml[*i]=='\n'
+   || xml[*i]=='\f'
+   || xml[*i]=='\r'
+   || (xml[*i]=='"' && !is_attr)
+   || xml[*i]=='\\' ){
+    new_value_part->next_value_part = (value_part)arena_alloc(a, sizeof(struct value_part));
+    new_value_part = new_value_part->next_value_part;
+    if( !new_value_part )
+      return 0;
+    new_value_part->next_value_part = 0;
+  }
+  
+  if( xml[*i]=='&' ){
+    *i += 1;
+    if( memcmp("amp;", &xml[*i], 4) == 0 ){
+      new_value_part->nVal = 1;
+      new_value_part->val = "&";
+      *i += 4;
+    }else if( memcmp("gt;", &xml[*i], 3) == 0 ){
+      new_value_part->nVal = 1;
+      new_value_part->val = ">";
+      *i += 3;
+    }else if( memcmp("lt;", &xml[*i], 3) == 0 ){
+      new_value_part->nVal = 1;
+      new_value_part->val = "<";
+      *i += 3;
+    }else if( memcmp("quot;", &xml[*i], 5) == 0 ){
+      new_value_part->nVal = 2;
+      new_value_part->val = "\\\"";
+      *i += 5;
+    }else if( memcmp("apos;", &xml[*i], 5) == 0 ){
+      new_value_part->nVal = 1;
+      new_value_part->val = "'";
+      *i += 5;
+    }else if( memcmp("#8;", &xml[*i], 3) == 0 ){
+      new_value_part->nVal = 2;
+      new_value_part->val = "\\b";
+      *i += 3;
+    }else if( memcmp("#9;", &xml[*i], 3) == 0 ){
+      new_value_part->nVal = 2;
+      new_value_part->val = "\\t";
+      *i += 3;
+    }else if( memcmp("#10;", &xml[*i], 4) == 0 ){
+      new_value_part->nVal = 2;
+      new_value_part->val = "\\n";
+      *i += 4;
+    }else if( memcmp("#12;", &xml[*i], 4) == 0 ){
+      new_value_part->nVal = 2;
+      new_value_part->val = "\\f";
+      *i += 4;
+    }else if( memcmp("#13;", &xml[*i], 4) == 0 ){
+      new_value_part->nVal = 2;
+      new_value_part->val = "\\r";
+      *i += 4;
+    }else if( memcmp("#34;", &xml[*i], 4) == 0 ){
+      new_value_part->nVal = 2;
+      new_value_part->val = "\\\"";
+      *i += 4;
+    }else if( memcmp("#92;", &xml[*i], 4) == 0 ){
+      new_value_part->nVal = 2;
+      new_value_part->val = "\\\\";
+      *i += 4;
+    }else if( memcmp("#", &xml[*i], 1) == 0 ){
+      if( !html_code_to_str(i, new_value_part, (const char *)xml, a) )
+        return 0;
+    }
+  }else if( xml[*i]=='\b' ){
+    new_value_part->nVal = 2;
+    new_value_part->val = "\\b";
+    *i += 1;
+  }else if( xml[*i]=='\t' ){
+    new_value_part->nVal = 2;
+    new_value_part->val = "\\t";
+    *i += 1;
+  }else if( xml[*i]=='\n' ){
+    new_value_part->nVal = 2;
+    new_value_part->val = "\\n";
+    *i += 1;
+  }else if( xml[*i]=='\f' ){
+    new_value_part->nVal = 2;
+    new_value_part->val = "\\f";
+    *i += 1;
+  }else if( xml[*i]=='\r' ){
+    new_value_part->nVal = 2;
+    new_value_part->val = "\\r";
+    *i += 1;
+  }else if( !is_attr && xml[*i]=='"' ){
+    new_value_part->nVal = 2;
+    new_value_part->val = "\\\"";
+    *i += 1;
+  }else if( xml[*i]=='\\' ){
+    new_value_part->nVal = 2;
+    new_value_part->val = "\\\\";
+    *i += 1;
+  }
+
+  return new_value_part;
+}
+
+//
+// Typed values
+//
+// With typed output, text and attribute values that are JSON numbers, or
+// true or false, are output as JSON numbers and booleans rather than
+// strings. Most values are rejected by their first byte. Numbers must be in
+// the JSON form, so values such as 007, +1 or 1. stay strings, as do
+// values with entities or surrounding spaces.
+//
+
+// Length of the run of digits at z, which is n bytes long
+static int xml_digits(const char *z, int n){
+  const char *p = z;
+  const char *end = z+n;
+  unsigned long long w;
+#ifdef __SSE2__
+  __m128i v;
+  __m128i nine = _mm_set1_epi8(9);
+  int mask;
+  
+  // Bytes of 0-9 once '0' is taken off
+  while( end-p>=16 ){
+    v = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)p), _mm_set1_epi8('0'));
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, nine), v));
+    if( mask!=0xFFFF )
+      return p - z + __builtin_ctz(~mask);
+    p += 16;
+  }
+#endif
+  
+  // A byte is a digit if its high nibble is 3 and adding 6 to its low
+  // nibble does not carry
+  while( end-p>=8 ){
+    memcpy(&w, p, 8);
+    if( ((w & 0xF0F0F0F0F0F0F0F0ULL) ^ 0x3030303030303030ULL)
+        | (((w & 0x0F0F0F0F0F0F0F0FULL) + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) )
+      break;
+    p += 8;
+  }
+  while( p<end && *p>='0' && *p<='9' ) p++;
+  return p-z;
+}
+
+//
+// xml_value_kind
+//
+// Returns how a value with the given type is output: VALUE_STRING, or the
+// JSON number or boolean it holds if typed output is on or the type asks
+// for one.
+//
+static int xml_value_kind(value_part first, int value_type, int typed){
+  char *z;
+  int n;
+  int kind = VALUE_INTEGER;
+  int i, k;
+  
+  if( value_type==XML_VALUE_STRING || (value_type==XML_VALUE_AUTO && !typed)
+      || !first || first->next_value_part || first->nVal==0 )
+    return VALUE_STRING;
+  z = first->val;
+  n = first->nVal;
+  
+  switch( z[0] ){
+    case 't':
+      return value_type!=XML_VALUE_NUMBER && n==4 && memcmp(z, "true", 4)==0 ? VALUE_TRUE : VALUE_STRING;
+    case 'f':
+      return value_type!=XML_VALUE_NUMBER && n==5 && memcmp(z, "false", 5)==0 ? VALUE_FALSE : VALUE_STRING;
+    case '-': case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+      if( value_type==XML_VALUE_BOOLEAN )
+        return VALUE_STRING;
+      break;
+    default:
+      return VALUE_STRING;
+  }
+  
+  // -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+  i = z[0]=='-';
+  if( i<n && z[i]=='0' ){
+    i++;
+  }else{
+    k = xml_digits(&z[i], n-i);
+    if( k==0 )
+      return VALUE_STRING;
+    i += k;
+  }
+  if( i<n && z[i]=='.' ){
+    k = xml_digits(&z[i+1], n-i-1);
+    if( k==0 )
+      return VALUE_STRING;
+    i += k+1;
+    kind = VALUE_REAL;
+  }
+  if( i<n && (z[i]=='e' || z[i]=='E') ){
+    i++;
+    if( i<n && (z[i]=='+' || z[i]=='-') )
+      i++;
+    k = xml_digits(&z[i], n-i);
+    if( k==0 )
+      return VALUE_STRING;
+    i += k;
+    kind = VALUE_REAL;
+  }
+  return i==n ? kind : VALUE_STRING;
+}
+
+// Output a value, quoted unless it is a typed number or boolean
+static void print_value(json_buffer out, value_part first, int value_type, xml_options opt){
+  value_part part;
+  
+  if( xml_value_kind(first, value_type, opt->typed)!=VALUE_STRING ){
+    print_string(out, first->val, first->nVal);
+    return;
+  }
+  
+  // Join value parts
+  print_char(out, '"');
+  for(part=first; part; part=part->next_value_part)
+    print_string(out, part->val, part->nVal);
+  print_char(out, '"');
+}
+
+#define PRINT_SPACES(x) print_spaces(out, x)
+#define PRINT_INDENT(x) print_indent(out, x, indent)
+#define PRINT_NEWLINE print_newline(out, indent)
+#define PRINT_CHAR(x) print_char(out, x)
+#define PRINT_STRING(z,n) print_string(out, z, n);
+#define PRINT_KEY(z,n,symbol) print_key(out, z, n, symbol, indent)
+
+//
+// json_output
+//
+// If out->json is null, then calculate total space required.
+// If out->json is not null, then populate with JSON string.
+//
+// Outputs elements from first up to, but not including, end. Pass
+// root->next and null to output the whole document. Indenting starts
+// at out->depth, which is updated to the depth after the last element.
+//
+// Returns out->nJson. Does not zero terminate JSON string.
+//
+int json_output(element root, element first, element end, json_buffer out, xml_options opt){
+  int indent = opt->indent;
+  int depth = out->depth;
+  
+  element current_node;
+  element parent_node;
+  element_attribute current_attr;
+  value current_value;
+
+  for(current_node=first; current_node!=end; current_node=current_node->next){
+    if( xml_interrupted(opt->interrupt) )
+      break;
+
+    // Opening bracket
+    if( (current_node->child_index == 1 && !current_node->parent->first_attr && !current_node->parent->first_value) || current_node == root->next ){
+      if( current_node->parent->array_index > 1){
+        PRINT_INDENT(depth);
+      }
+      PRINT_CHAR('{');
+      PRINT_NEWLINE;
+      depth++;
+    }
+    
+    // Node name
+    if( current_node->array_index <= 1 ){
+      PRINT_INDENT(depth);
+      PRINT_KEY(0, 0, current_node->symbol);
+    }
+    
+    // Attributes
+    current_attr = current_node->first_attr;
+    if( current_attr ){
+      
+      if( current_node->array_index == 1 ){
+        depth++;
+        PRINT_CHAR('[');
+        PRINT_NEWLINE;
+      }
+      
+      if( current_node->array_index ){
+        PRINT_INDENT(depth);
+      }
+      
+      PRINT_CHAR('{');
+      PRINT_NEWLINE;
+      depth++;
+      
+      while(current_attr){
+        // "@name":"value",
+        PRINT_INDENT(depth);
+        PRINT_KEY(opt->attr_prefix, opt->nAttrPrefix, current_attr->symbol);
+
+        print_value(out, current_attr->first_value_part, current_attr->value_type, opt);
+
+        current_attr = current_attr->next_attr;
+        
+        if( current_attr || current_node->first_value || current_node->is_parent ){
+          PRINT_CHAR(',');
+          PRINT_NEWLINE;
+        }
+      }
+      
+      if( !current_node->first_value && !current_node->is_parent ){
+        depth--;
+        PRINT_NEWLINE;
+        PRINT_INDENT(depth);
+        PRINT_CHAR('}');
+      }
+    }
+    
+    // Array start
+    if( current_node->array_index == 1 && !current_node->first_attr ){
+      depth++;
+      PRINT_CHAR('[');
+      PRINT_NEWLINE;
+      if( current_node->is_parent ){
+        PRINT_INDENT(depth);
+      }
+    }
+    
+    // #text
+    if( current_node->first_value && (current_node->first_attr || current_node->is_parent) ){
+      if( current_node->array_index > 1 || (current_node->array_index && current_node->first_attr) ){
+        PRINT_INDENT(depth);
+      }
+      if( current_node->is_parent && !current_node->first_attr ){
+        PRINT_CHAR('{');
+        PRINT_NEWLINE;
+        depth++;
+      }
+      if( !(current_node->first_attr && current_node->array_index ) ){
+        PRINT_INDENT(depth);
+      }
+      PRINT_CHAR('"');
+      PRINT_STRING(opt->text_key, opt->nTextKey);
+      PRINT_CHAR('"');
+      PRINT_CHAR(':');
+      PRINT_SPACES(indent < 0 ? 0 : 1);
+      
+      // Array of values
+      if( current_node->first_value->next_value ){
+        PRINT_CHAR('[');
+        PRINT_NEWLINE;
+        current_value = current_node->first_value;
+        
+        while( current_value ){
+          PRINT_INDENT(depth+1);
+          
+          print_value(out, current_value->first_value_part, current_node->value_type, opt);
+
+          current_value = current_value->next_value;
+          if( current_value ){
+            PRINT_CHAR(',');
+            PRINT_NEWLINE;
+          }else{
+            PRINT_NEWLINE;
+            PRINT_INDENT(depth);
+            PRINT_CHAR(']');
+          }
+        }
+      }
+    }
+    
+    // null
+    if( !current_node->first_value && !current_node->is_parent && !current_node->first_attr ){
+      if( current_node->array_index ){
+        PRINT_INDENT(depth);
+      }
+      PRINT_STRING("null", 4);
+    }
+    
+    // Value
+    if( current_node->first_value && !current_node->first_value->next_value ){
+      if( current_node->array_index && !current_node->is_parent && !current_node->first_attr ){
+        PRINT_INDENT(depth);
+      }
+      
+      print_value(out, current_node->first_value->first_value_part, current_node->value_type, opt);
+      
+      if( current_node->first_attr && !current_node->is_parent ){
+        depth--;
+        PRINT_NEWLINE;
+        PRINT_INDENT(depth);
+        PRINT_CHAR('}');
+      }
+    }
+    
+    // Comma
+    if( (!current_node->is_last_child && !current_node->is_array_end && !current_node->is_parent) || (current_node->is_parent && current_node->first_value) ){
+      PRINT_CHAR(',');
+      PRINT_NEWLINE;
+    }
+    
+    // Trailing brackets
+    if( (current_node->is_last_child || current_node->is_array_end ) && !current_node->is_parent ){
+      parent_node = current_node;
+      
+      while( parent_node != root && (!current_node->next || parent_node != current_node->next->parent) ){
+        if( parent_node->is_array_end ){
+          depth--;
+          PRINT_NEWLINE;
+          PRINT_INDENT(depth);
+          PRINT_CHAR(']');
+          if( !parent_node->is_last_child ){
+            PRINT_CHAR(',');
+          }
+        }
+        
+        if( parent_node->is_last_child ){
+          depth--;
+          PRINT_NEWLINE;
+          PRINT_INDENT(depth);
+          PRINT_CHAR('}');
+          if( !parent_node->parent->is_last_child && !parent_node->parent->is_array_end ){
+            PRINT_CHAR(',');
+          }
+        }
+
+        parent_node = parent_node->parent;
+      }
+      PRINT_NEWLINE;
+    }
+    
+  }
+  
+  out->depth = depth;
+  return out->nJson;
+}
+
+//
+// Encoders
+//
+// Binary formats are written by walking the element tree with the same
+// structure as json_output(), and calling the encoder for each object,
+// array, key and value. Strings are passed as value parts, which may hold
+// JSON escapes, i.e. a part of two bytes starting with a backslash.
+//
+typedef struct encoder *encoder;
+struct encoder{
+  unsigned char *z;                     // Output
+  int n;                                // Length of output
+  int nAlloc;                           // Allocated size of z
+  int *aOpen;                           // Offsets of open objects and arrays
+  int *aItem;                           // Items written to each open object and array
+  int nOpen;                            // Number of open objects and arrays
+  int nOpenAlloc;                       // Allocated size of aOpen and aItem
+  int error;                            // XML_ERROR_NOMEM or _TOOBIG once the output cannot grow
+  int counted;                          // True if objects and arrays are opened with their number of items
+  unsigned int *aCount;                 // Items in each object and array, in the order they are opened
+  int nCount;                           // Number of objects and arrays counted
+  int nCountAlloc;                      // Allocated size of aCount
+  int iCount;                           // Next object or array to be opened
+  void (*xObject)(encoder);             // Start of object
+  void (*xArray)(encoder);              // Start of array
+  void (*xEnd)(encoder);                // End of object or array
+  void (*xString)(encoder, value_part); // Key or string value
+  void (*xNumber)(encoder, char*, int, int); // Number of n bytes, VALUE_INTEGER or _REAL
+  void (*xBoolean)(encoder, int);       // true or false value
+  void (*xNull)(encoder);               // null value
+  xml_options options;                  // Attribute prefix and text key
+};
+
+// Reserve space for n more bytes of output. Returns null, and sets
+// e->error, if the output cannot grow, and after any earlier failure.
+static unsigned char *encode_reserve(encoder e, int n){
+  long long nAlloc;
+  unsigned char *z;
+  
+  if( e->error )
+    return 0;
+  if( (long long)e->n+n > e->nAlloc ){
+    if( (long long)e->n+n > 0x7FFFFFFF ){
+      e->error = XML_ERROR_TOOBIG;
+      return 0;
+    }
+    nAlloc = 2*((long long)e->n+n) + 256;
+    if( nAlloc>0x7FFFFFFF )
+      nAlloc = 0x7FFFFFFF;
+    z = REALLOC(e->z, nAlloc);
+    if( !z ){
+      e->error = XML_ERROR_NOMEM;
+      return 0;
+    }
+    e->z = z;
+    e->nAlloc = nAlloc;
+  }
+  e->n += n;
+  return &e->z[e->n-n];
+}
+
+// Write a byte of output
+static void encode_byte(encoder e, int b){
+  unsigned char *z = encode_reserve(e, 1);
+  
+  if( z )
+    *z = b;
+}
+
+// Write n bytes of output
+static void encode_bytes(encoder e, const char *z, int n){
+  unsigned char *p = encode_reserve(e, n);
+  
+  if( p )
+    memcpy(p, z, n);
+}
+
+// Remember the offset of an object or array. Sets e->error if it cannot.
+static void encode_push(encoder e, int offset){
+  int *aOpen;
+  int *aItem;
+  
+  if( e->nOpen==e->nOpenAlloc ){
+    aOpen = REALLOC(e->aOpen, (e->nOpenAlloc*2 + 16)*sizeof(int));
+    if( aOpen )
+      e->aOpen = aOpen;
+    aItem = aOpen ? REALLOC(e->aItem, (e->nOpenAlloc*2 + 16)*sizeof(int)) : 0;
+    if( !aItem ){
+      e->error = XML_ERROR_NOMEM;
+      return;
+    }
+    e->aItem = aItem;
+    e->nOpenAlloc = e->nOpenAlloc*2 + 16;
+  }
+  e->aItem[e->nOpen] = 0;
+  e->aOpen[e->nOpen++] = offset;
+}
+
+// Count an item of the object or array it is written to
+static void encode_item(encoder e){
+  if( e->nOpen>0 )
+    e->aItem[e->nOpen-1]++;
+}
+
+// Length of a string with JSON escapes decoded
+static unsigned int encode_text_length(value_part first){
+  value_part part;
+  unsigned int n = 0;
+  
+  for(part=first; part; part=part->next_value_part)
+    n += (part->nVal==2 && part->val[0]=='\\') ? 1 : part->nVal;
+  return n;
+}
+
+// Write a string with JSON escapes decoded
+static void encode_text(encoder e, value_part first){
+  value_part part;
+  
+  for(part=first; part; part=part->next_value_part){
+    if( part->nVal==2 && part->val[0]=='\\' ){
+      switch( part->val[1] ){
+        case 'b': encode_byte(e, '\b'); break;
+        case 't': encode_byte(e, '\t'); break;
+        case 'n': encode_byte(e, '\n'); break;
+        case 'f': encode_byte(e, '\f'); break;
+        case 'r': encode_byte(e, '\r'); break;
+        default:  encode_byte(e, part->val[1]);
+      }
+    }else{
+      encode_bytes(e, part->val, part->nVal);
+    }
+  }
+}
+
+// Value of a number of n bytes of the kind given. Returns 1 and sets *piVal
+// if it is an integer that fits in 64 bits, otherwise sets *prVal. -0 is a
+// double, so that its sign is kept as it is in JSON.
+static int encode_number(char *z, int n, int kind, long long *piVal, double *prVal){
+  unsigned long long u = 0;
+  char zBuf[32];
+  char *zNum = zBuf;
+  int is_neg = z[0]=='-';
+  int i;
+  
+  // Up to 19 digits can not overflow
+  if( kind==VALUE_INTEGER && n-is_neg<=19 ){
+    for(i=is_neg; i<n; i++)
+      u = u*10 + (z[i]-'0');
+    if( u <= 0x7FFFFFFFFFFFFFFFULL + is_neg && (u || !is_neg) ){
+      *piVal = is_neg ? (long long)(0-u) : (long long)u;
+      return 1;
+    }
+  }
+  
+  if( n>=(int)sizeof(zBuf) )
+    zNum = MALLOC(n+1);
+  if( !zNum ){
+    *prVal = 0;
+    return 0;
+  }
+  memcpy(zNum, z, n);
+  zNum[n] = 0;
+  *prVal = strtod(zNum, 0);
+  if( zNum!=zBuf )
+    FREE(zNum);
+  return 0;
+}
+
+// Write a 64-bit value big-endian
+static void encode_be64(unsigned char *z, unsigned long long u){
+  int i;
+  
+  for(i=7; i>=0; i--, u>>=8)
+    z[i] = u;
+}
+
+// Value of an element or attribute, as a string, number or boolean
+static void encode_value(encoder e, value_part first, int value_type){
+  int kind = xml_value_kind(first, value_type, e->options->typed);
+  
+  if( kind==VALUE_STRING )
+    e->xString(e, first);
+  else if( kind==VALUE_TRUE || kind==VALUE_FALSE )
+    e->xBoolean(e, kind==VALUE_TRUE);
+  else
+    e->xNumber(e, first->val, first->nVal, kind);
+}
+
+// Key of an element or attribute
+static void encode_key(encoder e, char *zPrefix, int nPrefix, char *z, int n){
+  struct value_part key[2];
+  
+  key[0].val = zPrefix;
+  key[0].nVal = nPrefix;
+  key[0].next_value_part = &key[1];
+  key[1].val = z;
+  key[1].nVal = n;
+  key[1].next_value_part = 0;
+  e->xString(e, nPrefix ? &key[0] : &key[1]);
+}
+
+//
+// tree_encode
+//
+// Walk the elements in the same way as json_output(), calling the encoder.
+//
+static void tree_encode(element root, encoder e){
+  element node;
+  element next;
+  element parent_node;
+  element_attribute attr;
+  value current_value;
+  
+  if( !root->next )
+    return;
+  
+  e->xObject(e);
+  for(node=root->next; node; node=next){
+    next = node->next;
+    if( e->error || xml_interrupted(e->options->interrupt) )
+      return;
+    
+    // Node name, unless it continues an array
+    if( node->array_index<=1 )
+      encode_key(e, 0, 0, node->symbol->name, node->symbol->nName);
+    if( node->array_index==1 )
+      e->xArray(e);
+    
+    // null or a single value
+    if( !node->first_attr && !node->is_parent
+        && (!node->first_value || !node->first_value->next_value) ){
+      if( node->first_value )
+        encode_value(e, node->first_value->first_value_part, node->value_type);
+      else
+        e->xNull(e);
+      
+    // Object of attributes, #text and children
+    }else{
+      e->xObject(e);
+      for(attr=node->first_attr; attr; attr=attr->next_attr){
+        encode_key(e, e->options->attr_prefix, e->options->nAttrPrefix, attr->symbol->name, attr->symbol->nName);
+        encode_value(e, attr->first_value_part, attr->value_type);
+      }
+      
+      if( node->first_value ){
+        encode_key(e, 0, 0, e->options->text_key, e->options->nTextKey);
+        if( node->first_value->next_value )
+          e->xArray(e);
+        for(current_value=node->first_value; current_value; current_value=current_value->next_value)
+          encode_value(e, current_value->first_value_part, node->value_type);
+        if( node->first_value->next_value )
+          e->xEnd(e);
+      }
+      
+      // Children are closed by the last of them
+      if( node->is_parent )
+        continue;
+      e->xEnd(e);
+    }
+    
+    // Trailing arrays and objects
+    parent_node = node;
+    while( parent_node != root && (!next || parent_node != next->parent) ){
+      if( parent_node->is_array_end )
+        e->xEnd(e);
+      if( parent_node->is_last_child )
+        e->xEnd(e);
+      parent_node = parent_node->parent;
+    }
+  }
+}
+
+// Callbacks of the counting walk of encode_count()
+static void count_open(encoder e){
+  unsigned int *aCount;
+  long long nAlloc;
+  
+  encode_item(e);
+  if( e->error )
+    return;
+  if( e->nCount==e->nCountAlloc ){
+    nAlloc = 2*(long long)e->nCountAlloc + 16;
+    if( nAlloc*sizeof(unsigned int)>0x7FFFFFFF ){
+      e->error = XML_ERROR_TOOBIG;
+      return;
+    }
+    aCount = REALLOC(e->aCount, nAlloc*sizeof(unsigned int));
+    if( !aCount ){
+      e->error = XML_ERROR_NOMEM;
+      return;
+    }
+    e->aCount = aCount;
+    e->nCountAlloc = nAlloc;
+  }
+  e->aCount[e->nCount] = 0;
+  encode_push(e, e->nCount++);
+}
+
+static void count_end(encoder e){
+  if( e->error )
+    return;
+  e->nOpen--;
+  e->aCount[e->aOpen[e->nOpen]] = e->aItem[e->nOpen];
+}
+
+static void count_string(encoder e, value_part first){
+  (void)first;
+  encode_item(e);
+}
+
+static void count_number(encoder e, char *z, int n, int kind){
+  (void)z;
+  (void)n;
+  (void)kind;
+  encode_item(e);
+}
+
+static void count_boolean(encoder e, int b){
+  (void)b;
+  encode_item(e);
+}
+
+//
+// encode_count
+//
+// Walk the elements without any output, setting e->aCount to the number of
+// items in each object and array, in the order they are opened, so that
+// formats whose headers give the count can write each header once. A key
+// and its value are two items. Returns 0, and sets e->error, if memory
+// runs out.
+//
+static int encode_count(element root, encoder e){
+  struct encoder c;
+  
+  memset(&c, 0, sizeof(c));
+  c.xObject = count_open;
+  c.xArray = count_open;
+  c.xEnd = count_end;
+  c.xString = count_string;
+  c.xNumber = count_number;
+  c.xBoolean = count_boolean;
+  c.xNull = encode_item;
+  c.options = e->options;
+  tree_encode(root, &c);
+  
+  FREE(c.aOpen);
+  FREE(c.aItem);
+  e->aCount = c.aCount;
+  e->nCount = c.nCount;
+  e->iCount = 0;
+  e->error = c.error;
+  return !c.error;
+}
+
+//
+// JSONB
+//
+// The binary JSON format used by SQLite 3.45 and later. Each value has a
+// header giving its type in the low 4 bits and the size of its payload.
+// Objects and arrays use a 4 byte size, which is filled in at their end.
+//
+#define JSONB_NULL 0
+#define JSONB_TRUE 1
+#define JSONB_FALSE 2
+#define JSONB_INT 3                     // Integer, as JSON text
+#define JSONB_FLOAT 5                   // Real number, as JSON text
+#define JSONB_TEXT 7                    // Text without escapes
+#define JSONB_TEXTJ 8                   // Text with JSON escapes
+#define JSONB_ARRAY 11
+#define JSONB_OBJECT 12
+
+static void jsonb_header(encoder e, int type, unsigned int n){
+  unsigned char *z;
+  
+  if( n<=11 ){
+    z = encode_reserve(e, 1);
+    if( !z )
+      return;
+    z[0] = n<<4 | type;
+  }else if( n<=0xFF ){
+    z = encode_reserve(e, 2);
+    if( !z )
+      return;
+    z[0] = 0xC0 | type;
+    z[1] = n;
+  }else if( n<=0xFFFF ){
+    z = encode_reserve(e, 3);
+    if( !z )
+      return;
+    z[0] = 0xD0 | type;
+    z[1] = n>>8;
+    z[2] = n;
+  }else{
+    z = encode_reserve(e, 5);
+    if( !z )
+      return;
+    z[0] = 0xE0 | type;
+    z[1] = n>>24;
+    z[2] = n>>16;
+    z[3] = n>>8;
+    z[4] = n;
+  }
+}
+
+static void jsonb_container(encoder e, int type){
+  encode_push(e, e->n);
+  jsonb_header(e, type, 0x10000);
+}
+
+static void jsonb_object(encoder e){
+  jsonb_container(e, JSONB_OBJECT);
+}
+
+static void jsonb_array(encoder e){
+  jsonb_container(e, JSONB_ARRAY);
+}
+
+static void jsonb_end(encoder e){
+  int offset;
+  unsigned int n;
+  
+  if( e->error )
+    return;
+  offset = e->aOpen[--e->nOpen];
+  n = e->n - offset - 5;
+  e->z[offset+1] = n>>24;
+  e->z[offset+2] = n>>16;
+  e->z[offset+3] = n>>8;
+  e->z[offset+4] = n;
+}
+
+static void jsonb_string(encoder e, value_part first){
+  value_part part;
+  int type = JSONB_TEXT;
+  int n = 0;
+  
+  for(part=first; part; part=part->next_value_part){
+    n += part->nVal;
+    if( part->nVal==2 && part->val[0]=='\\' )
+      type = JSONB_TEXTJ;
+  }
+  
+  jsonb_header(e, type, n);
+  for(part=first; part; part=part->next_value_part)
+    encode_bytes(e, part->val, part->nVal);
+}
+
+// Numbers are kept as their text, which is already in JSON form
+static void jsonb_number(encoder e, char *z, int n, int kind){
+  jsonb_header(e, kind==VALUE_INTEGER ? JSONB_INT : JSONB_FLOAT, n);
+  encode_bytes(e, z, n);
+}
+
+static void jsonb_boolean(encoder e, int b){
+  jsonb_header(e, b ? JSONB_TRUE : JSONB_FALSE, 0);
+}
+
+static void jsonb_null(encoder e){
+  jsonb_header(e, JSONB_NULL, 0);
+}
+
+//
+// xml_encode_tree
+//
+// Encode the grouped elements of root with the encoder given, whose
+// callbacks and options are set. Sets *pnByte to the size of the result,
+// which must be freed. Returns null for an empty document, or if the
+// options' interrupt hook stops it, or the output cannot grow, in which
+// case the options' error is set.
+//
+static unsigned char *xml_encode_tree(element root, encoder e, int *pnByte){
+  if( !e->counted || encode_count(root, e) )
+    tree_encode(root, e);
+  
+  FREE(e->aOpen);
+  FREE(e->aItem);
+  FREE(e->aCount);
+  if( e->error )
+    e->options->error = e->error;
+  if( e->error || xml_interrupted(e->options->interrupt) ){
+    FREE(e->z);
+    *pnByte = 0;
+    return 0;
+  }
+  *pnByte = e->n;
+  return e->z;
+}
+
+//
+// xml_encode
+//
+// Convert XML string with the encoder given, whose callbacks and options
+// are set. Sets *pnByte to the size of the result, which must be freed.
+// Returns null for an empty document or one that is not XML, or if the
+// options' interrupt hook stops it, or memory runs out, in which case the
+// options' error is set.
+//
+static unsigned char *xml_encode(char *xml, encoder e, int *pnByte){
+  xml_interrupt it = e->options->interrupt;
+  struct arena a = {0, 0, it, {0, 0, 0, 0}, 0};
+  element root;
+  unsigned char *z;
+  
+  root = xml_parse(xml, -1, 0, &a);
+  if( !root ){
+    if( a.nomem )
+      e->options->error = XML_ERROR_NOMEM;
+    arena_free(&a);
+    *pnByte = 0;
+    return 0;
+  }
+  if( !e->options->schema )
+    xml_group(root, 0, it);
+  else if( !xml_group_schema(root, e->options->schema, it) ){
+    e->options->error = XML_ERROR_NOMEM;
+    arena_free(&a);
+    *pnByte = 0;
+    return 0;
+  }
+  z = xml_encode_tree(root, e, pnByte);
+  
+  arena_free(&a);
+  return z;
+}
+
+// Start an encoder of JSONB with the options given
+static void jsonb_init(encoder e, xml_options opt){
+  memset(e, 0, sizeof(struct encoder));
+  e->xObject = jsonb_object;
+  e->xArray = jsonb_array;
+  e->xEnd = jsonb_end;
+  e->xString = jsonb_string;
+  e->xNumber = jsonb_number;
+  e->xBoolean = jsonb_boolean;
+  e->xNull = jsonb_null;
+  e->options = opt;
+}
+
+//
+// xml_convert_jsonb
+//
+// Convert XML string to SQLite's JSONB format with the options given. Sets
+// *pnByte to the size of the result, which must be freed. Returns null for
+// an empty document, or if opt->interrupt stops it.
+//
+static unsigned char *xml_convert_jsonb(char *xml, xml_options opt, int *pnByte){
+  struct encoder e;
+  
+  jsonb_init(&e, opt);
+  return xml_encode(xml, &e, pnByte);
+}
+
+#ifndef SQLITE
+//
+// xml_to_jsonb
+//
+// Convert XML string to SQLite's JSONB format. Sets *pnByte to the size of
+// the result, which must be freed. Returns null for an empty document.
+//
+unsigned char *xml_to_jsonb(char *xml, int *pnByte){
+  struct xml_options opt;
+  
+  xml_options_init(&opt, -1);
+  return xml_convert_jsonb(xml, &opt, pnByte);
+}
+#endif
+
+//
+// CBOR
+//
+// Concise Binary Object Representation (RFC 8949), with definite length
+// maps, arrays and text strings. Each item starts with a header of its
+// major type in the top 3 bits, and its length or count in the low 5 bits
+// if under 24, or in the 1, 2 or 4 bytes that follow.
+//
+// The number of entries in each map and array is counted by encode_count()
+// before any output, so its header is written once, in the fewest bytes.
+//
+#define CBOR_UINT 0
+#define CBOR_NINT 1                     // Negative integer, -1-n
+#define CBOR_ARRAY 4
+#define CBOR_MAP 5
+#define CBOR_TEXT 3
+#define CBOR_FALSE 0xF4
+#define CBOR_TRUE 0xF5
+#define CBOR_NULL 0xF6
+#define CBOR_FLOAT16 0xF9
+#define CBOR_FLOAT64 0xFB
+
+// Size of the header of a count or length of n
+static int cbor_header_size(unsigned int n){
+  return n<24 ? 1 : n<=0xFF ? 2 : n<=0xFFFF ? 3 : 5;
+}
+
+static void cbor_header_write(unsigned char *z, int type, unsigned int n){
+  switch( cbor_header_size(n) ){
+    case 1:
+      z[0] = type<<5 | n;
+      break;
+    case 2:
+      z[0] = type<<5 | 24;
+      z[1] = n;
+      break;
+    case 3:
+      z[0] = type<<5 | 25;
+      z[1] = n>>8;
+      z[2] = n;
+      break;
+    default:
+      z[0] = type<<5 | 26;
+      z[1] = n>>24;
+      z[2] = n>>16;
+      z[3] = n>>8;
+      z[4] = n;
+  }
+}
+
+static void cbor_container(encoder e, int type){
+  unsigned int n = e->aCount[e->iCount++];
+  unsigned char *z;
+  
+  // Maps count pairs of items
+  if( type==CBOR_MAP )
+    n /= 2;
+  z = encode_reserve(e, cbor_header_size(n));
+  if( z )
+    cbor_header_write(z, type, n);
+}
+
+static void cbor_map(encoder e){
+  cbor_container(e, CBOR_MAP);
+}
+
+static void cbor_array(encoder e){
+  cbor_container(e, CBOR_ARRAY);
+}
+
+// Nothing is written at the end of a map or array, as its header has the count
+static void cbor_end(encoder e){
+  (void)e;
+}
+
+// Text string, with JSON escapes in value parts decoded
+static void cbor_string(encoder e, value_part first){
+  unsigned int n = encode_text_length(first);
+  unsigned char *z;
+  
+  z = encode_reserve(e, cbor_header_size(n));
+  if( !z )
+    return;
+  cbor_header_write(z, CBOR_TEXT, n);
+  encode_text(e, first);
+}
+
+// Integers that fit in 64 bits, otherwise a double, or a half precision -0
+static void cbor_number(encoder e, char *z, int n, int kind){
+  long long iVal;
+  double rVal;
+  unsigned long long u;
+  unsigned char *p;
+  int type;
+  
+  if( encode_number(z, n, kind, &iVal, &rVal) ){
+    type = iVal<0 ? CBOR_NINT : CBOR_UINT;
+    u = iVal<0 ? (unsigned long long)(-1-iVal) : (unsigned long long)iVal;
+    if( u<=0xFFFFFFFF ){
+      p = encode_reserve(e, cbor_header_size(u));
+      if( p )
+        cbor_header_write(p, type, u);
+    }else{
+      p = encode_reserve(e, 9);
+      if( !p )
+        return;
+      p[0] = type<<5 | 27;
+      encode_be64(&p[1], u);
+    }
+  }else{
+    memcpy(&u, &rVal, 8);
+    if( u==0x8000000000000000ULL ){
+      p = encode_reserve(e, 3);
+      if( !p )
+        return;
+      p[0] = CBOR_FLOAT16;
+      p[1] = 0x80;
+      p[2] = 0;
+      return;
+    }
+    p = encode_reserve(e, 9);
+    if( !p )
+      return;
+    p[0] = CBOR_FLOAT64;
+    encode_be64(&p[1], u);
+  }
+}
+
+static void cbor_boolean(encoder e, int b){
+  encode_byte(e, b ? CBOR_TRUE : CBOR_FALSE);
+}
+
+static void cbor_null(encoder e){
+  encode_byte(e, CBOR_NULL);
+}
+
+// Start an encoder of CBOR with the options given
+static void cbor_init(encoder e, xml_options opt){
+  memset(e, 0, sizeof(struct encoder));
+  e->xObject = cbor_map;
+  e->xArray = cbor_array;
+  e->xEnd = cbor_end;
+  e->xString = cbor_string;
+  e->xNumber = cbor_number;
+  e->xBoolean = cbor_boolean;
+  e->xNull = cbor_null;
+  e->options = opt;
+  e->counted = 1;
+}
+
+//
+// xml_convert_cbor
+//
+// Convert XML string to CBOR with the options given. Sets *pnByte to the
+// size of the result, which must be freed. Returns null for an empty
+// document, or if opt->interrupt stops it.
+//
+static unsigned char *xml_convert_cbor(char *xml, xml_options opt, int *pnByte){
+  struct encoder e;
+  
+  cbor_init(&e, opt);
+  return xml_encode(xml, &e, pnByte);
+}
+
+#ifndef SQLITE
+//
+// xml_to_cbor
+//
+// Convert XML string to CBOR, with the same keys as xml_to_json(). Sets
+// *pnByte to the size of the result, which must be freed. Returns null for
+// an empty document.
+//
+unsigned char *xml_to_cbor(char *xml, int *pnByte){
+  struct xml_options opt;
+  
+  xml_options_init(&opt, -1);
+  return xml_convert_cbor(xml, &opt, pnByte);
+}
+#endif
+
+//
+// MessagePack
+//
+// Maps, arrays and strings are written with the smallest header that holds
+// their count or length: a single byte for maps and arrays of under 16
+// items and strings of under 32 bytes, otherwise a type byte followed by a
+// 1, 2 or 4 byte big-endian length. The number of entries in maps and
+// arrays is counted by encode_count(), as for CBOR.
+//
+#define MSGPACK_FIXMAP 0x80
+#define MSGPACK_FIXARRAY 0x90
+#define MSGPACK_FIXSTR 0xA0
+#define MSGPACK_NIL 0xC0
+#define MSGPACK_FALSE 0xC2
+#define MSGPACK_TRUE 0xC3
+#define MSGPACK_FLOAT64 0xCB
+#define MSGPACK_UINT8 0xCC              // Followed by UINT16, 32 and 64
+#define MSGPACK_INT8 0xD0               // Followed by INT16, 32 and 64
+#define MSGPACK_STR8 0xD9
+#define MSGPACK_STR16 0xDA
+#define MSGPACK_STR32 0xDB
+#define MSGPACK_ARRAY16 0xDC
+#define MSGPACK_ARRAY32 0xDD
+#define MSGPACK_MAP16 0xDE
+#define MSGPACK_MAP32 0xDF
+
+// Write the 2 or 4 byte big-endian length after a type byte
+static void msgpack_length_write(unsigned char *z, int nLength, unsigned int n){
+  if( nLength==2 ){
+    z[0] = n>>8;
+    z[1] = n;
+  }else{
+    z[0] = n>>24;
+    z[1] = n>>16;
+    z[2] = n>>8;
+    z[3] = n;
+  }
+}
+
+static void msgpack_container(encoder e, int is_map){
+  unsigned int n = e->aCount[e->iCount++];
+  unsigned char *z;
+  
+  // Maps count pairs of items
+  if( is_map )
+    n /= 2;
+  if( n<16 ){
+    encode_byte(e, (is_map ? MSGPACK_FIXMAP : MSGPACK_FIXARRAY) | n);
+  }else if( n<=0xFFFF ){
+    z = encode_reserve(e, 3);
+    if( !z )
+      return;
+    z[0] = is_map ? MSGPACK_MAP16 : MSGPACK_ARRAY16;
+    msgpack_length_write(&z[1], 2, n);
+  }else{
+    z = encode_reserve(e, 5);
+    if( !z )
+      return;
+    z[0] = is_map ? MSGPACK_MAP32 : MSGPACK_ARRAY32;
+    msgpack_length_write(&z[1], 4, n);
+  }
+}
+
+static void msgpack_map(encoder e){
+  msgpack_container(e, 1);
+}
+
+static void msgpack_array(encoder e){
+  msgpack_container(e, 0);
+}
+
+// Nothing is written at the end of a map or array, as its header has the count
+static void msgpack_end(encoder e){
+  (void)e;
+}
+
+// String, with JSON escapes in value parts decoded
+static void msgpack_string(encoder e, value_part first){
+  unsigned int n = encode_text_length(first);
+  unsigned char *z;
+  
+  if( n<32 ){
+    encode_byte(e, MSGPACK_FIXSTR | n);
+  }else if( n<=0xFF ){
+    z = encode_reserve(e, 2);
+    if( !z )
+      return;
+    z[0] = MSGPACK_STR8;
+    z[1] = n;
+  }else if( n<=0xFFFF ){
+    z = encode_reserve(e, 3);
+    if( !z )
+      return;
+    z[0] = MSGPACK_STR16;
+    msgpack_length_write(&z[1], 2, n);
+  }else{
+    z = encode_reserve(e, 5);
+    if( !z )
+      return;
+    z[0] = MSGPACK_STR32;
+    msgpack_length_write(&z[1], 4, n);
+  }
+  encode_text(e, first);
+}
+
+// Integers in the fewest bytes that hold them, otherwise a double
+static void msgpack_number(encoder e, char *z, int n, int kind){
+  long long iVal;
+  double rVal;
+  unsigned long long u;
+  unsigned char *p;
+  int nByte;
+  
+  if( !encode_number(z, n, kind, &iVal, &rVal) ){
+    memcpy(&u, &rVal, 8);
+    p = encode_reserve(e, 9);
+    if( !p )
+      return;
+    p[0] = MSGPACK_FLOAT64;
+    encode_be64(&p[1], u);
+    return;
+  }
+  
+  // Positive and negative fixint
+  if( iVal>=-32 && iVal<128 ){
+    encode_byte(e, (unsigned char)iVal);
+    return;
+  }
+  if( iVal>=0 )
+    nByte = iVal<=0xFF ? 1 : iVal<=0xFFFF ? 2 : iVal<=0xFFFFFFFFLL ? 4 : 8;
+  else
+    nByte = iVal>=-0x80 ? 1 : iVal>=-0x8000 ? 2 : iVal>=-0x80000000LL ? 4 : 8;
+  p = encode_reserve(e, 1+nByte);
+  if( !p )
+    return;
+  p[0] = (iVal>=0 ? MSGPACK_UINT8 : MSGPACK_INT8) + (nByte==1 ? 0 : nByte==2 ? 1 : nByte==4 ? 2 : 3);
+  u = (unsigned long long)iVal;
+  if( nByte==1 )
+    p[1] = u;
+  else if( nByte==8 )
+    encode_be64(&p[1], u);
+  else
+    msgpack_length_write(&p[1], nByte, u);
+}
+
+static void msgpack_boolean(encoder e, int b){
+  encode_byte(e, b ? MSGPACK_TRUE : MSGPACK_FALSE);
+}
+
+static void msgpack_nil(encoder e){
+  encode_byte(e, MSGPACK_NIL);
+}
+
+// Start an encoder of MessagePack with the options given
+static void msgpack_init(encoder e, xml_options opt){
+  memset(e, 0, sizeof(struct encoder));
+  e->xObject = msgpack_map;
+  e->xArray = msgpack_array;
+  e->xEnd = msgpack_end;
+  e->xString = msgpack_string;
+  e->xNumber = msgpack_number;
+  e->xBoolean = msgpack_boolean;
+  e->xNull = msgpack_nil;
+  e->options = opt;
+  e->counted = 1;
+}
+
+//
+// xml_convert_msgpack
+//
+// Convert XML string to MessagePack with the options given. Sets *pnByte to
+// the size of the result, which must be freed. Returns null for an empty
+// document, or if opt->interrupt stops it.
+//
+static unsigned char *xml_convert_msgpack(char *xml, xml_options opt, int *pnByte){
+  struct encoder e;
+  
+  msgpack_init(&e, opt);
+  return xml_encode(xml, &e, pnByte);
+}
+
+#ifndef SQLITE
+//
+// xml_to_msgpack
+//
+// Convert XML string to MessagePack, with the same keys as xml_to_json().
+// Sets *pnByte to the size of the result, which must be freed. Returns null
+// for an empty document.
+//
+unsigned char *xml_to_msgpack(char *xml, int *pnByte){
+  struct xml_options opt;
+  
+  xml_options_init(&opt, -1);
+  return xml_convert_msgpack(xml, &opt, pnByte);
+}
+#endif
+
+#ifndef SQLITE
+//
+// Parsed documents
+//
+// A document is parsed and grouped once by xml_doc_parse(), then output
+// any number of times, in any format and indent, by xml_doc_emit(). The
+// elements are only read while output, so a document may be emitted by
+// several threads at once.
+//
+#define XML_DOC_JSON 0                  // JSON string
+#define XML_DOC_JSONB 1                 // SQLite's JSONB format
+#define XML_DOC_CBOR 2                  // CBOR
+#define XML_DOC_MSGPACK 3               // MessagePack
+#define XML_DOC_TYPED 0x100             // Flag for typed numbers and booleans, as xml_to_json_typed()
+
+typedef struct xml_doc *xml_doc;
+struct xml_doc{
+  element root;                         // Grouped elements
+  struct arena arena;                   // Arena elements are parsed into
+  void *map;                            // Tree file the elements reference, or null
+  size_t nMap;                          // Size of map
+};
+
+//
+// xml_doc_parse
+//
+// Parse and group an XML string, with arrays given by schema, or found by
+// looking for repeated elements if it is null. The document references
+// xml, which must not be freed or modified until the document is freed.
+// Returns null if xml is not XML, or memory runs out.
+//
+xml_doc xml_doc_parse(char *xml, xml_schema schema){
+  xml_doc doc = MALLOC(sizeof(struct xml_doc));
+  
+  if( !doc )
+    return 0;
+  memset(doc, 0, sizeof(struct xml_doc));
+  doc->root = xml_parse(xml, -1, 0, &doc->arena);
+  if( !doc->root ){
+    arena_free(&doc->arena);
+    FREE(doc);
+    return 0;
+  }
+  if( !schema )
+    xml_group(doc->root, 0, 0);
+  else if( !xml_group_schema(doc->root, schema, 0) ){
+    arena_free(&doc->arena);
+    FREE(doc);
+    return 0;
+  }
+  return doc;
+}
+
+//
+// xml_doc_emit
+//
+// Output a document as XML_DOC_JSON, XML_DOC_JSONB, XML_DOC_CBOR or
+// XML_DOC_MSGPACK, or'd with XML_DOC_TYPED for typed output. The indent is
+// only used for JSON, which is zero terminated. Sets *pnByte to the size
+// of the result, if pnByte is not null. The result must be freed.
+//
+// Returns null for an unknown format, an empty document in the binary
+// formats, or if memory runs out.
+//
+void *xml_doc_emit(xml_doc doc, int format, int indent, int *pnByte){
+  struct xml_options opt;
+  struct encoder e;
+  int n;
+  
+  xml_options_init(&opt, indent);
+  opt.typed = (format & XML_DOC_TYPED)!=0;
+  
+  switch( format & ~XML_DOC_TYPED ){
+    case XML_DOC_JSON:
+      return xml_output(doc->root, &opt, pnByte);
+    case XML_DOC_JSONB:
+      jsonb_init(&e, &opt);
+      break;
+    case XML_DOC_CBOR:
+      cbor_init(&e, &opt);
+      break;
+    case XML_DOC_MSGPACK:
+      msgpack_init(&e, &opt);
+      break;
+    default:
+      if( pnByte )
+        *pnByte = 0;
+      return 0;
+  }
+  return xml_encode_tree(doc->root, &e, pnByte ? pnByte : &n);
+}
+
+//
+// xml_doc_free
+//
+void xml_doc_free(xml_doc doc){
+  if( !doc )
+    return;
+  arena_free(&doc->arena);
+  if( doc->map ){
+#ifdef HAVE_MMAP
+    munmap(doc->map, doc->nMap);
+#else
+    FREE(doc->map);
+#endif
+  }
+  FREE(doc);
+}
+
+//
+// Tree files
+//
+// A parsed document can be saved to a file by xml_doc_save(), and loaded
+// by xml_doc_load() to be emitted again without parsing or grouping. The
+// file is position independent: a header, then tables of symbols,
+// elements, attributes, values and value parts that refer to each other
+// by index, then the text they reference. It is memory mapped when
+// loaded, and text is output straight from the mapping.
+//
+// Elements are in output order, and only their parent, symbol, array
+// index, value type, attributes and values are saved. Sibling indexes and
+// the last child and array end flags are found again from the parents
+// when loaded, so that a file cannot unbalance the output.
+//
+// Files with another version or byte order, or whose checksum does not
+// match, are rejected. The checksum only catches accidental damage, so
+// every count and offset is also checked against the file and against
+// what the arena can allocate before anything is built from it.
+//
+#define XML_TREE_MAGIC "XMLTREE"         // Zero terminated, so 8 bytes
+#define XML_TREE_VERSION 1
+#define XML_TREE_BYTE_ORDER 0x01020304
+
+typedef struct tree_header *tree_header;
+struct tree_header{
+  char zMagic[8];                       // XML_TREE_MAGIC
+  uint32_t version;                     // XML_TREE_VERSION
+  uint32_t byte_order;                  // XML_TREE_BYTE_ORDER, as written by the saving machine
+  uint32_t checksum;                    // Checksum of the file after the header
+  uint32_t nSymbol;                     // Number of symbols
+  uint32_t nElement;                    // Number of elements, including the root
+  uint32_t nAttr;                       // Number of attributes
+  uint32_t nValue;                      // Number of values
+  uint32_t nPart;                       // Number of value parts
+  uint32_t nText;                       // Bytes of text
+};
+
+struct tree_symbol{
+  uint32_t iName, nName;                // Name in the text
+  uint32_t iKey, nKey;                  // Key in the text
+};
+
+struct tree_element{
+  uint32_t iParent;                     // Index of parent plus 1, or 0 for the root
+  uint32_t iSymbol;                     // Index of symbol plus 1, or 0 for the root
+  int32_t value_type;                   // Type of its text
+  int32_t array_index;                  // Index in its array, or 0
+  uint32_t iAttr, nAttr;                // Attributes
+  uint32_t iValue, nValue;              // Values
+};
+
+struct tree_attr{
+  uint32_t iSymbol;                     // Index of symbol
+  int32_t value_type;                   // Type of its value
+  uint32_t iPart, nPart;                // Value parts
+};
+
+struct tree_value{
+  uint32_t iPart, nPart;                // Value parts
+};
+
+struct tree_part{
+  uint32_t iText, nText;                // Part in the text
+};
+
+// Checksum of n bytes, a Fletcher sum of 32-bit words
+static uint32_t tree_checksum(const unsigned char *z, size_t n){
+  uint64_t a = 1;
+  uint64_t b = 0;
+  uint32_t w;
+  size_t i;
+  
+  for(i=0; i+4<=n; i+=4){
+    memcpy(&w, &z[i], 4);
+    a += w;
+    b += a;
+  }
+  for(; i<n; i++){
+    a += z[i];
+    b += a;
+  }
+  return (uint32_t)(a ^ b ^ (b>>32));
+}
+
+static int tree_symbol_compare(const void *p1, const void *p2){
+  uintptr_t a = (uintptr_t)*(xml_symbol*)p1;
+  uintptr_t b = (uintptr_t)*(xml_symbol*)p2;
+  
+  return a<b ? -1 : a>b;
+}
+
+// Index of a symbol in aSymbol, which is sorted by address
+static uint32_t tree_symbol_index(xml_symbol *aSymbol, int nSymbol, xml_symbol symbol){
+  xml_symbol *p = bsearch(&symbol, aSymbol, nSymbol, sizeof(xml_symbol), tree_symbol_compare);
+  
+  return (uint32_t)(p - aSymbol);
+}
+
+// Save the value parts from first, adding their text at *piText
+static void tree_save_parts(struct tree_part *aPart, uint32_t *piPart, char *zText, uint32_t *piText, value_part first){
+  value_part part;
+  
+  for(part=first; part; part=part->next_value_part){
+    aPart[*piPart].iText = *piText;
+    aPart[*piPart].nText = part->nVal;
+    memcpy(&zText[*piText], part->val, part->nVal);
+    *piText += part->nVal;
+    (*piPart)++;
+  }
+}
+
+//
+// xml_doc_save
+//
+// Save a document to a tree file at zPath. Returns 0 if it cannot be
+// written.
+//
+int xml_doc_save(xml_doc doc, const char *zPath){
+  struct tree_header h;
+  struct tree_symbol *aSym;
+  struct tree_element *aElem;
+  struct tree_attr *aAttr;
+  struct tree_value *aValue;
+  struct tree_part *aPart;
+  char *zText;
+  xml_symbol *aSymbol;
+  xml_symbol symbol;
+  element *aStack;
+  uint32_t *aStackIndex;
+  int nStack = 0;
+  int nStackAlloc = 0;
+  element node;
+  element_attribute attr;
+  value current_value;
+  value_part part;
+  unsigned char *z;
+  size_t nByte;
+  uint64_t nText = 0;
+  uint32_t iText, iAttr, iValue, iPart;
+  uint32_t i, k;
+  FILE *f;
+  int rc;
+  
+  memset(&h, 0, sizeof(h));
+  memcpy(h.zMagic, XML_TREE_MAGIC, 8);
+  h.version = XML_TREE_VERSION;
+  h.byte_order = XML_TREE_BYTE_ORDER;
+  
+  // Count the elements, attributes, values and text
+  for(node=doc->root; node; node=node->next){
+    h.nElement++;
+    for(attr=node->first_attr; attr; attr=attr->next_attr){
+      h.nAttr++;
+      for(part=attr->first_value_part; part; part=part->next_value_part){
+        h.nPart++;
+        nText += part->nVal;
+      }
+    }
+    for(current_value=node->first_value; current_value; current_value=current_value->next_value){
+      h.nValue++;
+      for(part=current_value->first_value_part; part; part=part->next_value_part){
+        h.nPart++;
+        nText += part->nVal;
+      }
+    }
+  }
+  
+  // Symbols used, sorted to be found by address
+  aSymbol = MALLOC(((size_t)h.nElement+h.nAttr)*sizeof(xml_symbol));
+  k = 0;
+  for(node=doc->root->next; node; node=node->next){
+    aSymbol[k++] = node->symbol;
+    for(attr=node->first_attr; attr; attr=attr->next_attr)
+      aSymbol[k++] = attr->symbol;
+  }
+  qsort(aSymbol, k, sizeof(xml_symbol), tree_symbol_compare);
+  for(i=0; i<k; i++){
+    if( i==0 || aSymbol[i]!=aSymbol[i-1] ){
+      symbol = aSymbol[i];
+      aSymbol[h.nSymbol++] = symbol;
+      nText += symbol->nName + symbol->nKey;
+    }
+  }
+  
+  if( nText>0xFFFFFFFF ){
+    FREE(aSymbol);
+    return 0;
+  }
+  h.nText = (uint32_t)nText;
+  
+  nByte = sizeof(h) + h.nSymbol*sizeof(struct tree_symbol)
+        + (size_t)h.nElement*sizeof(struct tree_element)
+        + (size_t)h.nAttr*sizeof(struct tree_attr)
+        + (size_t)h.nValue*sizeof(struct tree_value)
+        + (size_t)h.nPart*sizeof(struct tree_part) + h.nText;
+  z = MALLOC(nByte);
+  if( !z ){
+    FREE(aSymbol);
+    return 0;
+  }
+  aSym = (struct tree_symbol *)&z[sizeof(h)];
+  aElem = (struct tree_element *)&aSym[h.nSymbol];
+  aAttr = (struct tree_attr *)&aElem[h.nElement];
+  aValue = (struct tree_value *)&aAttr[h.nAttr];
+  aPart = (struct tree_part *)&aValue[h.nValue];
+  zText = (char *)&aPart[h.nPart];
+  
+  iText = 0;
+  for(i=0; i<h.nSymbol; i++){
+    aSym[i].iName = iText;
+    aSym[i].nName = aSymbol[i]->nName;
+    memcpy(&zText[iText], aSymbol[i]->name, aSymbol[i]->nName);
+    iText += aSymbol[i]->nName;
+    aSym[i].iKey = iText;
+    aSym[i].nKey = aSymbol[i]->nKey;
+    memcpy(&zText[iText], aSymbol[i]->key, aSymbol[i]->nKey);
+    iText += aSymbol[i]->nKey;
+  }
+  
+  // Elements in output order. Each parent is found among the ancestors of
+  // the element before.
+  aStack = 0;
+  aStackIndex = 0;
+  iAttr = iValue = iPart = 0;
+  for(node=doc->root, i=0; node; node=node->next, i++){
+    while( nStack>0 && aStack[nStack-1]!=node->parent )
+      nStack--;
+    aElem[i].iParent = nStack>0 ? aStackIndex[nStack-1]+1 : 0;
+    aElem[i].iSymbol = node->symbol ? tree_symbol_index(aSymbol, h.nSymbol, node->symbol)+1 : 0;
+    aElem[i].value_type = node->value_type;
+    aElem[i].array_index = node->array_index;
+    
+    aElem[i].iAttr = iAttr;
+    for(attr=node->first_attr; attr; attr=attr->next_attr){
+      aAttr[iAttr].iSymbol = tree_symbol_index(aSymbol, h.nSymbol, attr->symbol);
+      aAttr[iAttr].value_type = attr->value_type;
+      aAttr[iAttr].iPart = iPart;
+      tree_save_parts(aPart, &iPart, zText, &iText, attr->first_value_part);
+      aAttr[iAttr].nPart = iPart - aAttr[iAttr].iPart;
+      iAttr++;
+    }
+    aElem[i].nAttr = iAttr - aElem[i].iAttr;
+    
+    aElem[i].iValue = iValue;
+    for(current_value=node->first_value; current_value; current_value=current_value->next_value){
+      aValue[iValue].iPart = iPart;
+      tree_save_parts(aPart, &iPart, zText, &iText, current_value->first_value_part);
+      aValue[iValue].nPart = iPart - aValue[iValue].iPart;
+      iValue++;
+    }
+    aElem[i].nValue = iValue - aElem[i].iValue;
+    
+    if( nStack==nStackAlloc ){
+      nStackAlloc = nStackAlloc*2 + 64;
+      aStack = REALLOC(aStack, nStackAlloc*sizeof(element));
+      aStackIndex = REALLOC(aStackIndex, nStackAlloc*sizeof(uint32_t));
+    }
+    aStack[nStack] = node;
+    aStackIndex[nStack++] = i;
+  }
+  FREE(aStack);
+  FREE(aStackIndex);
+  FREE(aSymbol);
+  
+  h.checksum = tree_checksum(&z[sizeof(h)], nByte-sizeof(h));
+  memcpy(z, &h, sizeof(h));
+  
+  f = fopen(zPath, "wb");
+  rc = f && fwrite(z, 1, nByte, f)==nByte;
+  if( f && fclose(f)!=0 )
+    rc = 0;
+  FREE(z);
+  return rc;
+}
+
+// Link n parts from aPart[iPart] in order, returning the first or null
+static value_part tree_load_parts(value_part aPart, uint32_t iPart, uint32_t n){
+  uint32_t k;
+  
+  if( !n )
+    return 0;
+  for(k=0; k+1<n; k++)
+    aPart[iPart+k].next_value_part = &aPart[iPart+k+1];
+  aPart[iPart+n-1].next_value_part = 0;
+  return &aPart[iPart];
+}
+
+// Mark an element, once none of its siblings can follow it
+static void tree_load_close(element node){
+  node->is_last_child = 1;
+  if( node->array_index )
+    node->is_array_end = 1;
+}
+
+//
+// tree_load
+//
+// Build the elements of a document from the tree file mapped at z, n
+// bytes long. Returns 0 if the file is not a valid tree file.
+//
+static int tree_load(xml_doc doc, const unsigned char *z, size_t n){
+  struct tree_header h;
+  const struct tree_symbol *aSym;
+  const struct tree_element *aElem;
+  const struct tree_attr *aAttr;
+  const struct tree_value *aValue;
+  const struct tree_part *aPart;
+  const char *zText;
+  xml_symbol aSymbol;
+  element aElement;
+  element_attribute aAttribute;
+  value aVal;
+  value_part aValuePart;
+  element node;
+  element parent;
+  element prev;
+  element c;
+  uint32_t i, k;
+  
+  if( n<sizeof(h) )
+    return 0;
+  memcpy(&h, z, sizeof(h));
+  if( memcmp(h.zMagic, XML_TREE_MAGIC, 8)!=0 || h.version!=XML_TREE_VERSION
+      || h.byte_order!=XML_TREE_BYTE_ORDER || h.nElement<1 )
+    return 0;
+  if( n != sizeof(h) + (uint64_t)h.nSymbol*sizeof(struct tree_symbol)
+           + (uint64_t)h.nElement*sizeof(struct tree_element)
+           + (uint64_t)h.nAttr*sizeof(struct tree_attr)
+           + (uint64_t)h.nValue*sizeof(struct tree_value)
+           + (uint64_t)h.nPart*sizeof(struct tree_part) + h.nText )
+    return 0;
+  if( tree_checksum(&z[sizeof(h)], n-sizeof(h))!=h.checksum )
+    return 0;
+  
+  // The arena allocates sizes that fit in an int once rounded up to 8
+  // bytes. The structures in memory are larger than their records, so a
+  // file under the limit can still need more.
+  if( (uint64_t)h.nSymbol*sizeof(struct xml_symbol)>0x7FFFFFF0
+      || (uint64_t)h.nElement*sizeof(struct element)>0x7FFFFFF0
+      || (uint64_t)h.nAttr*sizeof(struct element_attribute)>0x7FFFFFF0
+      || (uint64_t)h.nValue*sizeof(struct value)>0x7FFFFFF0
+      || (uint64_t)h.nPart*sizeof(struct value_part)>0x7FFFFFF0 )
+    return 0;
+  
+  aSym = (const struct tree_symbol *)&z[sizeof(h)];
+  aElem = (const struct tree_element *)&aSym[h.nSymbol];
+  aAttr = (const struct tree_attr *)&aElem[h.nElement];
+  aValue = (const struct tree_value *)&aAttr[h.nAttr];
+  aPart = (const struct tree_part *)&aValue[h.nValue];
+  zText = (const char *)&aPart[h.nPart];
+  
+  aSymbol = arena_alloc(&doc->arena, h.nSymbol*sizeof(struct xml_symbol));
+  aElement = arena_alloc(&doc->arena, h.nElement*sizeof(struct element));
+  aAttribute = arena_alloc(&doc->arena, h.nAttr*sizeof(struct element_attribute));
+  aVal = arena_alloc(&doc->arena, h.nValue*sizeof(struct value));
+  aValuePart = arena_alloc(&doc->arena, h.nPart*sizeof(struct value_part));
+  if( doc->arena.nomem )
+    return 0;
+  
+  for(i=0; i<h.nSymbol; i++){
+    if( (uint64_t)aSym[i].iName+aSym[i].nName>h.nText || (uint64_t)aSym[i].iKey+aSym[i].nKey>h.nText
+        || aSym[i].nKey<3 )
+      return 0;
+    memset(&aSymbol[i], 0, sizeof(struct xml_symbol));
+    aSymbol[i].name = (char *)&zText[aSym[i].iName];
+    aSymbol[i].nName = aSym[i].nName;
+    aSymbol[i].key = (char *)&zText[aSym[i].iKey];
+    aSymbol[i].nKey = aSym[i].nKey;
+  }
+  
+  for(i=0; i<h.nPart; i++){
+    if( (uint64_t)aPart[i].iText+aPart[i].nText>h.nText )
+      return 0;
+    aValuePart[i].val = (char *)&zText[aPart[i].iText];
+    aValuePart[i].nVal = aPart[i].nText;
+  }
+  
+  for(i=0; i<h.nValue; i++){
+    if( (uint64_t)aValue[i].iPart+aValue[i].nPart>h.nPart )
+      return 0;
+    aVal[i].first_value_part = tree_load_parts(aValuePart, aValue[i].iPart, aValue[i].nPart);
+  }
+  
+  for(i=0; i<h.nAttr; i++){
+    if( aAttr[i].iSymbol>=h.nSymbol || (uint64_t)aAttr[i].iPart+aAttr[i].nPart>h.nPart
+        || aAttr[i].value_type<XML_VALUE_AUTO || aAttr[i].value_type>XML_VALUE_BOOLEAN )
+      return 0;
+    aAttribute[i].symbol = &aSymbol[aAttr[i].iSymbol];
+    aAttribute[i].value_type = aAttr[i].value_type;
+    aAttribute[i].first_value_part = tree_load_parts(aValuePart, aAttr[i].iPart, aAttr[i].nPart);
+  }
+  
+  for(i=0; i<h.nElement; i++){
+    node = &aElement[i];
+    memset(node, 0, sizeof(struct element));
+    if( (uint64_t)aElem[i].iAttr+aElem[i].nAttr>h.nAttr
+        || (uint64_t)aElem[i].iValue+aElem[i].nValue>h.nValue )
+      return 0;
+    if( aElem[i].value_type<XML_VALUE_AUTO || aElem[i].value_type>XML_VALUE_BOOLEAN )
+      return 0;
+    node->value_type = aElem[i].value_type;
+    node->array_index = aElem[i].array_index;
+    
+    // Attributes and values, linked in order
+    if( aElem[i].nAttr ){
+      node->first_attr = &aAttribute[aElem[i].iAttr];
+      for(k=0; k+1<aElem[i].nAttr; k++)
+        node->first_attr[k].next_attr = &node->first_attr[k+1];
+      node->first_attr[k].next_attr = 0;
+    }
+    if( aElem[i].nValue ){
+      node->first_value = &aVal[aElem[i].iValue];
+      for(k=0; k+1<aElem[i].nValue; k++)
+        node->first_value[k].next_value = &node->first_value[k+1];
+      node->first_value[k].next_value = 0;
+    }
+    
+    // The root
+    if( i==0 ){
+      if( aElem[i].iParent || aElem[i].iSymbol || node->array_index )
+        return 0;
+      node->is_last_child = 1;
+      continue;
+    }
+    if( aElem[i].iParent<1 || aElem[i].iParent>i || aElem[i].iSymbol<1 || aElem[i].iSymbol>h.nSymbol )
+      return 0;
+    parent = &aElement[aElem[i].iParent-1];
+    node->parent = parent;
+    node->symbol = &aSymbol[aElem[i].iSymbol-1];
+    node->depth = parent->depth+1;
+    aElement[i-1].next = node;
+    
+    // The parent must be an ancestor of the element before, whose
+    // descendants are done, and the child of the parent among them is
+    // the previous sibling
+    prev = 0;
+    for(c=&aElement[i-1]; c!=parent; c=c->parent){
+      if( c==aElement )
+        return 0;
+      if( c->parent==parent )
+        prev = c;
+      else
+        tree_load_close(c);
+    }
+    parent->is_parent = 1;
+    node->child_index = prev ? prev->child_index+1 : 1;
+    
+    // Arrays continue from the previous sibling of the same name
+    if( node->array_index<0 || (node->array_index>1
+        && (!prev || prev->array_index+1!=node->array_index || prev->symbol!=node->symbol)) )
+      return 0;
+    if( prev && prev->array_index && node->array_index<=1 )
+      prev->is_array_end = 1;
+  }
+  
+  // The last element closes its ancestors
+  for(c=&aElement[h.nElement-1]; c!=aElement; c=c->parent)
+    tree_load_close(c);
+  
+  doc->root = aElement;
+  return 1;
+}
+
+//
+// xml_doc_load
+//
+// Load a document saved by xml_doc_save(). Returns null if the file cannot
+// be read, is not a valid tree file of this version, or memory runs out.
+//
+xml_doc xml_doc_load(const char *zPath){
+  xml_doc doc;
+  void *map;
+  size_t n;
+#ifdef HAVE_MMAP
+  struct stat st;
+  int fd;
+  
+  fd = open(zPath, O_RDONLY);
+  if( fd<0 )
+    return 0;
+  if( fstat(fd, &st)!=0 || st.st_size<(off_t)sizeof(struct tree_header) ){
+    close(fd);
+    return 0;
+  }
+  n = st.st_size;
+  map = mmap(0, n, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if( map==MAP_FAILED )
+    return 0;
+#else
+  FILE *f = fopen(zPath, "rb");
+  long nFile;
+  
+  if( !f )
+    return 0;
+  if( fseek(f, 0, SEEK_END)!=0 || (nFile = ftell(f))<(long)sizeof(struct tree_header) ){
+    fclose(f);
+    return 0;
+  }
+  n = nFile;
+  map = MALLOC(n);
+  rewind(f);
+  if( !map || fread(map, 1, n, f)!=n ){
+    fclose(f);
+    FREE(map);
+    return 0;
+  }
+  fclose(f);
+#endif
+  
+  doc = MALLOC(sizeof(struct xml_doc));
+  if( !doc ){
+#ifdef HAVE_MMAP
+    munmap(map, n);
+#else
+    FREE(map);
+#endif
+    return 0;
+  }
+  memset(doc, 0, sizeof(struct xml_doc));
+  doc->map = map;
+  doc->nMap = n;
+  if( !tree_load(doc, map, n) ){
+    xml_doc_free(doc);
+    return 0;
+  }
+  return doc;
+}
+#endif
+
+#ifdef SQLITE
+/*
+** Options argument of xml_to_json(X, O), xml_to_jsonb(X, O),
+** xml_to_cbor(X, O), xml_to_msgpack(X, O) and xml_group_json(X, O).
+**
+** O is either an integer indent, or a JSON object of options, e.g.
+** '{"indent":2,"attribute_prefix":"-","text_key":"_","typed":true}'. An object is parsed
+** into a single allocation, which is kept with sqlite3_set_auxdata() so it
+** is parsed once per statement rather than once per row. A "schema" key is
+** compiled with xml_schema_compile() into a second allocation.
+*/
+static const char *xml_options_space(const char *z){
+  while( *z==' ' || *z=='\t' || *z=='\n' || *z=='\r' )
+    z++;
+  return z;
+}
+
+// String of an options object, still escaped. Sets *pn to its length.
+static const char *xml_options_string(const char *z, int *pn){
+  int n;
+  
+  if( *z!='"' )
+    return 0;
+  z++;
+  for(n=0; z[n]!='"'; n++){
+    if( (unsigned char)z[n]<0x20 )
+      return 0;
+    if( z[n]=='\\' && z[++n]==0 )
+      return 0;
+  }
+  *pn = n;
+  return z;
+}
+
+// Copy a string of n bytes from an options object to zOut, decoding JSON
+// escapes, and zero terminate it. Returns its length, or -1 if an escape
+// is not valid.
+static int xml_options_unescape(char *zOut, const char *z, int n){
+  unsigned int c;
+  int nOut = 0;
+  int i, k;
+  
+  for(i=0; i<n; i++){
+    if( z[i]!='\\' ){
+      zOut[nOut++] = z[i];
+      continue;
+    }
+    switch( z[++i] ){
+      case '"': case '\\': case '/': zOut[nOut++] = z[i]; break;
+      case 'b': zOut[nOut++] = '\b'; break;
+      case 'f': zOut[nOut++] = '\f'; break;
+      case 'n': zOut[nOut++] = '\n'; break;
+      case 'r': zOut[nOut++] = '\r'; break;
+      case 't': zOut[nOut++] = '\t'; break;
+      case 'u':
+        // As UTF-8, which is no longer than the escape
+        for(c=0, k=1; k<=4; k++){
+          if( i+k<n && z[i+k]>='0' && z[i+k]<='9' )
+            c = c*16 + z[i+k]-'0';
+          else if( i+k<n && (z[i+k]|0x20)>='a' && (z[i+k]|0x20)<='f' )
+            c = c*16 + (z[i+k]|0x20)-'a'+10;
+          else
+            return -1;
+        }
+        i += 4;
+        if( c<0x80 ){
+          zOut[nOut++] = c;
+        }else if( c<0x800 ){
+          zOut[nOut++] = 0xC0 | c>>6;
+          zOut[nOut++] = 0x80 | (c & 0x3F);
+        }else{
+          zOut[nOut++] = 0xE0 | c>>12;
+          zOut[nOut++] = 0x80 | ((c>>6) & 0x3F);
+          zOut[nOut++] = 0x80 | (c & 0x3F);
+        }
+        break;
+      default:
+        return -1;
+    }
+  }
+  zOut[nOut] = 0;
+  return nOut;
+}
+
+// Free options parsed by xml_options_parse(), and their schema
+static void xml_options_free(void *p){
+  xml_options opt = (xml_options)p;
+  
+  sqlite3_free(opt->schema);
+  sqlite3_free(opt);
+}
+
+static xml_options xml_options_parse(const char *zOptions, char **pzErr){
+  xml_options opt;
+  const char *z;
+  const char *zKey;
+  const char *zVal;
+  char *zOut;
+  int nKey;
+  int nVal;
+  
+  opt = sqlite3_malloc(sizeof(struct xml_options) + strlen(zOptions) + 2);
+  if( !opt ){
+    *pzErr = 0;
+    return 0;
+  }
+  xml_options_init(opt, -1);
+  zOut = (char *)&opt[1];
+  
+  z = xml_options_space(zOptions);
+  if( *z!='{' )
+    goto options_error;
+  z = xml_options_space(z+1);
+  while( *z!='}' ){
+    zKey = xml_options_string(z, &nKey);
+    if( !zKey )
+      goto options_error;
+    z = xml_options_space(zKey+nKey+1);
+    if( *z!=':' )
+      goto options_error;
+    z = xml_options_space(z+1);
+    
+    if( nKey==6 && memcmp(zKey, "indent", 6)==0 ){
+      zVal = z;
+      if( *z=='-' )
+        z++;
+      if( *z<'0' || *z>'9' )
+        goto options_error;
+      while( *z>='0' && *z<='9' )
+        z++;
+      opt->indent = atoi(zVal);
+    }else if( nKey==5 && memcmp(zKey, "typed", 5)==0 ){
+      if( memcmp(z, "true", 4)==0 ){
+        opt->typed = 1;
+        z += 4;
+      }else if( memcmp(z, "false", 5)==0 ){
+        opt->typed = 0;
+        z += 5;
+      }else{
+        goto options_error;
+      }
+    }else if( (nKey==16 && memcmp(zKey, "attribute_prefix", 16)==0)
+        || (nKey==8 && memcmp(zKey, "text_key", 8)==0) ){
+      zVal = xml_options_string(z, &nVal);
+      if( !zVal )
+        goto options_error;
+      z = zVal+nVal+1;
+      
+      // Output as they are, so escapes are not allowed
+      if( memchr(zVal, '\\', nVal) )
+        goto options_error;
+      memcpy(zOut, zVal, nVal);
+      if( nKey==8 ){
+        opt->text_key = zOut;
+        opt->nTextKey = nVal;
+      }else{
+        opt->attr_prefix = zOut;
+        opt->nAttrPrefix = nVal;
+      }
+      zOut += nVal+1;
+    }else if( nKey==6 && memcmp(zKey, "schema", 6)==0 ){
+      zVal = xml_options_string(z, &nVal);
+      if( !zVal )
+        goto options_error;
+      z = zVal+nVal+1;
+      if( xml_options_unescape(zOut, zVal, nVal)<0 )
+        goto options_error;
+      
+      // As with the other options, the last schema given is used
+      sqlite3_free(opt->schema);
+      opt->schema = xml_schema_compile(zOut);
+      if( !opt->schema ){
+        *pzErr = sqlite3_mprintf("malformed schema: %s", zOut);
+        xml_options_free(opt);
+        return 0;
+      }
+    }else{
+      *pzErr = sqlite3_mprintf("unknown option: %.*s", nKey, zKey);
+      xml_options_free(opt);
+      return 0;
     }
     
-    printf("  \"#text\":\"%.*s\"\n", current_node->nName, current_node->name);
+    z = xml_options_space(z);
+    if( *z==',' )
+      z = xml_options_space(z+1);
+    else if( *z!='}' )
+      goto options_error;
   }
-#endif
+  if( *xml_options_space(z+1) )
+    goto options_error;
+  return opt;
   
-   int nJson;
-   char *json;
+options_error:
+  *pzErr = sqlite3_mprintf("malformed options: %s", zOptions);
+  xml_options_free(opt);
+  return 0;
+}
 
-   // Calculate space required
-   nJson = json_output(root, NULL, indent);
-   
-   // Construct JSON
-   json = MALLOC(nJson+1);
-   json_output(root, json, indent);
-   json[nJson] = 0;
-   
-   // Cleanup elements
-   current_node = root;
-   next_node = current_node->next;
-   while( current_node ){
-     
-     // Cleanup attributes
-     current_attr = current_node->first_attr;
-     while( current_attr ){
-       
-       // Cleanup value parts
-       current_value_part = current_attr->first_value_part;
-       while( current_value_part ){
-         next_value_part = current_value_part->next_value_part;
-         FREE(current_value_part);
-         current_value_part = next_value_part;
-       }
-       
-       next_attr = current_attr->next_attr;
-       FREE(current_attr);
-       current_attr = next_attr;
-     }
-     
-     // Cleanup values
-     current_value = current_node->first_value;
-     while( current_value ){
-       
-       // Cleanup value parts
-       current_value_part = current_value->first_value_part;
-       while( current_value_part ){
-         next_value_part = current_value_part->next_value_part;
-         if( current_value_part->free ) FREE(current_value_part->val);
-         FREE(current_value_part);
-         current_value_part = next_value_part;
-       }
-       
-       next_value = current_value->next_value;
-       FREE(current_value);
-       current_value = next_value;
-     }
-     
-     next_node = current_node->next;
-     FREE(current_node);
-     current_node = next_node;
-   }
-   
-   return json;
+// Options of argument iArg. Returns pDefault for an integer indent or NULL,
+// or the options kept for the statement. Sets *pIsNew if the options were
+// parsed for this row, and should be kept with sqlite3_set_auxdata().
+static xml_options xml_options_arg(
+  sqlite3_context *context,
+  sqlite3_value *pArg,
+  int iArg,
+  xml_options pDefault,
+  int *pIsNew
+){
+  xml_options opt;
+  const char *z;
+  char *zErr;
+  
+  *pIsNew = 0;
+  xml_options_init(pDefault, -1);
+  if( !pArg || sqlite3_value_type(pArg)==SQLITE_NULL )
+    return pDefault;
+  if( sqlite3_value_type(pArg)!=SQLITE_TEXT
+      || *xml_options_space((const char *)sqlite3_value_text(pArg))!='{' ){
+    pDefault->indent = sqlite3_value_int(pArg);
+    return pDefault;
+  }
+  
+  opt = sqlite3_get_auxdata(context, iArg);
+  if( opt )
+    return opt;
+  
+  z = (const char *)sqlite3_value_text(pArg);
+  opt = xml_options_parse(z, &zErr);
+  if( !opt ){
+    if( zErr )
+      sqlite3_result_error(context, zErr, -1);
+    else
+      sqlite3_result_error_nomem(context);
+    sqlite3_free(zErr);
+    return 0;
+  }
+  *pIsNew = 1;
+  return opt;
+}
+
+/*
+** Interrupt hook of conversions in SQL functions.
+**
+** sqlite3_interrupt() only stops a statement between calls of SQL
+** functions, so conversions check sqlite3_is_interrupted() themselves, and
+** fail with SQLITE_INTERRUPT. It was added in SQLite 3.41.0, and with older
+** versions a conversion runs to the end.
+*/
+static int xml_is_interrupted(void *pArg){
+#if SQLITE_VERSION_NUMBER>=3041000
+  return sqlite3_is_interrupted((sqlite3 *)pArg);
+#else
+  (void)pArg;
+  return 0;
+#endif
 }
 
 //
-// html_code_to_str()
-//
-// Convert a html code to a char array.
-//
-//   e.g. &#39; to '
+// xml_interrupt_options
 //
-// must be freed
+// Copy opt into pCopy, with an interrupt hook for the database connection
+// of the SQL function, and return pCopy.
 //
-static void html_code_to_str(int *i, value_part value_part, const char *xml){
-  // find end of html code
-  int start = *i+1;
-  int len = 0;
-  while( xml[start+len]!=';' )
-    len++;
+static xml_options xml_interrupt_options(
+  sqlite3_context *context,
+  xml_options opt,
+  xml_options pCopy,
+  xml_interrupt it
+){
+  *pCopy = *opt;
+  xml_interrupt_init(it, xml_is_interrupted, sqlite3_context_db_handle(context));
+  if( SQLITE_VERSION_NUMBER>=3041000 && sqlite3_libversion_number()>=3041000 )
+    pCopy->interrupt = it;
+  return pCopy;
+}
 
-  // advance through xml
-  *i += 2+len;
+/*
+** Result cache of xml_to_json().
+**
+** Each connection has an LRU cache of the JSON of recent documents, so
+** repeated documents are converted once. Entries are found by a 64-bit hash
+** of the XML and the options, and the XML is kept to be compared on a hit,
+** so a hash collision can not return the wrong JSON. A hit returns the
+** cached JSON without copying it: each result holds a reference to the
+** entry, which is freed when the cache and every result have let it go.
+**
+** The cache is off unless it is given a size with xml_cache_size(N), or
+** compiled with -DXML_CACHE_SIZE=N. xml_cache_stats() returns its hits,
+** misses and size as JSON.
+*/
+#ifndef XML_CACHE_SIZE
+# define XML_CACHE_SIZE 0               // Default number of entries, 0 for no cache
+#endif
+#define XML_CACHE_MAX_XML (64*1024)     // Largest XML string cached
+
+typedef struct xml_cache_entry *xml_cache_entry;
+struct xml_cache_entry{
+  sqlite3_uint64 hash;                  // Hash of XML and options
+  sqlite3_uint64 hash_options;          // Hash of options alone
+  int nXml;                             // Length of XML
+  int nJson;                            // Length of JSON
+  int nRef;                             // References from the cache and results
+  xml_cache_entry pHashNext;            // Next entry in the same bucket
+  xml_cache_entry pPrev;                // More recently used entry
+  xml_cache_entry pNext;                // Less recently used entry
+  // Followed by the JSON, with a null terminator, and the XML
+};
+
+typedef struct xml_cache *xml_cache;
+struct xml_cache{
+  int nRef;                             // Functions registered with the cache
+  int nMax;                             // Most entries kept, 0 for no cache
+  int nEntry;                           // Number of entries
+  int nBucket;                          // Size of aBucket, a power of two
+  xml_cache_entry *aBucket;             // Hash table of entries
+  xml_cache_entry pFirst;               // Most recently used entry
+  xml_cache_entry pLast;                // Least recently used entry
+  sqlite3_int64 nHit;                   // Results found in the cache
+  sqlite3_int64 nMiss;                  // Results converted
+  sqlite3_int64 nEvict;                 // Entries dropped to make room
+};
+
+// 64-bit hash, reading 8 bytes at a time
+static sqlite3_uint64 xml_cache_hash(const char *z, int n, sqlite3_uint64 h){
+  sqlite3_uint64 w;
+  int i;
   
-  // str to int
-  int m = 1; // multiplier 1, 10, 100 etc.
-  unsigned long x = 0;
-  while( len>0 ){
-    x += (xml[start+len-1]-48)*m;
-    m *= 10;
-    len--;
+  for(i=0; i+8<=n; i+=8){
+    memcpy(&w, &z[i], 8);
+    h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 32;
   }
+  w = 0;
+  memcpy(&w, &z[i], n-i);
+  h = (h ^ w ^ (sqlite3_uint64)n) * 0x9E3779B97F4A7C15ULL;
+  h ^= h >> 29;
+  h *= 0xBF58476D1CE4E5B9ULL;
+  h ^= h >> 32;
+  return h;
+}
 
-  // int to char array
-  char *str;
-  if( x < 1 << 8 ){
-    value_part->nVal = 1;
-    str = MALLOC(2);
-    str[0] = x & 0xFF;
-    str[1] = 0;
-  }else if( x < 1 << 16 ){
-    value_part->nVal = 2;
-    str = MALLOC(3);
-    str[0] = (x >> 8) & 0xFF;
-    str[1] = x & 0xFF;
-    str[2] = 0;
-  }else if( x < 1 << 16 ){
-    value_part->nVal = 3;
-    str = MALLOC(4);
-    str[0] = (x >> 16) & 0xFF;
-    str[1] = (x >> 8) & 0xFF;
-    str[2] = x & 0xFF;
-    str[3] = 0;
-  }else{
-    value_part->nVal = 4;
-    str = MALLOC(5);
-    str[0] = (x >> 24) & 0xFF;
-    str[1] = (x >> 16) & 0xFF;
-    str[2] = (x >> 8) & 0xFF;
-    str[3] = x & 0xFF;
-    str[4] = 0;
+static sqlite3_uint64 xml_cache_hash_options(xml_options opt){
+  sqlite3_uint64 h = (sqlite3_uint64)(opt->indent + 1) * 2 + opt->typed;
+  
+  h = xml_cache_hash(opt->attr_prefix, opt->nAttrPrefix, h);
+  if( opt->schema )
+    h = xml_cache_hash(opt->schema->name, opt->schema->nName, h);
+  return xml_cache_hash(opt->text_key, opt->nTextKey, h);
+}
+
+// Destructor of results, and of entries dropped from the cache
+static void xml_cache_unref(void *p){
+  xml_cache_entry entry = (xml_cache_entry)p - 1;
+  
+  if( --entry->nRef==0 )
+    sqlite3_free(entry);
+}
+
+// Remove an entry from the hash table and LRU list
+static void xml_cache_remove(xml_cache cache, xml_cache_entry entry){
+  xml_cache_entry *pp = &cache->aBucket[entry->hash & (cache->nBucket-1)];
+  
+  while( *pp!=entry )
+    pp = &(*pp)->pHashNext;
+  *pp = entry->pHashNext;
+  
+  if( entry->pPrev )
+    entry->pPrev->pNext = entry->pNext;
+  else
+    cache->pFirst = entry->pNext;
+  if( entry->pNext )
+    entry->pNext->pPrev = entry->pPrev;
+  else
+    cache->pLast = entry->pPrev;
+  
+  cache->nEntry--;
+  xml_cache_unref(&entry[1]);
+}
+
+// Add an entry as the most recently used
+static void xml_cache_insert(xml_cache cache, xml_cache_entry entry){
+  xml_cache_entry *pp = &cache->aBucket[entry->hash & (cache->nBucket-1)];
+  
+  entry->pHashNext = *pp;
+  *pp = entry;
+  entry->pPrev = 0;
+  entry->pNext = cache->pFirst;
+  if( cache->pFirst )
+    cache->pFirst->pPrev = entry;
+  else
+    cache->pLast = entry;
+  cache->pFirst = entry;
+  cache->nEntry++;
+}
+
+// Set the most entries kept, dropping the least recently used entries and
+// resizing the hash table to at least twice the number of entries
+static int xml_cache_resize(xml_cache cache, int nMax){
+  xml_cache_entry *aBucket;
+  xml_cache_entry entry;
+  xml_cache_entry next;
+  int nBucket;
+  
+  while( cache->nEntry>nMax ){
+    xml_cache_remove(cache, cache->pLast);
+    cache->nEvict++;
   }
-  value_part->free = 1;
-  value_part->val = str;
+  cache->nMax = nMax;
+  if( nMax==0 ){
+    sqlite3_free(cache->aBucket);
+    cache->aBucket = 0;
+    cache->nBucket = 0;
+    return SQLITE_OK;
+  }
+  
+  for(nBucket=16; nBucket<2*nMax; nBucket*=2);
+  if( nBucket==cache->nBucket )
+    return SQLITE_OK;
+  aBucket = sqlite3_malloc64(nBucket*sizeof(xml_cache_entry));
+  if( !aBucket )
+    return SQLITE_NOMEM;
+  memset(aBucket, 0, nBucket*sizeof(xml_cache_entry));
+  
+  // Insert the entries again, least recently used first to keep the order
+  entry = cache->pLast;
+  sqlite3_free(cache->aBucket);
+  cache->aBucket = aBucket;
+  cache->nBucket = nBucket;
+  cache->pFirst = cache->pLast = 0;
+  cache->nEntry = 0;
+  for(; entry; entry=next){
+    next = entry->pPrev;
+    xml_cache_insert(cache, entry);
+  }
+  return SQLITE_OK;
 }
 
-static value_part get_value_parts(int *i, int j, char *xml, value_part new_value_part, int is_attr){
+static void xml_cache_release(void *p){
+  xml_cache cache = (xml_cache)p;
+  
+  if( --cache->nRef==0 ){
+    xml_cache_resize(cache, 0);
+    sqlite3_free(cache);
+  }
+}
 
-  while( xml[*i+j] && !(xml[*i+j]=='<'
-                    || xml[*i+j]=='&'
-                    || xml[*i+j]=='\b'
-                    || xml[*i+j]=='\t'
-                    || xml[*i+j]=='\n'
-                    || xml[*i+j]=='\f'
-                    || xml[*i+j]=='\r'
-                    || xml[*i+j]=='"'
-                    || xml[*i+j]=='\\') )
-    j++;
+// Find a cached entry, and make it the most recently used
+static xml_cache_entry xml_cache_find(
+  xml_cache cache,
+  sqlite3_uint64 hash,
+  sqlite3_uint64 hash_options,
+  const char *xml,
+  int nXml
+){
+  xml_cache_entry entry;
+  
+  entry = cache->aBucket[hash & (cache->nBucket-1)];
+  for(; entry; entry=entry->pHashNext){
+    if( entry->hash==hash && entry->hash_options==hash_options
+        && entry->nXml==nXml
+        && memcmp((char *)&entry[1] + entry->nJson + 1, xml, nXml)==0 ){
+      break;
+    }
+  }
+  if( entry && entry!=cache->pFirst ){
+    entry->nRef++;
+    xml_cache_remove(cache, entry);
+    xml_cache_insert(cache, entry);
+  }
+  return entry;
+}
 
-  //printf("%.*s\n", j, &xml[*i]);
+/*
+** Implementation of xml_to_json() function.
+*/
+static void xml_to_jsonFunc(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  if( sqlite3_value_type(argv[0])==SQLITE_NULL ) return;
+  xml_cache cache = (xml_cache)sqlite3_user_data(context);
+  xml_cache_entry entry;
+  struct xml_options defaults;
+  struct xml_options copy;
+  struct xml_interrupt it;
+  xml_options opt;
+  sqlite3_uint64 hash_options = 0;
+  sqlite3_uint64 hash = 0;
+  int is_new;
+  char *xml = (char *)sqlite3_value_text(argv[0]);
+  int nXml = sqlite3_value_bytes(argv[0]);
+  char *json;
+  int nJson;
   
-  new_value_part->nVal = j;
-  new_value_part->val = &xml[*i];
-  new_value_part->free = 0;
-  *i += j;
+  opt = xml_options_arg(context, argc==2 ? argv[1] : 0, 1, &defaults, &is_new);
+  if( !opt )
+    return;
   
-  // Special characters
-  if( xml[*i]=='&'
-   || xml[*i]=='\b'
-   || xml[*i]=='\t'
-   || xml[*i]=='\n'
-   || xml[*i]=='\f'
-   || xml[*i]=='\r'
-   || (xml[*i]=='"' && !is_attr)
-   || xml[*i]=='\\' ){
-    new_value_part->next_value_part = (value_part)MALLOC(sizeof(struct value_part));
-    new_value_part = new_value_part->next_value_part;
-    new_value_part->next_value_part = 0;
-    new_value_part->free = 0;
+  // Cached result
+  entry = 0;
+  if( cache->nMax>0 && nXml<=XML_CACHE_MAX_XML ){
+    hash_options = xml_cache_hash_options(opt);
+    hash = xml_cache_hash(xml, nXml, hash_options);
+    entry = xml_cache_find(cache, hash, hash_options, xml, nXml);
+    if( entry ){
+      cache->nHit++;
+      entry->nRef++;
+      sqlite3_result_text(context, (char *)&entry[1], entry->nJson, xml_cache_unref);
+      goto to_json_end;
+    }
+    cache->nMiss++;
   }
   
-  if( xml[*i]=='&' ){
-    *i += 1;
-    if( memcmp("amp;", &xml[*i], 4) == 0 ){
-      new_value_part->nVal = 1;
-      new_value_part->val = "&";
-      *i += 4;
-    }else if( memcmp("gt;", &xml[*i], 3) == 0 ){
-      new_value_part->nVal = 1;
-      new_value_part->val = ">";
-      *i += 3;
-    }else if( memcmp("lt;", &xml[*i], 3) == 0 ){
-      new_value_part->nVal = 1;
-      new_value_part->val = "<";
-      *i += 3;
-    }else if( memcmp("quot;", &xml[*i], 5) == 0 ){
-      new_value_part->nVal = 2;
-      new_value_part->val = "\\\"";
-      *i += 5;
-    }else if( memcmp("apos;", &xml[*i], 5) == 0 ){
-      new_value_part->nVal = 1;
-      new_value_part->val = "'";
-      *i += 5;
-    }else if( memcmp("#8;", &xml[*i], 3) == 0 ){
-      new_value_part->nVal = 2;
-      new_value_part->val = "\\b";
-      *i += 3;
-    }else if( memcmp("#9;", &xml[*i], 3) == 0 ){
-      new_value_part->nVal = 2;
-      new_value_part->val = "\\t";
-      *i += 3;
-    }else if( memcmp("#10;", &xml[*i], 4) == 0 ){
-      new_value_part->nVal = 2;
-      new_value_part->val = "\\n";
-      *i += 4;
-    }else if( memcmp("#12;", &xml[*i], 4) == 0 ){
-      new_value_part->nVal = 2;
-      new_value_part->val = "\\f";
-      *i += 4;
-    }else if( memcmp("#13;", &xml[*i], 4) == 0 ){
-      new_value_part->nVal = 2;
-      new_value_part->val = "\\r";
-      *i += 4;
-    }else if( memcmp("#34;", &xml[*i], 4) == 0 ){
-      new_value_part->nVal = 2;
-      new_value_part->val = "\\\"";
-      *i += 4;
-    }else if( memcmp("#92;", &xml[*i], 4) == 0 ){
-      new_value_part->nVal = 2;
-      new_value_part->val = "\\\\";
-      *i += 4;
-    }else if( memcmp("#", &xml[*i], 1) == 0 ){
-      html_code_to_str(i, new_value_part, (const char *)xml);
+  json = xml_convert(xml, nXml, xml_interrupt_options(context, opt, &copy, &it));
+  if( !json && xml_interrupted(copy.interrupt) ){
+    sqlite3_result_error_code(context, SQLITE_INTERRUPT);
+    goto to_json_end;
+  }
+  if( !json && copy.error ){
+    sqlite3_result_error_nomem(context);
+    goto to_json_end;
+  }
+  
+  if( !json || cache->nMax==0 || nXml>XML_CACHE_MAX_XML ){
+    sqlite3_result_text(context, json, -1, sqlite3_free);
+    goto to_json_end;
+  }
+  
+  // Keep the JSON and XML in a new entry, referenced by the cache and result
+  nJson = strlen(json);
+  entry = sqlite3_malloc64(sizeof(struct xml_cache_entry) + nJson + 1 + nXml);
+  if( !entry ){
+    sqlite3_result_text(context, json, nJson, sqlite3_free);
+    goto to_json_end;
+  }
+  entry->hash = hash;
+  entry->hash_options = hash_options;
+  entry->nXml = nXml;
+  entry->nJson = nJson;
+  entry->nRef = 2;
+  memcpy(&entry[1], json, nJson+1);
+  memcpy((char *)&entry[1] + nJson + 1, xml, nXml);
+  sqlite3_free(json);
+  
+  if( cache->nEntry==cache->nMax ){
+    xml_cache_remove(cache, cache->pLast);
+    cache->nEvict++;
+  }
+  xml_cache_insert(cache, entry);
+  sqlite3_result_text(context, (char *)&entry[1], nJson, xml_cache_unref);
+  
+to_json_end:
+  if( is_new )
+    sqlite3_set_auxdata(context, 1, opt, xml_options_free);
+}
+
+/*
+** Implementation of xml_cache_size(N) and xml_cache_stats() functions.
+**
+** xml_cache_size(N) sets the most entries in the result cache of
+** xml_to_json(), and returns the size before. 0 turns the cache off.
+** xml_cache_stats() returns a JSON object of the size, number of entries,
+** hits, misses and evictions.
+*/
+static void xml_cache_sizeFunc(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  xml_cache cache = (xml_cache)sqlite3_user_data(context);
+  int nMax = cache->nMax;
+  int n;
+  
+  (void)argc;
+  n = sqlite3_value_int(argv[0]);
+  if( n<0 )
+    n = 0;
+  if( n>1000000 )
+    n = 1000000;
+  if( xml_cache_resize(cache, n)!=SQLITE_OK ){
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  sqlite3_result_int(context, nMax);
+}
+
+static void xml_cache_statsFunc(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  xml_cache cache = (xml_cache)sqlite3_user_data(context);
+  char *z;
+  
+  (void)argc;
+  (void)argv;
+  z = sqlite3_mprintf(
+      "{\"size\":%d,\"entries\":%d,\"hits\":%lld,\"misses\":%lld,\"evictions\":%lld}",
+      cache->nMax, cache->nEntry, cache->nHit, cache->nMiss, cache->nEvict);
+  if( !z ){
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  sqlite3_result_text(context, z, -1, sqlite3_free);
+  sqlite3_result_subtype(context, 'J');
+}
+
+/*
+** Implementation of xml_extract(X, P1, P2, ...) function.
+**
+** With a single path, the value is returned as text, or as JSON for an
+** element with children or attributes. With several paths, a JSON array
+** of the values is returned. Paths are compiled once per statement, and
+** kept with sqlite3_set_auxdata().
+*/
+static void xml_extract_quote(sqlite3_str *pStr, const char *z){
+  static const char aHex[] = "0123456789abcdef";
+  unsigned char c;
+  
+  sqlite3_str_appendchar(pStr, 1, '"');
+  for(; (c = *z); z++){
+    if( c=='"' || c=='\\' ){
+      sqlite3_str_appendchar(pStr, 1, '\\');
+      sqlite3_str_appendchar(pStr, 1, c);
+    }else if( c<0x20 ){
+      sqlite3_str_append(pStr, "\\u00", 4);
+      sqlite3_str_appendchar(pStr, 1, aHex[c>>4]);
+      sqlite3_str_appendchar(pStr, 1, aHex[c&0xF]);
+    }else{
+      sqlite3_str_appendchar(pStr, 1, c);
+    }
+  }
+  sqlite3_str_appendchar(pStr, 1, '"');
+}
+
+static void xml_extractFunc(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  struct xml_match aStatic[4];
+  xml_match aMatch = aStatic;
+  char *is_new = 0;
+  sqlite3_str *pStr;
+  const char *zPath;
+  char *xml;
+  char *z;
+  int nPath = argc-1;
+  int is_json;
+  int nomem = 0;
+  int i;
+  
+  if( argc<2 ){
+    sqlite3_result_error(context, "xml_extract() needs at least one path", -1);
+    return;
+  }
+  if( sqlite3_value_type(argv[0])==SQLITE_NULL ) return;
+  
+  if( nPath>4 ){
+    aMatch = sqlite3_malloc(nPath*sizeof(struct xml_match));
+    if( !aMatch ){
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+  }
+  is_new = sqlite3_malloc(nPath);
+  if( !is_new ){
+    sqlite3_result_error_nomem(context);
+    goto extract_end;
+  }
+  memset(is_new, 0, nPath);
+  
+  // Compile paths that were not kept from an earlier row
+  for(i=0; i<nPath; i++){
+    aMatch[i].path = sqlite3_get_auxdata(context, i+1);
+    if( aMatch[i].path )
+      continue;
+    if( sqlite3_value_type(argv[i+1])==SQLITE_NULL )
+      goto extract_end;
+    zPath = (const char *)sqlite3_value_text(argv[i+1]);
+    aMatch[i].path = xml_path_compile(zPath, &nomem);
+    if( !aMatch[i].path && nomem ){
+      sqlite3_result_error_nomem(context);
+      goto extract_end;
+    }
+    if( !aMatch[i].path ){
+      z = sqlite3_mprintf("bad XML path: %s", zPath);
+      sqlite3_result_error(context, z, -1);
+      sqlite3_free(z);
+      goto extract_end;
+    }
+    is_new[i] = 1;
+  }
+  
+  xml = (char *)sqlite3_value_text(argv[0]);
+  xml_extract_find(xml, sqlite3_value_bytes(argv[0]), aMatch, nPath);
+  
+  if( nPath==1 ){
+    z = xml_match_value(&aMatch[0], &is_json);
+    if( z ){
+      sqlite3_result_text(context, z, -1, sqlite3_free);
+      if( is_json )
+        sqlite3_result_subtype(context, 'J');
+    }else if( aMatch[0].nomem ){
+      sqlite3_result_error_nomem(context);
     }
-  }else if( xml[*i]=='\b' ){
-    new_value_part->nVal = 2;
-    new_value_part->val = "\\b";
-    *i += 1;
-  }else if( xml[*i]=='\t' ){
-    new_value_part->nVal = 2;
-    new_value_part->val = "\\t";
-    *i += 1;
-  }else if( xml[*i]=='\n' ){
-    new_value_part->nVal = 2;
-    new_value_part->val = "\\n";
-    *i += 1;
-  }else if( xml[*i]=='\f' ){
-    new_value_part->nVal = 2;
-    new_value_part->val = "\\f";
-    *i += 1;
-  }else if( xml[*i]=='\r' ){
-    new_value_part->nVal = 2;
-    new_value_part->val = "\\r";
-    *i += 1;
-  }else if( !is_attr && xml[*i]=='"' ){
-    new_value_part->nVal = 2;
-    new_value_part->val = "\\\"";
-    *i += 1;
-  }else if( xml[*i]=='\\' ){
-    new_value_part->nVal = 2;
-    new_value_part->val = "\\\\";
-    *i += 1;
+  }else{
+    pStr = sqlite3_str_new(0);
+    sqlite3_str_appendchar(pStr, 1, '[');
+    for(i=0; i<nPath; i++){
+      if( i )
+        sqlite3_str_appendchar(pStr, 1, ',');
+      z = xml_match_value(&aMatch[i], &is_json);
+      if( !z && aMatch[i].nomem ){
+        sqlite3_free(sqlite3_str_finish(pStr));
+        sqlite3_result_error_nomem(context);
+        goto extract_end;
+      }
+      if( !z )
+        sqlite3_str_append(pStr, "null", 4);
+      else if( is_json )
+        sqlite3_str_appendall(pStr, z);
+      else
+        xml_extract_quote(pStr, z);
+      sqlite3_free(z);
+    }
+    sqlite3_str_appendchar(pStr, 1, ']');
+    sqlite3_result_text(context, sqlite3_str_finish(pStr), -1, sqlite3_free);
+    sqlite3_result_subtype(context, 'J');
   }
+  
+extract_end:
+  for(i=0; is_new && i<nPath; i++){
+    if( is_new[i] )
+      sqlite3_set_auxdata(context, i+1, aMatch[i].path, sqlite3_free);
+  }
+  sqlite3_free(is_new);
+  if( aMatch!=aStatic )
+    sqlite3_free(aMatch);
+}
 
-  return new_value_part;
+//
+// xml_path_find
+//
+// Advance the tokenizer to the element selected by the first nStep steps
+// of the path, which must all select elements, skipping the subtrees of
+// other elements. Returns true if the element is found, leaving the
+// tokenizer just after its name.
+//
+static int xml_path_find(xml_tokenizer t, xml_path path, int nStep){
+  xml_path_step step;
+  int depth = t->depth;
+  int nMatch = 0;
+  int iStep = 0;
+  
+  while( iStep<nStep ){
+    step = &path->aStep[iStep];
+    switch( xml_token_next(t) ){
+      case XML_OPEN:
+        if( t->nName==step->nName && memcmp(t->name, step->name, t->nName)==0
+            && nMatch++==step->index ){
+          iStep++;
+          nMatch = 0;
+          depth = t->depth;
+        }else if( xml_token_skip(t)==XML_EOF ){
+          return 0;
+        }
+        break;
+      case XML_CLOSE:
+        if( t->depth<depth )
+          return 0;
+        break;
+      case XML_EOF:
+        return 0;
+    }
+  }
+  
+  return 1;
+}
+
+/*
+** Implementation of the xml_each(X, P) and xml_tree(X, P) table-valued
+** functions.
+**
+** Rows are read from the XML with the tokenizer as they are stepped
+** through, so a LIMIT stops reading early. xml_each() returns the
+** attributes, text and child elements of the element at path P, or the
+** top level elements if P is omitted. xml_tree() returns everything below
+** it.
+**
+** The value of an element is its text if it has no child elements, which
+** is then not returned as a separate text row. Otherwise it is null.
+*/
+#define XML_EACH_KEY 0
+#define XML_EACH_VALUE 1
+#define XML_EACH_TYPE 2
+#define XML_EACH_ID 3
+#define XML_EACH_PARENT 4
+#define XML_EACH_FULLKEY 5
+#define XML_EACH_PATH 6
+#define XML_EACH_XML 7
+#define XML_EACH_ROOT 8
+
+// Names of an element's children seen so far, to index siblings
+typedef struct xml_each_name *xml_each_name;
+struct xml_each_name{
+  char *name;                           // Child name, or "#text"
+  int nName;                            // Length of name
+  int count;                            // Number of children with name
+};
+
+// An element whose children are being returned
+typedef struct xml_each_frame *xml_each_frame;
+struct xml_each_frame{
+  sqlite3_int64 id;                     // Row id of element, or 0 for the root
+  int nPath;                            // Length of element's path
+  int folded;                           // True if element's text is its value
+  xml_each_name aName;                  // Names of children
+  int nName;                            // Number of names
+  int nNameAlloc;                       // Allocated size of aName
+};
+
+typedef struct xml_each_cursor *xml_each_cursor;
+struct xml_each_cursor{
+  sqlite3_vtab_cursor base;
+  int is_tree;                          // True for xml_tree()
+  char *xml;                            // Copy of XML string
+  struct xml_tokenizer t;               // Tokenizer reading rows
+  int root_depth;                       // Depth of root element
+  int skip;                             // True if the subtree of the last row is to be skipped
+  int eof;                              // True at end of rows
+  sqlite3_int64 iRowid;                 // Row id of current row
+  xml_each_frame aFrame;                // Root element and open elements below it
+  int nFrame;                           // Number of open elements
+  int nFrameAlloc;                      // Allocated size of aFrame
+  char *zPath;                          // Path of innermost open element
+  int nPathAlloc;                       // Allocated size of zPath
+  int type;                             // Row type: XML_OPEN, XML_ATTR or XML_TEXT
+  char *key;                            // Element or attribute name
+  int nKey;                             // Length of key
+  int index;                            // Position among siblings of the same name
+  char *val;                            // Encoded value, or null
+  int nVal;                             // Length of val
+  char *zValue;                         // Decoded value
+  int nValueAlloc;                      // Allocated size of zValue
+};
+
+static int xml_eachConnect(
+  sqlite3 *db,
+  void *pAux,
+  int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab,
+  char **pzErr
+){
+  sqlite3_vtab *pNew;
+  int rc;
+  
+  (void)pAux;
+  (void)argc;
+  (void)argv;
+  (void)pzErr;
+  rc = sqlite3_declare_vtab(db,
+     "CREATE TABLE x(key,value,type,id,parent,fullkey,path,"
+                    "xml HIDDEN,root HIDDEN)");
+  if( rc==SQLITE_OK ){
+    pNew = *ppVtab = sqlite3_malloc(sizeof(*pNew));
+    if( pNew==0 ) return SQLITE_NOMEM;
+    memset(pNew, 0, sizeof(*pNew));
+#ifdef SQLITE_VTAB_INNOCUOUS
+    sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+#endif
+  }
+  return rc;
+}
+
+static int xml_eachDisconnect(sqlite3_vtab *pVtab){
+  sqlite3_free(pVtab);
+  return SQLITE_OK;
+}
+
+static int xml_eachOpenEach(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor){
+  xml_each_cursor cur;
+  
+  (void)p;
+  cur = sqlite3_malloc(sizeof(*cur));
+  if( cur==0 ) return SQLITE_NOMEM;
+  memset(cur, 0, sizeof(*cur));
+  cur->eof = 1;
+  *ppCursor = &cur->base;
+  return SQLITE_OK;
+}
+
+static int xml_eachOpenTree(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor){
+  int rc = xml_eachOpenEach(p, ppCursor);
+  
+  if( rc==SQLITE_OK )
+    ((xml_each_cursor)*ppCursor)->is_tree = 1;
+  return rc;
 }
 
-#define PRINT_SPACES(x) nJson += print_spaces(json, nJson, x)
-#define PRINT_NEWLINE nJson += print_newline(json, nJson, indent)
-#define PRINT_CHAR(x) nJson += print_char(json, nJson, x)
-#define PRINT_STRING(z,n) nJson += print_string(json, nJson, z, n);
+static int xml_eachClose(sqlite3_vtab_cursor *pCursor){
+  xml_each_cursor cur = (xml_each_cursor)pCursor;
+  int i;
+  
+  for(i=0; i<cur->nFrameAlloc; i++)
+    sqlite3_free(cur->aFrame[i].aName);
+  sqlite3_free(cur->aFrame);
+  sqlite3_free(cur->xml);
+  sqlite3_free(cur->zPath);
+  sqlite3_free(cur->zValue);
+  sqlite3_free(cur);
+  return SQLITE_OK;
+}
 
 //
-// json_output
+// xml_each_key
+//
+// Append the key of the current row to zOut, which must have room for
+// nKey+30 bytes, and return its length.
 //
-// If *json is null, then return total space required.
-// If *json is not null, then populate with JSON string.
+static int xml_each_key(xml_each_cursor cur, char *zOut){
+  int n = 0;
+  int quote;
+  
+  zOut[n++] = '.';
+  if( cur->type==XML_TEXT ){
+    memcpy(&zOut[n], "#text", 5);
+    n += 5;
+  }else{
+    if( cur->type==XML_ATTR )
+      zOut[n++] = '@';
+    quote = memchr(cur->key, '.', cur->nKey) || memchr(cur->key, '[', cur->nKey);
+    if( quote ) zOut[n++] = '"';
+    memcpy(&zOut[n], cur->key, cur->nKey);
+    n += cur->nKey;
+    if( quote ) zOut[n++] = '"';
+  }
+  if( cur->index )
+    n += sprintf(&zOut[n], "[%d]", cur->index);
+  return n;
+}
+
 //
-// Does not zero terminate JSON string.
+// xml_each_push
 //
-int json_output(element root, char *json, int indent){
-  int nJson = 0;
-  int depth = 0;
+// Push the element just returned, whose children are returned next.
+//
+static int xml_each_push(xml_each_cursor cur, int folded){
+  xml_each_frame parent = &cur->aFrame[cur->nFrame-1];
+  xml_each_frame frame;
+  char *zPath;
+  int n;
   
-  element current_node;
-  element parent_node;
-  element_attribute current_attr;
-  value current_value;
-  value_part current_value_part;
+  if( cur->nFrame==cur->nFrameAlloc ){
+    frame = sqlite3_realloc(cur->aFrame, 2*cur->nFrameAlloc*sizeof(struct xml_each_frame));
+    if( !frame ) return SQLITE_NOMEM;
+    memset(&frame[cur->nFrameAlloc], 0, cur->nFrameAlloc*sizeof(struct xml_each_frame));
+    cur->aFrame = frame;
+    cur->nFrameAlloc *= 2;
+    parent = &cur->aFrame[cur->nFrame-1];
+  }
+  
+  n = parent->nPath + cur->nKey + 30;
+  if( n>cur->nPathAlloc ){
+    zPath = sqlite3_realloc(cur->zPath, 2*n);
+    if( !zPath ) return SQLITE_NOMEM;
+    cur->zPath = zPath;
+    cur->nPathAlloc = 2*n;
+  }
+  
+  frame = &cur->aFrame[cur->nFrame++];
+  frame->id = cur->iRowid;
+  frame->nPath = parent->nPath + xml_each_key(cur, &cur->zPath[parent->nPath]);
+  frame->folded = folded;
+  frame->nName = 0;
+  return SQLITE_OK;
+}
 
-  current_node = root;
+//
+// xml_each_index
+//
+// Count the current row among its siblings of the same name.
+//
+static int xml_each_index(xml_each_cursor cur){
+  xml_each_frame frame = &cur->aFrame[cur->nFrame-1];
+  xml_each_name name;
+  char *zName = cur->type==XML_TEXT ? "#text" : cur->key;
+  int nName = cur->type==XML_TEXT ? 5 : cur->nKey;
+  int i;
   
-  while(current_node->next){
-    current_node = current_node->next;  
+  for(i=frame->nName-1; i>=0; i--){
+    name = &frame->aName[i];
+    if( name->nName==nName && memcmp(name->name, zName, nName)==0 ){
+      cur->index = name->count++;
+      return SQLITE_OK;
+    }
+  }
+  
+  if( frame->nName==frame->nNameAlloc ){
+    name = sqlite3_realloc(frame->aName, (frame->nNameAlloc*2+8)*sizeof(struct xml_each_name));
+    if( !name ) return SQLITE_NOMEM;
+    frame->aName = name;
+    frame->nNameAlloc = frame->nNameAlloc*2+8;
+  }
+  name = &frame->aName[frame->nName++];
+  name->name = zName;
+  name->nName = nName;
+  name->count = 1;
+  cur->index = 0;
+  return SQLITE_OK;
+}
 
-    // Opening bracket
-    if( (current_node->child_index == 1 && !current_node->parent->first_attr && !current_node->parent->first_value) || current_node == root->next ){
-      if( current_node->parent->array_index > 1){
-        PRINT_SPACES(depth*indent);
-      }
-      PRINT_CHAR('{');
-      PRINT_NEWLINE;
-      depth++;
+static int xml_eachNext(sqlite3_vtab_cursor *pCursor){
+  xml_each_cursor cur = (xml_each_cursor)pCursor;
+  xml_tokenizer t = &cur->t;
+  struct xml_tokenizer peek;
+  int folded;
+  int type;
+  
+  if( cur->skip ){
+    cur->skip = 0;
+    if( xml_token_skip(t)==XML_EOF ){
+      cur->eof = 1;
+      return SQLITE_OK;
     }
-    
-    // Node name
-    if( current_node->array_index <= 1 ){
-      PRINT_SPACES(depth*indent);
-      PRINT_CHAR('"');
-      PRINT_STRING(current_node->name, current_node->nName);
-      PRINT_CHAR('"');
-      PRINT_CHAR(':');
-      PRINT_SPACES(indent < 0 ? 0 : 1);
+  }
+  
+  for(;;){
+    type = xml_token_next(t);
+    if( type==XML_EOF || t->depth<cur->root_depth ){
+      cur->eof = 1;
+      return SQLITE_OK;
     }
-    
-    // Attributes
-    current_attr = current_node->first_attr;
-    if( current_attr ){
-      
-      if( current_node->array_index == 1 ){
-        depth++;
-        PRINT_CHAR('[');
-        PRINT_NEWLINE;
+    if( type==XML_CLOSE ){
+      cur->nFrame = t->depth - cur->root_depth + 1;
+      continue;
+    }
+    if( type==XML_TEXT && cur->aFrame[cur->nFrame-1].folded )
+      continue;
+    break;
+  }
+  
+  cur->iRowid++;
+  cur->type = type;
+  cur->key = t->name;
+  cur->nKey = t->nName;
+  cur->val = t->val;
+  cur->nVal = t->nVal;
+  cur->index = 0;
+  if( type!=XML_ATTR && xml_each_index(cur)!=SQLITE_OK )
+    return SQLITE_NOMEM;
+  if( type!=XML_OPEN )
+    return SQLITE_OK;
+  
+  // An element with only text has the text as its value
+  peek = *t;
+  while( (type = xml_token_next(&peek))==XML_ATTR );
+  if( type==XML_TEXT ){
+    cur->val = peek.val;
+    cur->nVal = peek.nVal;
+    type = xml_token_next(&peek);
+  }
+  folded = type==XML_CLOSE;
+  if( !folded )
+    cur->val = 0;
+  
+  if( !cur->is_tree ){
+    cur->skip = 1;
+    return SQLITE_OK;
+  }
+  return xml_each_push(cur, folded);
+}
+
+static int xml_eachEof(sqlite3_vtab_cursor *pCursor){
+  return ((xml_each_cursor)pCursor)->eof;
+}
+
+static int xml_eachColumn(
+  sqlite3_vtab_cursor *pCursor,
+  sqlite3_context *ctx,
+  int i
+){
+  xml_each_cursor cur = (xml_each_cursor)pCursor;
+  xml_each_frame parent = &cur->aFrame[cur->nFrame-1];
+  char *z;
+  int n;
+  
+  // An element's own frame has already been pushed
+  if( cur->is_tree && cur->type==XML_OPEN )
+    parent--;
+  
+  switch( i ){
+    case XML_EACH_KEY:
+      if( cur->type==XML_TEXT ){
+        sqlite3_result_text(ctx, "#text", 5, SQLITE_STATIC);
+      }else if( cur->type==XML_ATTR ){
+        z = sqlite3_mprintf("@%.*s", cur->nKey, cur->key);
+        sqlite3_result_text(ctx, z, -1, sqlite3_free);
+      }else{
+        sqlite3_result_text(ctx, cur->key, cur->nKey, SQLITE_TRANSIENT);
       }
-      
-      if( current_node->array_index ){
-        PRINT_SPACES(depth*indent);
+      break;
+    case XML_EACH_VALUE:
+      if( !cur->val )
+        break;
+      if( cur->nVal==0 ){
+        sqlite3_result_text(ctx, "", 0, SQLITE_STATIC);
+        break;
       }
-      
-      PRINT_CHAR('{');
-      PRINT_NEWLINE;
-      depth++;
-      
-      while(current_attr){
-        // "@name":"value",
-        PRINT_SPACES(depth*indent);
-        PRINT_CHAR('"');
-        PRINT_CHAR('@');
-        PRINT_STRING(current_attr->name, current_attr->nName);
-        PRINT_CHAR('"');
-        PRINT_CHAR(':');
-        PRINT_SPACES(indent < 0 ? 0 : 1);
-
-        // Join value parts
-        PRINT_CHAR('"');
-        current_value_part = current_attr->first_value_part;
-        while( current_value_part ){
-          PRINT_STRING(current_value_part->val, current_value_part->nVal);
-          current_value_part = current_value_part->next_value_part;
-        }
-        PRINT_CHAR('"');
-
-        current_attr = current_attr->next_attr;
-        
-        if( current_attr || current_node->first_value || current_node->is_parent ){
-          PRINT_CHAR(',');
-          PRINT_NEWLINE;
+      if( cur->nVal>cur->nValueAlloc ){
+        z = sqlite3_realloc(cur->zValue, cur->nVal);
+        if( !z ){
+          sqlite3_result_error_nomem(ctx);
+          break;
         }
+        cur->zValue = z;
+        cur->nValueAlloc = cur->nVal;
       }
-      
-      if( !current_node->first_value && !current_node->is_parent ){
-        depth--;
-        PRINT_NEWLINE;
-        PRINT_SPACES(depth*indent);
-        PRINT_CHAR('}');
+      n = xml_decode(cur->val, cur->nVal, cur->zValue);
+      sqlite3_result_text(ctx, cur->zValue, n, SQLITE_TRANSIENT);
+      break;
+    case XML_EACH_TYPE:
+      sqlite3_result_text(ctx, cur->type==XML_OPEN ? "element" : cur->type==XML_ATTR ? "attribute" : "text", -1, SQLITE_STATIC);
+      break;
+    case XML_EACH_ID:
+      sqlite3_result_int64(ctx, cur->iRowid);
+      break;
+    case XML_EACH_PARENT:
+      if( parent->id )
+        sqlite3_result_int64(ctx, parent->id);
+      break;
+    case XML_EACH_FULLKEY:
+      z = sqlite3_malloc(parent->nPath + cur->nKey + 30);
+      if( !z ){
+        sqlite3_result_error_nomem(ctx);
+        break;
       }
+      memcpy(z, cur->zPath, parent->nPath);
+      n = parent->nPath + xml_each_key(cur, &z[parent->nPath]);
+      sqlite3_result_text(ctx, z, n, sqlite3_free);
+      break;
+    case XML_EACH_PATH:
+      sqlite3_result_text(ctx, cur->zPath, parent->nPath, SQLITE_TRANSIENT);
+      break;
+  }
+  return SQLITE_OK;
+}
+
+static int xml_eachRowid(sqlite3_vtab_cursor *pCursor, sqlite_int64 *pRowid){
+  *pRowid = ((xml_each_cursor)pCursor)->iRowid;
+  return SQLITE_OK;
+}
+
+//
+// The XML argument is required, and the root path is optional. idxNum
+// is 0 without the XML, 1 with just the XML, and 3 with both.
+//
+static int xml_eachBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo){
+  const struct sqlite3_index_constraint *pConstraint;
+  int aIdx[2] = {-1, -1};
+  int unusable = 0;
+  int idxMask = 0;
+  int iCol;
+  int i;
+  
+  (void)tab;
+  pConstraint = pIdxInfo->aConstraint;
+  for(i=0; i<pIdxInfo->nConstraint; i++, pConstraint++){
+    if( pConstraint->iColumn<XML_EACH_XML ) continue;
+    iCol = pConstraint->iColumn - XML_EACH_XML;
+    if( !pConstraint->usable ){
+      unusable |= 1<<iCol;
+    }else if( pConstraint->op==SQLITE_INDEX_CONSTRAINT_EQ ){
+      aIdx[iCol] = i;
+      idxMask |= 1<<iCol;
     }
-    
-    // #text
-    if( current_node->first_value && (current_node->first_attr || current_node->is_parent) ){
-      if( current_node->array_index ){
-        PRINT_SPACES(depth*indent);
-      }
-      if( current_node->is_parent && !current_node->first_attr ){
-        PRINT_CHAR('{');
-        PRINT_NEWLINE;
-        depth++;
-      }
-      if( !(current_node->first_attr && current_node->array_index ) ){
-        PRINT_SPACES(depth*indent);
-      }
-      PRINT_STRING("\"#text\":", 8);
-      PRINT_SPACES(indent < 0 ? 0 : 1);
-      
-      // Array of values
-      if( current_node->first_value->next_value ){
-        PRINT_CHAR('[');
-        PRINT_NEWLINE;
-        current_value = current_node->first_value;
-        
-        while( current_value ){
-          PRINT_SPACES((depth+1)*indent);
-          
-          // Join value parts
-          PRINT_CHAR('"');
-          current_value_part = current_value->first_value_part;
-          while( current_value_part ){
-            PRINT_STRING(current_value_part->val, current_value_part->nVal);
-            current_value_part = current_value_part->next_value_part;
-          }
-          PRINT_CHAR('"');
+  }
+  if( unusable & ~idxMask )
+    return SQLITE_CONSTRAINT;
+  
+  if( aIdx[0]<0 ){
+    pIdxInfo->idxNum = 0;
+    pIdxInfo->estimatedCost = 1e99;
+  }else{
+    pIdxInfo->estimatedCost = 1.0;
+    pIdxInfo->aConstraintUsage[aIdx[0]].argvIndex = 1;
+    pIdxInfo->aConstraintUsage[aIdx[0]].omit = 1;
+    if( aIdx[1]<0 ){
+      pIdxInfo->idxNum = 1;
+    }else{
+      pIdxInfo->aConstraintUsage[aIdx[1]].argvIndex = 2;
+      pIdxInfo->aConstraintUsage[aIdx[1]].omit = 1;
+      pIdxInfo->idxNum = 3;
+    }
+  }
+  return SQLITE_OK;
+}
+
+static int xml_eachFilter(
+  sqlite3_vtab_cursor *pCursor,
+  int idxNum, const char *idxStr,
+  int argc, sqlite3_value **argv
+){
+  xml_each_cursor cur = (xml_each_cursor)pCursor;
+  const char *zRoot = "$";
+  xml_path path;
+  int found;
+  int nomem = 0;
+  int n;
+  
+  (void)idxStr;
+  (void)argc;
+  sqlite3_free(cur->xml);
+  cur->xml = 0;
+  cur->eof = 1;
+  cur->skip = 0;
+  cur->iRowid = 0;
+  if( idxNum==0 || sqlite3_value_type(argv[0])==SQLITE_NULL )
+    return SQLITE_OK;
+  if( idxNum==3 ){
+    if( sqlite3_value_type(argv[1])==SQLITE_NULL )
+      return SQLITE_OK;
+    zRoot = (const char *)sqlite3_value_text(argv[1]);
+  }
+  
+  path = xml_path_compile(zRoot, &nomem);
+  if( !path && nomem )
+    return SQLITE_NOMEM;
+  if( !path ){
+    sqlite3_free(cur->base.pVtab->zErrMsg);
+    cur->base.pVtab->zErrMsg = sqlite3_mprintf("bad XML path: %s", zRoot);
+    return SQLITE_ERROR;
+  }
+  
+  // Copy the XML, which only lasts until the next call
+  n = sqlite3_value_bytes(argv[0]);
+  cur->xml = sqlite3_malloc(n+1);
+  if( !cur->xml ){
+    sqlite3_free(path);
+    return SQLITE_NOMEM;
+  }
+  memcpy(cur->xml, sqlite3_value_text(argv[0]), n+1);
+  xml_token_init(&cur->t, cur->xml, n);
+  
+  // Find the root element
+  found = 1;
+  if( path->nStep ){
+    found = path->aStep[path->nStep-1].type==XML_OPEN
+         && xml_path_find(&cur->t, path, path->nStep);
+  }
+  sqlite3_free(path);
+  if( !found )
+    return SQLITE_OK;
+  
+  if( cur->nFrameAlloc==0 ){
+    cur->aFrame = sqlite3_malloc(8*sizeof(struct xml_each_frame));
+    if( !cur->aFrame ) return SQLITE_NOMEM;
+    memset(cur->aFrame, 0, 8*sizeof(struct xml_each_frame));
+    cur->nFrameAlloc = 8;
+  }
+  n = strlen(zRoot);
+  if( n>cur->nPathAlloc ){
+    sqlite3_free(cur->zPath);
+    cur->zPath = sqlite3_malloc(2*n);
+    if( !cur->zPath ) return SQLITE_NOMEM;
+    cur->nPathAlloc = 2*n;
+  }
+  memcpy(cur->zPath, zRoot, n);
+  cur->nFrame = 1;
+  cur->aFrame[0].id = 0;
+  cur->aFrame[0].nPath = n;
+  cur->aFrame[0].folded = 0;
+  cur->aFrame[0].nName = 0;
+  cur->root_depth = cur->t.depth;
+  cur->eof = 0;
+  
+  return xml_eachNext(pCursor);
+}
+
+static sqlite3_module xml_eachModule = {
+  0,                         /* iVersion */
+  0,                         /* xCreate */
+  xml_eachConnect,           /* xConnect */
+  xml_eachBestIndex,         /* xBestIndex */
+  xml_eachDisconnect,        /* xDisconnect */
+  0,                         /* xDestroy */
+  xml_eachOpenEach,          /* xOpen - open a cursor */
+  xml_eachClose,             /* xClose - close a cursor */
+  xml_eachFilter,            /* xFilter - configure scan constraints */
+  xml_eachNext,              /* xNext - advance a cursor */
+  xml_eachEof,               /* xEof - check for end of scan */
+  xml_eachColumn,            /* xColumn - read data */
+  xml_eachRowid,             /* xRowid - read data */
+  0,                         /* xUpdate */
+  0,                         /* xBegin */
+  0,                         /* xSync */
+  0,                         /* xCommit */
+  0,                         /* xRollback */
+  0,                         /* xFindMethod */
+  0,                         /* xRename */
+  0,                         /* xSavepoint */
+  0,                         /* xRelease */
+  0,                         /* xRollbackTo */
+#if SQLITE_VERSION_NUMBER>=3026000
+  0,                         /* xShadowName */
+#endif
+#if SQLITE_VERSION_NUMBER>=3044000
+  0,                         /* xIntegrity */
+#endif
+};
+
+static sqlite3_module xml_treeModule = {
+  0,                         /* iVersion */
+  0,                         /* xCreate */
+  xml_eachConnect,           /* xConnect */
+  xml_eachBestIndex,         /* xBestIndex */
+  xml_eachDisconnect,        /* xDisconnect */
+  0,                         /* xDestroy */
+  xml_eachOpenTree,          /* xOpen - open a cursor */
+  xml_eachClose,             /* xClose - close a cursor */
+  xml_eachFilter,            /* xFilter - configure scan constraints */
+  xml_eachNext,              /* xNext - advance a cursor */
+  xml_eachEof,               /* xEof - check for end of scan */
+  xml_eachColumn,            /* xColumn - read data */
+  xml_eachRowid,             /* xRowid - read data */
+  0,                         /* xUpdate */
+  0,                         /* xBegin */
+  0,                         /* xSync */
+  0,                         /* xCommit */
+  0,                         /* xRollback */
+  0,                         /* xFindMethod */
+  0,                         /* xRename */
+  0,                         /* xSavepoint */
+  0,                         /* xRelease */
+  0,                         /* xRollbackTo */
+#if SQLITE_VERSION_NUMBER>=3026000
+  0,                         /* xShadowName */
+#endif
+#if SQLITE_VERSION_NUMBER>=3044000
+  0,                         /* xIntegrity */
+#endif
+};
+
+/*
+** Implementation of the xml_file virtual table.
+**
+** SELECT value FROM xml_file('orders.xml', '$.orders.order') returns a row
+** for each element at the record path, with its JSON, reading the file
+** with a record reader.
+**
+** Columns extracted from each record are declared when the table is
+** created, with paths applied to the record's XML in the same way as
+** xml_extract():
+**
+**   CREATE VIRTUAL TABLE orders USING xml_file(id '$.order.@id',
+**                                              city '$.order.customer.city');
+**   SELECT id, value FROM orders('orders.xml', '$.orders.order')
+**    WHERE city='Paris';
+**
+** Equality constraints on extracted columns are checked as each record is
+** read, before its JSON is made, and the JSON is only made if the value
+** column is read.
+*/
+#define XML_FILE_VALUE 0
+
+typedef struct xml_file_vtab *xml_file_vtab;
+struct xml_file_vtab{
+  sqlite3_vtab base;
+  int nCol;                             // Number of extracted columns
+  xml_path *aPath;                      // Path of each extracted column
+};
+
+typedef struct xml_file_cursor *xml_file_cursor;
+struct xml_file_cursor{
+  sqlite3_vtab_cursor base;
+  struct xml_reader reader;             // Record reader
+  int eof;                              // True at end of rows
+  sqlite3_int64 iRowid;                 // Record number
+  char *json;                           // JSON of current record, once read
+  xml_match aMatch;                     // Extracted columns of current record
+  char **azValue;                       // Values of extracted columns
+  int *aIsJson;                         // True for values that are JSON
+  char **azEq;                          // Values extracted columns must equal, or null
+};
+
+static int xml_fileDisconnect(sqlite3_vtab *pVtab){
+  xml_file_vtab p = (xml_file_vtab)pVtab;
+  int i;
+  
+  for(i=0; i<p->nCol; i++)
+    sqlite3_free(p->aPath[i]);
+  sqlite3_free(p->aPath);
+  sqlite3_free(p);
+  return SQLITE_OK;
+}
+
+//
+// xml_file_name
+//
+// Read the column name at the start of an extracted column argument. It is
+// either bare, ending at the first space or quote, or in double quotes with
+// any double quotes inside doubled. Sets *pn to the length of the name as
+// written, and returns it without quotes, or null if there is none. The
+// result must be freed.
+//
+static char *xml_file_name(char *z, int *pn){
+  char *zName;
+  int i, n;
+  
+  if( z[0]!='"' ){
+    for(n=0; z[n] && !is_space(&z[n]) && z[n]!='\''; n++);
+    *pn = n;
+    return n ? sqlite3_mprintf("%.*s", n, z) : 0;
+  }
+  zName = sqlite3_malloc(strlen(z));
+  if( !zName )
+    return 0;
+  for(i=1, n=0; z[i] && (z[i]!='"' || z[i+1]=='"'); i++){
+    if( z[i]=='"' )
+      i++;
+    zName[n++] = z[i];
+  }
+  if( z[i]!='"' || n==0 ){
+    sqlite3_free(zName);
+    return 0;
+  }
+  zName[n] = 0;
+  *pn = i+1;
+  return zName;
+}
 
-          current_value = current_value->next_value;
-          if( current_value ){
-            PRINT_CHAR(',');
-            PRINT_NEWLINE;
-          }else{
-            PRINT_NEWLINE;
-            PRINT_SPACES(depth*indent);
-            PRINT_CHAR(']');
-          }
-        }
-      }
+static int xml_fileConnect(
+  sqlite3 *db,
+  void *pAux,
+  int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab,
+  char **pzErr
+){
+  xml_file_vtab pNew;
+  sqlite3_str *pStr;
+  char *zSql;
+  char *zPath;
+  char *zName;
+  char *z;
+  int nName;
+  int nomem = 0;
+  int rc;
+  int i, j;
+  
+  (void)pAux;
+  pNew = sqlite3_malloc(sizeof(*pNew));
+  if( pNew==0 ) return SQLITE_NOMEM;
+  memset(pNew, 0, sizeof(*pNew));
+  if( argc>3 ){
+    pNew->aPath = sqlite3_malloc((argc-3)*sizeof(xml_path));
+    if( !pNew->aPath ){
+      xml_fileDisconnect(&pNew->base);
+      return SQLITE_NOMEM;
     }
-    
-    // Array start
-    if( current_node->array_index == 1 && !current_node->first_attr ){
-      depth++;
-      PRINT_CHAR('[');
-      PRINT_NEWLINE;
-      if( current_node->is_parent ){
-        PRINT_SPACES(depth*indent);
+  }
+  
+  // Extracted columns, each a name, which may be double quoted, followed by
+  // a quoted path
+  pStr = sqlite3_str_new(db);
+  sqlite3_str_appendall(pStr, "CREATE TABLE x(value");
+  for(i=3; i<argc; i++){
+    z = (char *)argv[i];
+    while( is_space(z) ) z++;
+    zName = xml_file_name(z, &nName);
+    j = nName;
+    while( zName && is_space(&z[j]) ) j++;
+    zPath = 0;
+    if( zName && z[j]=='\'' )
+      zPath = sqlite3_mprintf("%s", &z[j+1]);
+    if( zPath ){
+      // Remove the closing quote, and undouble quotes inside
+      for(j=0; zPath[j] && (zPath[j]!='\'' || zPath[j+1]=='\''); j++){
+        if( zPath[j]=='\'' )
+          memmove(&zPath[j], &zPath[j+1], strlen(&zPath[j]));
       }
+      zPath[j] = 0;
+      pNew->aPath[pNew->nCol] = xml_path_compile(zPath, &nomem);
+      sqlite3_free(zPath);
     }
-    
-    // null
-    if( !current_node->first_value && !current_node->is_parent && !current_node->first_attr ){
-      if( current_node->array_index ){
-        PRINT_SPACES(depth*indent); 
-      }
-      PRINT_STRING("null", 4);
+    if( !zPath || !pNew->aPath[pNew->nCol] ){
+      if( !nomem )
+        *pzErr = sqlite3_mprintf("bad xml_file column: %s", argv[i]);
+      sqlite3_free(zName);
+      sqlite3_free(sqlite3_str_finish(pStr));
+      xml_fileDisconnect(&pNew->base);
+      return nomem ? SQLITE_NOMEM : SQLITE_ERROR;
     }
-    
-    // Value
-    if( current_node->first_value && !current_node->first_value->next_value ){
-      if( current_node->array_index && !current_node->is_parent && !current_node->first_attr ){
-        PRINT_SPACES(depth*indent);
-      }
-      
-      // Join value parts
-      PRINT_CHAR('"');
-      current_value_part = current_node->first_value->first_value_part;
-      while( current_value_part ){
-        PRINT_STRING(current_value_part->val, current_value_part->nVal);
-        current_value_part = current_value_part->next_value_part;
-      }
-      PRINT_CHAR('"');
-      
-      if( current_node->first_attr && !current_node->is_parent ){
-        depth--;
-        PRINT_NEWLINE;
-        PRINT_SPACES(depth*indent);
-        PRINT_CHAR('}');
-      }
+    pNew->nCol++;
+    sqlite3_str_appendf(pStr, ",\"%w\"", zName);
+    sqlite3_free(zName);
+  }
+  sqlite3_str_appendall(pStr, ",path HIDDEN,record_path HIDDEN)");
+  
+  zSql = sqlite3_str_finish(pStr);
+  rc = zSql ? sqlite3_declare_vtab(db, zSql) : SQLITE_NOMEM;
+  sqlite3_free(zSql);
+  if( rc!=SQLITE_OK ){
+    xml_fileDisconnect(&pNew->base);
+    return rc;
+  }
+#ifdef SQLITE_VTAB_DIRECTONLY
+  sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+#endif
+  *ppVtab = &pNew->base;
+  return SQLITE_OK;
+}
+
+static int xml_fileOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor){
+  xml_file_vtab tab = (xml_file_vtab)p;
+  xml_file_cursor cur;
+  int nCol = tab->nCol;
+  
+  cur = sqlite3_malloc(sizeof(*cur));
+  if( cur==0 ) return SQLITE_NOMEM;
+  memset(cur, 0, sizeof(*cur));
+  cur->eof = 1;
+  cur->reader.iRecord = -1;
+  *ppCursor = &cur->base;
+  if( nCol==0 )
+    return SQLITE_OK;
+  
+  // Columns are kept in one allocation
+  cur->aMatch = sqlite3_malloc(nCol*(sizeof(struct xml_match) + 2*sizeof(char *) + sizeof(int)));
+  if( !cur->aMatch )
+    return SQLITE_NOMEM;
+  cur->azValue = (char **)&cur->aMatch[nCol];
+  cur->azEq = &cur->azValue[nCol];
+  cur->aIsJson = (int *)&cur->azEq[nCol];
+  memset(cur->azValue, 0, 2*nCol*sizeof(char *));
+  for(nCol--; nCol>=0; nCol--)
+    cur->aMatch[nCol].path = tab->aPath[nCol];
+  return SQLITE_OK;
+}
+
+// Free the current record
+static void xml_file_clear(xml_file_cursor cur){
+  xml_file_vtab tab = (xml_file_vtab)cur->base.pVtab;
+  int i;
+  
+  for(i=0; i<tab->nCol; i++){
+    sqlite3_free(cur->azValue[i]);
+    cur->azValue[i] = 0;
+  }
+  sqlite3_free(cur->json);
+  cur->json = 0;
+}
+
+// Close the file and free the current record
+static void xml_file_reset(xml_file_cursor cur){
+  xml_file_vtab tab = (xml_file_vtab)cur->base.pVtab;
+  int i;
+  
+  for(i=0; i<tab->nCol; i++){
+    sqlite3_free(cur->azEq[i]);
+    cur->azEq[i] = 0;
+  }
+  xml_file_clear(cur);
+  xml_reader_close(&cur->reader);
+  cur->eof = 1;
+  cur->iRowid = 0;
+}
+
+static int xml_fileClose(sqlite3_vtab_cursor *pCursor){
+  xml_file_cursor cur = (xml_file_cursor)pCursor;
+  
+  xml_file_reset(cur);
+  sqlite3_free(cur->aMatch);
+  sqlite3_free(cur);
+  return SQLITE_OK;
+}
+
+static int xml_fileNext(sqlite3_vtab_cursor *pCursor){
+  xml_file_cursor cur = (xml_file_cursor)pCursor;
+  xml_file_vtab tab = (xml_file_vtab)cur->base.pVtab;
+  char *zRecord;
+  int i;
+  
+  for(;;){
+    xml_file_clear(cur);
+    if( !xml_reader_next(&cur->reader) ){
+      cur->eof = 1;
+      if( cur->reader.error==XML_READER_NOMEM )
+        return SQLITE_NOMEM;
+      return cur->reader.error ? SQLITE_IOERR : SQLITE_OK;
     }
+    cur->iRowid++;
+    if( tab->nCol==0 )
+      return SQLITE_OK;
     
-    // Comma
-    if( (!current_node->is_last_child && !current_node->is_array_end && !current_node->is_parent) || (current_node->is_parent && current_node->first_value) ){
-      PRINT_CHAR(',');
-      PRINT_NEWLINE;
+    // Extracted columns, skipping records that do not match constraints
+    zRecord = &cur->reader.z[cur->reader.iRecord];
+    xml_extract_find(zRecord, cur->reader.nRecord, cur->aMatch, tab->nCol);
+    for(i=0; i<tab->nCol; i++){
+      cur->azValue[i] = xml_match_value(&cur->aMatch[i], &cur->aIsJson[i]);
+      if( cur->aMatch[i].nomem )
+        return SQLITE_NOMEM;
+      if( cur->azEq[i] && (!cur->azValue[i] || strcmp(cur->azValue[i], cur->azEq[i])!=0) )
+        break;
     }
-    
-    // Trailing brackets
-    if( (current_node->is_last_child || current_node->is_array_end ) && !current_node->is_parent ){
-      parent_node = current_node;
-      
-      while( parent_node != root && (!current_node->next || parent_node != current_node->next->parent) ){
-        if( parent_node->is_array_end ){
-          depth--;
-          PRINT_NEWLINE;
-          PRINT_SPACES(depth*indent);
-          PRINT_CHAR(']');
-          if( !parent_node->is_last_child ){
-            PRINT_CHAR(',');
-          }
-        }
-        
-        if( parent_node->is_last_child ){
-          depth--;
-          PRINT_NEWLINE;
-          PRINT_SPACES(depth*indent);
-          PRINT_CHAR('}');
-          if( !parent_node->parent->is_last_child && !parent_node->parent->is_array_end ){
-            PRINT_CHAR(',');
-          }
-        }
+    if( i==tab->nCol )
+      return SQLITE_OK;
+  }
+}
 
-        parent_node = parent_node->parent;
-      }
-      PRINT_NEWLINE;
+static int xml_fileEof(sqlite3_vtab_cursor *pCursor){
+  return ((xml_file_cursor)pCursor)->eof;
+}
+
+static int xml_fileColumn(
+  sqlite3_vtab_cursor *pCursor,
+  sqlite3_context *ctx,
+  int i
+){
+  xml_file_cursor cur = (xml_file_cursor)pCursor;
+  xml_file_vtab tab = (xml_file_vtab)cur->base.pVtab;
+  struct xml_options defaults;
+  struct xml_options opt;
+  struct xml_interrupt it;
+  
+  if( i==XML_FILE_VALUE ){
+    if( !cur->json ){
+      xml_options_init(&defaults, -1);
+      cur->json = xml_convert(&cur->reader.z[cur->reader.iRecord], cur->reader.nRecord,
+                              xml_interrupt_options(ctx, &defaults, &opt, &it));
+      if( !cur->json && xml_interrupted(opt.interrupt) )
+        return SQLITE_INTERRUPT;
+      if( !cur->json )
+        return opt.error ? SQLITE_NOMEM : SQLITE_OK;
     }
-    
+    sqlite3_result_text(ctx, cur->json, -1, SQLITE_TRANSIENT);
+    sqlite3_result_subtype(ctx, 'J');
+  }else if( i<=tab->nCol && cur->azValue[i-1] ){
+    sqlite3_result_text(ctx, cur->azValue[i-1], -1, SQLITE_TRANSIENT);
+    if( cur->aIsJson[i-1] )
+      sqlite3_result_subtype(ctx, 'J');
+  }
+  return SQLITE_OK;
+}
+
+static int xml_fileRowid(sqlite3_vtab_cursor *pCursor, sqlite_int64 *pRowid){
+  *pRowid = ((xml_file_cursor)pCursor)->iRowid;
+  return SQLITE_OK;
+}
+
+//
+// xml_fileBestIndex
+//
+// The path and record path are passed as the first two arguments of
+// xFilter. Equality constraints on extracted columns follow, with their
+// column numbers listed in idxStr. They are not omitted, as they are only
+// used to skip records early, and SQLite still checks them.
+//
+static int xml_fileBestIndex(sqlite3_vtab *pVtab, sqlite3_index_info *pIdxInfo){
+  xml_file_vtab tab = (xml_file_vtab)pVtab;
+  const struct sqlite3_index_constraint *pConstraint;
+  int aIdx[2] = {-1, -1};
+  int unusable = 0;
+  int idxMask = 0;
+  int nArg = 2;
+  sqlite3_str *pStr;
+  const char *zColl;
+  int iCol;
+  int i;
+  
+  pConstraint = pIdxInfo->aConstraint;
+  for(i=0; i<pIdxInfo->nConstraint; i++, pConstraint++){
+    if( pConstraint->iColumn<=tab->nCol ) continue;
+    iCol = pConstraint->iColumn - tab->nCol - 1;
+    if( !pConstraint->usable ){
+      unusable |= 1<<iCol;
+    }else if( pConstraint->op==SQLITE_INDEX_CONSTRAINT_EQ ){
+      aIdx[iCol] = i;
+      idxMask |= 1<<iCol;
+    }
+  }
+  if( unusable & ~idxMask )
+    return SQLITE_CONSTRAINT;
+  if( idxMask!=3 ){
+    pIdxInfo->idxNum = 0;
+    pIdxInfo->estimatedCost = 1e99;
+    return SQLITE_OK;
+  }
+  pIdxInfo->idxNum = 1;
+  pIdxInfo->estimatedCost = 1e6;
+  for(i=0; i<2; i++){
+    pIdxInfo->aConstraintUsage[aIdx[i]].argvIndex = i+1;
+    pIdxInfo->aConstraintUsage[aIdx[i]].omit = 1;
   }
   
-  return nJson;
+  // Equality constraints on extracted columns, compared as binary text
+  pStr = sqlite3_str_new(0);
+  pConstraint = pIdxInfo->aConstraint;
+  for(i=0; i<pIdxInfo->nConstraint; i++, pConstraint++){
+    if( pConstraint->iColumn<=XML_FILE_VALUE || pConstraint->iColumn>tab->nCol
+        || !pConstraint->usable || pConstraint->op!=SQLITE_INDEX_CONSTRAINT_EQ )
+      continue;
+    zColl = sqlite3_vtab_collation(pIdxInfo, i);
+    if( zColl && sqlite3_stricmp(zColl, "BINARY")!=0 )
+      continue;
+    pIdxInfo->aConstraintUsage[i].argvIndex = ++nArg;
+    sqlite3_str_appendf(pStr, "%d,", pConstraint->iColumn);
+    pIdxInfo->estimatedCost /= 10;
+  }
+  pIdxInfo->idxStr = sqlite3_str_finish(pStr);
+  pIdxInfo->needToFreeIdxStr = 1;
+  return SQLITE_OK;
 }
 
-#ifdef SQLITE
+static int xml_fileFilter(
+  sqlite3_vtab_cursor *pCursor,
+  int idxNum, const char *idxStr,
+  int argc, sqlite3_value **argv
+){
+  xml_file_cursor cur = (xml_file_cursor)pCursor;
+  const char *zFile;
+  const char *zRecord;
+  FILE *f;
+  int iCol;
+  int i;
+  
+  xml_file_reset(cur);
+  if( idxNum==0 || sqlite3_value_type(argv[0])==SQLITE_NULL
+      || sqlite3_value_type(argv[1])==SQLITE_NULL )
+    return SQLITE_OK;
+  
+  // Values that extracted columns must equal, if compared as text. They
+  // are copied, as argv only lasts until the next call.
+  for(i=2; i<argc && idxStr && *idxStr; i++){
+    iCol = atoi(idxStr);
+    if( sqlite3_value_type(argv[i])==SQLITE_TEXT ){
+      cur->azEq[iCol-1] = sqlite3_mprintf("%s", sqlite3_value_text(argv[i]));
+      if( !cur->azEq[iCol-1] )
+        return SQLITE_NOMEM;
+    }
+    idxStr = strchr(idxStr, ',') + 1;
+  }
+  
+  zFile = (const char *)sqlite3_value_text(argv[0]);
+  f = fopen(zFile, "rb");
+  if( !f ){
+    sqlite3_free(cur->base.pVtab->zErrMsg);
+    cur->base.pVtab->zErrMsg = sqlite3_mprintf("cannot open file: %s", zFile);
+    return SQLITE_ERROR;
+  }
+  
+  zRecord = (const char *)sqlite3_value_text(argv[1]);
+  if( !xml_reader_open(&cur->reader, f, zRecord) ){
+    xml_reader_close(&cur->reader);
+    sqlite3_free(cur->base.pVtab->zErrMsg);
+    cur->base.pVtab->zErrMsg = sqlite3_mprintf("bad record path: %s", zRecord);
+    return SQLITE_ERROR;
+  }
+  
+  cur->eof = 0;
+  return xml_fileNext(pCursor);
+}
+
+static sqlite3_module xml_fileModule = {
+  0,                         /* iVersion */
+  xml_fileConnect,           /* xCreate */
+  xml_fileConnect,           /* xConnect */
+  xml_fileBestIndex,         /* xBestIndex */
+  xml_fileDisconnect,        /* xDisconnect */
+  xml_fileDisconnect,        /* xDestroy */
+  xml_fileOpen,              /* xOpen - open a cursor */
+  xml_fileClose,             /* xClose - close a cursor */
+  xml_fileFilter,            /* xFilter - configure scan constraints */
+  xml_fileNext,              /* xNext - advance a cursor */
+  xml_fileEof,               /* xEof - check for end of scan */
+  xml_fileColumn,            /* xColumn - read data */
+  xml_fileRowid,             /* xRowid - read data */
+  0,                         /* xUpdate */
+  0,                         /* xBegin */
+  0,                         /* xSync */
+  0,                         /* xCommit */
+  0,                         /* xRollback */
+  0,                         /* xFindMethod */
+  0,                         /* xRename */
+  0,                         /* xSavepoint */
+  0,                         /* xRelease */
+  0,                         /* xRollbackTo */
+#if SQLITE_VERSION_NUMBER>=3026000
+  0,                         /* xShadowName */
+#endif
+#if SQLITE_VERSION_NUMBER>=3044000
+  0,                         /* xIntegrity */
+#endif
+};
+
 /*
-** Implementation of xml_to_json() function.
+** Implementation of the xml_group_json(X) aggregate function.
+**
+** Returns a JSON array of each row's XML converted to JSON, the same as
+** json_group_array(json(xml_to_json(X))), but each row is output straight
+** into the array, and the elements of each row are allocated from the same
+** arena, which is reset between rows.
 */
-static void xml_to_jsonFunc(
+typedef struct xml_group *xml_group_ctx;
+struct xml_group{
+  char *json;                           // JSON array so far
+  sqlite3_int64 nJson;                  // Length of json
+  sqlite3_int64 nAlloc;                 // Allocated size of json
+  struct arena arena;                   // Arena reused for each row
+  xml_options options;                  // Options of the first row
+  struct xml_options defaults;          // Options unless given as an object
+};
+
+static void xml_group_jsonStep(
   sqlite3_context *context,
   int argc,
   sqlite3_value **argv
 ){
-  if( sqlite3_value_type(argv[0])==SQLITE_NULL ) return;
-  int indent = -1;
-  char *xml = (char *)sqlite3_value_text(argv[0]);
+  xml_group_ctx g;
+  struct json_buffer out;
+  struct xml_options opt;
+  struct xml_interrupt it;
+  element root;
   char *json;
-	  
-  if( argc==2 ){
-    if( sqlite3_value_type(argv[1])!=SQLITE_NULL )
-      indent = sqlite3_value_int(argv[1]);
+  sqlite3_int64 nAlloc;
+  int is_new;
+  
+  g = sqlite3_aggregate_context(context, sizeof(struct xml_group));
+  if( !g ){
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  
+  // Options are taken from the first row
+  if( !g->options ){
+    g->options = xml_options_arg(context, argc==2 ? argv[1] : 0, 1, &g->defaults, &is_new);
+    if( !g->options )
+      return;
+  }
+  
+  root = 0;
+  memset(&out, 0, sizeof(out));
+  xml_interrupt_options(context, g->options, &opt, &it);
+  if( sqlite3_value_type(argv[0])!=SQLITE_NULL ){
+    arena_reset(&g->arena);
+    g->arena.interrupt = opt.interrupt;
+    root = xml_parse((char *)sqlite3_value_text(argv[0]), -1, 0, &g->arena);
+    g->arena.interrupt = 0;
+    if( !root && g->arena.nomem ){
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+    
+    // Rows that are not XML are null, as are empty documents
+    if( root ){
+      if( !opt.schema )
+        xml_group(root, 0, opt.interrupt);
+      else if( !xml_group_schema(root, opt.schema, opt.interrupt) ){
+        sqlite3_result_error_nomem(context);
+        return;
+      }
+      json_output(root, root->next, 0, &out, &opt);
+    }
+    if( xml_interrupted(opt.interrupt) ){
+      sqlite3_result_error_code(context, SQLITE_INTERRUPT);
+      return;
+    }
+  }
+  
+  // Room for a separator, null for an empty document, and the closing ']'
+  if( g->nJson + out.nJson + 6 > g->nAlloc ){
+    nAlloc = 2*(g->nJson + out.nJson + 6);
+    json = sqlite3_realloc64(g->json, nAlloc);
+    if( !json ){
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+    g->json = json;
+    g->nAlloc = nAlloc;
   }
   
-  json = xml_to_json(xml, indent);
+  g->json[g->nJson] = g->nJson ? ',' : '[';
+  g->nJson++;
+  if( out.nJson==0 ){
+    memcpy(&g->json[g->nJson], "null", 4);
+    g->nJson += 4;
+    return;
+  }
+  out.json = &g->json[g->nJson];
+  out.nJson = 0;
+  g->nJson += json_output(root, root->next, 0, &out, &opt);
+}
+
+static void xml_group_jsonFinal(sqlite3_context *context){
+  xml_group_ctx g = sqlite3_aggregate_context(context, 0);
+  
+  if( !g || !g->json ){
+    sqlite3_result_text(context, "[]", 2, SQLITE_STATIC);
+  }else{
+    g->json[g->nJson++] = ']';
+    sqlite3_result_text64(context, g->json, g->nJson, sqlite3_free, SQLITE_UTF8);
+    g->json = 0;
+  }
+  sqlite3_result_subtype(context, 'J');
+  if( g ){
+    arena_free(&g->arena);
+    if( g->options && g->options!=&g->defaults )
+      xml_options_free(g->options);
+  }
+}
+
+/*
+** Implementation of the xml_infer_schema(X) aggregate function.
+**
+** Returns a schema inferred from each row's XML, for the "schema" option,
+** e.g. SELECT xml_infer_schema(xml) FROM (SELECT xml FROM feed LIMIT 1000).
+*/
+static void xml_infer_schemaStep(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  xml_infer p;
+  (void)argc;
+  
+  p = sqlite3_aggregate_context(context, sizeof(struct xml_infer));
+  if( !p ){
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  if( sqlite3_value_type(argv[0])==SQLITE_NULL )
+    return;
+  if( xml_infer_add(p, (char *)sqlite3_value_text(argv[0]), sqlite3_value_bytes(argv[0])) )
+    sqlite3_result_error_nomem(context);
+}
+
+static void xml_infer_schemaFinal(sqlite3_context *context){
+  xml_infer p = sqlite3_aggregate_context(context, 0);
+  char *zSchema;
+  
+  if( !p || !p->nSample )
+    return;
+  zSchema = xml_infer_text(p);
+  if( zSchema )
+    sqlite3_result_text(context, zSchema, -1, sqlite3_free);
+  else
+    sqlite3_result_error_nomem(context);
+  xml_infer_free(p);
+}
+
+/*
+** Implementation of xml_to_jsonb(), xml_to_cbor() and xml_to_msgpack(),
+** which return a blob in a binary format made by xConvert.
+*/
+static void xml_encodeFunc(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv,
+  unsigned char *(*xConvert)(char*, xml_options, int*)
+){
+  struct xml_options defaults;
+  struct xml_options copy;
+  struct xml_interrupt it;
+  xml_options opt;
+  unsigned char *z;
+  int nByte;
+  int is_new;
+  
+  if( sqlite3_value_type(argv[0])==SQLITE_NULL ) return;
+  opt = xml_options_arg(context, argc==2 ? argv[1] : 0, 1, &defaults, &is_new);
+  if( !opt )
+    return;
+  
+  z = xConvert((char *)sqlite3_value_text(argv[0]), xml_interrupt_options(context, opt, &copy, &it), &nByte);
+  if( z )
+    sqlite3_result_blob(context, z, nByte, sqlite3_free);
+  else if( xml_interrupted(copy.interrupt) )
+    sqlite3_result_error_code(context, SQLITE_INTERRUPT);
+  else if( copy.error==XML_ERROR_TOOBIG )
+    sqlite3_result_error_toobig(context);
+  else if( copy.error )
+    sqlite3_result_error_nomem(context);
+  if( is_new )
+    sqlite3_set_auxdata(context, 1, opt, xml_options_free);
+}
+
+static void xml_to_jsonbFunc(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  xml_encodeFunc(context, argc, argv, xml_convert_jsonb);
+}
+
+static void xml_to_cborFunc(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  xml_encodeFunc(context, argc, argv, xml_convert_cbor);
+}
+
+static void xml_to_msgpackFunc(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  xml_encodeFunc(context, argc, argv, xml_convert_msgpack);
+}
+
+/*
+** The functions only depend on their arguments, so they are registered as
+** deterministic, which lets SQLite factor out constant calls and use them
+** in indexes on expressions, and innocuous, so they may be used in schemas
+** and views even with trusted_schema off.
+*/
+#ifndef SQLITE_INNOCUOUS
+# define SQLITE_INNOCUOUS 0
+#endif
+#define XML_FUNC_FLAGS (SQLITE_UTF8|SQLITE_DETERMINISTIC|SQLITE_INNOCUOUS)
+
+/*
+** The cache functions change and read the state of the connection, so they
+** may only be called from top-level SQL.
+*/
+#ifndef SQLITE_DIRECTONLY
+# define SQLITE_DIRECTONLY 0
+#endif
+#define XML_CACHE_FUNC_FLAGS (SQLITE_UTF8|SQLITE_DIRECTONLY)
+
+/*
+** Implementation of xml_well_formed(X) function.
+**
+** Returns 1 if X is well formed, otherwise 0, without converting it, so
+** rows can be filtered cheaply before they are converted.
+*/
+static void xml_well_formedFunc(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  const char *xml;
   
-  sqlite3_result_text(context, json, -1, sqlite3_free);
+  (void)argc;
+  if( sqlite3_value_type(argv[0])==SQLITE_NULL ) return;
+  xml = (const char *)sqlite3_value_text(argv[0]);
+  sqlite3_result_int(context, xml && xml_well_formed(xml, sqlite3_value_bytes(argv[0])));
 }
 
 #ifdef _WIN32
@@ -1069,14 +8951,89 @@ int sqlite3_xmltojson_init(
   const sqlite3_api_routines *pApi
 ){
   int rc = SQLITE_OK;
+  xml_cache cache;
   SQLITE_EXTENSION_INIT2(pApi);
   (void)pzErrMsg;  /* Unused parameter */
-  rc = sqlite3_create_function(db, "xml_to_json", 1, SQLITE_UTF8, 0,
-                               xml_to_jsonFunc, 0, 0);
+  
+  /* The result cache is shared by the functions registered with it, and
+  ** freed when the last of them is */
+  cache = sqlite3_malloc(sizeof(struct xml_cache));
+  if( !cache )
+    return SQLITE_NOMEM;
+  memset(cache, 0, sizeof(struct xml_cache));
+  cache->nRef = 1;
+  rc = xml_cache_resize(cache, XML_CACHE_SIZE);
+  if( rc==SQLITE_OK ){
+    cache->nRef++;
+    rc = sqlite3_create_function_v2(db, "xml_to_json", 1, XML_FUNC_FLAGS, cache,
+                                    xml_to_jsonFunc, 0, 0, xml_cache_release);
+  }
+  if( rc==SQLITE_OK ){
+    cache->nRef++;
+    rc = sqlite3_create_function_v2(db, "xml_to_json", 2, XML_FUNC_FLAGS, cache,
+                                    xml_to_jsonFunc, 0, 0, xml_cache_release);
+  }
+  if( rc==SQLITE_OK ){
+    cache->nRef++;
+    rc = sqlite3_create_function_v2(db, "xml_cache_size", 1, XML_CACHE_FUNC_FLAGS, cache,
+                                    xml_cache_sizeFunc, 0, 0, xml_cache_release);
+  }
+  if( rc==SQLITE_OK ){
+    cache->nRef++;
+    rc = sqlite3_create_function_v2(db, "xml_cache_stats", 0, XML_CACHE_FUNC_FLAGS, cache,
+                                    xml_cache_statsFunc, 0, 0, xml_cache_release);
+  }
+  xml_cache_release(cache);
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "xml_group_json", 1, XML_FUNC_FLAGS, 0,
+                                 0, xml_group_jsonStep, xml_group_jsonFinal);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "xml_group_json", 2, XML_FUNC_FLAGS, 0,
+                                 0, xml_group_jsonStep, xml_group_jsonFinal);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "xml_infer_schema", 1, XML_FUNC_FLAGS, 0,
+                                 0, xml_infer_schemaStep, xml_infer_schemaFinal);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "xml_to_jsonb", 1, XML_FUNC_FLAGS, 0,
+                                 xml_to_jsonbFunc, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "xml_to_jsonb", 2, XML_FUNC_FLAGS, 0,
+                                 xml_to_jsonbFunc, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "xml_to_cbor", 1, XML_FUNC_FLAGS, 0,
+                                 xml_to_cborFunc, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "xml_to_cbor", 2, XML_FUNC_FLAGS, 0,
+                                 xml_to_cborFunc, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "xml_to_msgpack", 1, XML_FUNC_FLAGS, 0,
+                                 xml_to_msgpackFunc, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "xml_to_msgpack", 2, XML_FUNC_FLAGS, 0,
+                                 xml_to_msgpackFunc, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "xml_extract", -1, XML_FUNC_FLAGS, 0,
+                                 xml_extractFunc, 0, 0);
+  }
   if( rc==SQLITE_OK ){
-    rc = sqlite3_create_function(db, "xml_to_json", 2, SQLITE_UTF8, 0,
-                                 xml_to_jsonFunc, 0, 0);
+    rc = sqlite3_create_function(db, "xml_well_formed", 1, XML_FUNC_FLAGS, 0,
+                                 xml_well_formedFunc, 0, 0);
   }
+  if( rc==SQLITE_OK )
+    rc = sqlite3_create_module(db, "xml_each", &xml_eachModule, 0);
+  if( rc==SQLITE_OK )
+    rc = sqlite3_create_module(db, "xml_tree", &xml_treeModule, 0);
+  if( rc==SQLITE_OK )
+    rc = sqlite3_create_module(db, "xml_file", &xml_fileModule, 0);
   return rc;
 }
 #endif